@@ -1,19 +1,20 @@
 #include "Audio.hpp"
 #include "Memory.hpp"
 #include "Common.hpp"
+#include "SaveState.hpp"
 
-#include <SDL.h>
 #include <cassert>
 #include <iostream>
 #include <vector>
 #include <queue>
 #include <cstring>
+#include <cmath>
 #include <atomic>
+#include <algorithm>
 
 constexpr uint32_t HALF_CLOCK_RATE = CLOCK_RATE / 2;
-constexpr uint32_t OUTPUT_FREQ = 65536;
-constexpr uint32_t CLOCKS_PER_SAMPLE = HALF_CLOCK_RATE / OUTPUT_FREQ;
-constexpr uint32_t SEQUENCER_FREQ = 512;
+constexpr uint32_t CLOCKS_PER_SAMPLE = HALF_CLOCK_RATE / AUDIO_OUTPUT_FREQ;
+static_assert(AUDIO_SEQUENCER_CLOCKS == HALF_CLOCK_RATE / 512);
 constexpr uint32_t C1_C2_FREQ = 131072;
 constexpr uint32_t C3_FREQ = 65536;
 constexpr uint32_t C4_FREQ = 524288;
@@ -26,54 +27,43 @@ static const int SQUARE_WAVE_PATTERNS[4][8] =
 	{ -1, -1, -1, -1, -1, -1, 1, 1 }
 };
 
-bool audioActive = false;
-int audioDeviceId;
+thread_local APU* apu;
 
-AudioRegisterState audioReg;
+thread_local AudioQueue* audioQueue;
 
-static constexpr size_t REG_QUEUE_LEN = 32768;
-static AudioRegisterState regStateQueue[REG_QUEUE_LEN];
-static std::atomic_uint32_t regStateQueueFront;
-static std::atomic_uint32_t regStateQueueBack;
+static constexpr uint32_t MAX_QUEUED_CLOCKS = 32768;
 
-inline const AudioRegisterState& PopRegisterState()
+inline const AudioRegisterState& PopRegisterState(AudioQueue& queue)
 {
-	static AudioRegisterState regState;
-	
-	uint32_t front = regStateQueueFront.load(std::memory_order_acquire);
-	uint32_t back = regStateQueueBack.load(std::memory_order_relaxed);
-	
-	if (back != front)
+	if (queue.clocksLeft == 0)
 	{
-		regState = regStateQueue[back];
-		regStateQueueBack.store((back + 1) % REG_QUEUE_LEN, std::memory_order_release);
+		uint32_t front = queue.front.load(std::memory_order_acquire);
+		uint32_t back = queue.back.load(std::memory_order_relaxed);
+		
+		if (back != front)
+		{
+			queue.current = queue.entries[back].state;
+			queue.clocksLeft = queue.entries[back].clocks;
+			queue.queuedClocks.fetch_sub(queue.clocksLeft, std::memory_order_relaxed);
+			queue.back.store((back + 1) % AudioQueue::LENGTH, std::memory_order_release);
+		}
 	}
 	
-	return regState;
+	if (queue.clocksLeft > 0)
+		queue.clocksLeft--;
+	return queue.current;
 }
 
-struct ChannelData
+//Channels by their number, 1 to 4
+static ChannelData& Channel(int index)
 {
-	uint32_t volSweepTimer = 0;
-	uint32_t timer = 0;
-	uint32_t pos = 0;
-	uint32_t lengthCounter = 0;
-};
-
-ChannelData channel1;
-ChannelData channel2;
-ChannelData channel3;
-ChannelData channel4;
-ChannelData* channels[] = { nullptr, &channel1, &channel2, &channel3, &channel4 };
-
-uint32_t channel1FreqSweepSteps = 0;
-
-uint32_t seqStep;
-int seqTimer;
+	ChannelData* const channels[] = { &apu->channel1, &apu->channel2, &apu->channel3, &apu->channel4 };
+	return *channels[index - 1];
+}
 
 void SetAudioChannelLen(int channel, uint32_t length)
 {
-	channels[channel]->lengthCounter = (channel == 3 ? 256 : 64) - length;
+	Channel(channel).lengthCounter = (channel == 3 ? 256 : 64) - length;
 }
 
 uint32_t GetChannelFrequency(uint8_t regLo, uint8_t regHi)
@@ -99,7 +89,7 @@ inline void UpdateChannelElapsed(ChannelData& channel, uint8_t enableReg, int ch
 		channel.lengthCounter--;
 		if (channel.lengthCounter == 0)
 		{
-			audioReg.NR52 &= ~(uint8_t)(1 << channelIdx);
+			apu->reg.NR52 &= ~(uint8_t)(1 << channelIdx);
 		}
 	}
 }
@@ -120,37 +110,35 @@ inline void UpdateChannelVolume(ChannelData& channel, uint8_t& volume, uint8_t r
 	}
 }
 
-uint16_t channel4LFSR = 0;
-
-std::pair<double, double> GenerateClockSample(const AudioRegisterState& reg)
+std::pair<double, double> GenerateClockSample(AudioQueue& queue, const AudioRegisterState& reg)
 {
-	if (!(reg.NR52 & (1 << 7)) || audioDeviceId == 0)
+	if (!(reg.NR52 & (1 << 7)))
 	{
-		channel1.pos = 0;
-		channel2.pos = 0;
-		channel3.pos = 0;
+		queue.channel1.pos = 0;
+		queue.channel2.pos = 0;
+		queue.channel3.pos = 0;
 		return { 0.0, 0.0 };
 	}
 	
 	if (reg.NR14 & NRX4_RESET)
 	{
-		channel1.timer = 1;
-		channel1.pos = 0;
+		queue.channel1.timer = 1;
+		queue.channel1.pos = 0;
 	}
 	if (reg.NR24 & NRX4_RESET)
 	{
-		channel2.timer = 1;
-		channel2.pos = 0;
+		queue.channel2.timer = 1;
+		queue.channel2.pos = 0;
 	}
 	if (reg.NR34 & NRX4_RESET)
 	{
-		channel3.timer = 1;
-		channel3.pos = 0;
+		queue.channel3.timer = 1;
+		queue.channel3.pos = 0;
 	}
 	if (reg.NR44 & NRX4_RESET)
 	{
-		channel4.timer = 1;
-		channel4LFSR = 0x7fff;
+		queue.channel4.timer = 1;
+		queue.channel4LFSR = 0x7fff;
 	}
 	
 	uint8_t channelPan = reg.NR51;
@@ -168,7 +156,7 @@ std::pair<double, double> GenerateClockSample(const AudioRegisterState& reg)
 	{
 		const uint32_t c1Pattern = reg.NR11 >> 6;
 		const double c1Vol =
-			SQUARE_WAVE_PATTERNS[c1Pattern][channel1.pos] *
+			SQUARE_WAVE_PATTERNS[c1Pattern][queue.channel1.pos] *
 			(int)reg.channel1Volume *
 			(MAX_PER_CHANNEL / (CLOCKS_PER_SAMPLE * 16.0));
 		
@@ -183,7 +171,7 @@ std::pair<double, double> GenerateClockSample(const AudioRegisterState& reg)
 	{
 		const uint32_t c2Pattern = reg.NR21 >> 6;
 		const double c2Vol =
-			SQUARE_WAVE_PATTERNS[c2Pattern][channel2.pos] *
+			SQUARE_WAVE_PATTERNS[c2Pattern][queue.channel2.pos] *
 			(int)reg.channel2Volume *
 			(MAX_PER_CHANNEL / (CLOCKS_PER_SAMPLE * 16.0));
 		
@@ -199,7 +187,7 @@ std::pair<double, double> GenerateClockSample(const AudioRegisterState& reg)
 		uint32_t c3Volume = (reg.NR32 >> 5) & 3;
 		if (c3Volume != 0)
 		{
-			uint8_t c3Sample = (reg.waveMem[channel3.pos / 2] >> ((channel3.pos % 2) ? 0 : 4)) & 0xF;
+			uint8_t c3Sample = (reg.waveMem[queue.channel3.pos / 2] >> ((queue.channel3.pos % 2) ? 0 : 4)) & 0xF;
 			c3Sample >>= (c3Volume - 1);
 			if (channelPan & CPAN_3L)
 				sampleL += c3Sample * volL * (MAX_PER_CHANNEL / (CLOCKS_PER_SAMPLE * 8)) - MAX_PER_CHANNEL / 2;
@@ -212,7 +200,7 @@ std::pair<double, double> GenerateClockSample(const AudioRegisterState& reg)
 	if ((reg.NR52 & 8) && reg.channel4Volume > 0 && false) //Channel disabled because it doesn't work
 	{
 		const double c4Vol =
-			(1 - 2 * (int)(channel4LFSR & 1)) *
+			(1 - 2 * (int)(queue.channel4LFSR & 1)) *
 			(int)reg.channel4Volume *
 			(MAX_PER_CHANNEL / (CLOCKS_PER_SAMPLE * 16.0));
 		
@@ -222,36 +210,36 @@ std::pair<double, double> GenerateClockSample(const AudioRegisterState& reg)
 			sampleR += c4Vol * volR;
 	}
 	
-	if (channel1.timer-- == 0)
+	if (queue.channel1.timer-- == 0)
 	{
-		channel1.timer = (HALF_CLOCK_RATE / (C1_C2_FREQ * 8)) * (2048 - reg.channel1Freq);
-		channel1.pos = (channel1.pos + 1) % 8;
+		queue.channel1.timer = (HALF_CLOCK_RATE / (C1_C2_FREQ * 8)) * (2048 - reg.channel1Freq);
+		queue.channel1.pos = (queue.channel1.pos + 1) % 8;
 	}
 	
-	if (channel2.timer-- == 0)
+	if (queue.channel2.timer-- == 0)
 	{
 		uint32_t freq = GetChannelFrequency(reg.NR23, reg.NR24);
-		channel2.timer = (HALF_CLOCK_RATE / (C1_C2_FREQ * 8)) * (2048 - freq);
-		channel2.pos = (channel2.pos + 1) % 8;
+		queue.channel2.timer = (HALF_CLOCK_RATE / (C1_C2_FREQ * 8)) * (2048 - freq);
+		queue.channel2.pos = (queue.channel2.pos + 1) % 8;
 	}
 	
-	if (channel3.timer-- == 0)
+	if (queue.channel3.timer-- == 0)
 	{
 		uint32_t freq = GetChannelFrequency(reg.NR33, reg.NR34);
-		channel3.timer = (HALF_CLOCK_RATE / (C3_FREQ * 32)) * (2048 - freq);
-		channel3.pos = (channel3.pos + 1) % 32;
+		queue.channel3.timer = (HALF_CLOCK_RATE / (C3_FREQ * 32)) * (2048 - freq);
+		queue.channel3.pos = (queue.channel3.pos + 1) % 32;
 	}
 	
-	if (channel4.timer-- == 0)
+	if (queue.channel4.timer-- == 0)
 	{
-		uint16_t nextLFSR = channel4LFSR >> 1;
-		uint16_t x = (channel4LFSR & 1) ^ (nextLFSR & 1);
+		uint16_t nextLFSR = queue.channel4LFSR >> 1;
+		uint16_t x = (queue.channel4LFSR & 1) ^ (nextLFSR & 1);
 		if (reg.NR43 & 8)
 			nextLFSR = (nextLFSR & 0x3F) | (x << 6);
 		nextLFSR |= x << 14;
-		channel4LFSR = nextLFSR;
+		queue.channel4LFSR = nextLFSR;
 		
-		channel4.timer = ((HALF_CLOCK_RATE / C4_FREQ) * (uint32_t)(reg.NR43 & 7)) >> ((reg.NR43 >> 4) + 1);
+		queue.channel4.timer = ((HALF_CLOCK_RATE / C4_FREQ) * (uint32_t)(reg.NR43 & 7)) >> ((reg.NR43 >> 4) + 1);
 	}
 	
 	return std::make_pair(sampleL, sampleR);
@@ -262,7 +250,7 @@ inline int8_t SampleToU8(double sample)
 	return std::max(std::min((int)std::round(sample), 127), -127);
 }
 
-void AudioCallback(void* userData, uint8_t* stream, int len)
+void MixAudio(AudioQueue& queue, int8_t* stream, int len)
 {
 	for (int s = 0; s < len; s += 2)
 	{
@@ -271,166 +259,232 @@ void AudioCallback(void* userData, uint8_t* stream, int len)
 		
 		for (size_t c = 0; c < CLOCKS_PER_SAMPLE; c++)
 		{
-			auto [genL, genR] = GenerateClockSample(PopRegisterState());
+			auto [genL, genR] = GenerateClockSample(queue, PopRegisterState(queue));
 			sampleL += genL;
 			sampleR += genR;
 		}
 		
-		reinterpret_cast<int8_t*>(stream)[s + 0] = SampleToU8(sampleL);
-		reinterpret_cast<int8_t*>(stream)[s + 1] = SampleToU8(sampleR);
+		stream[s + 0] = SampleToU8(sampleL);
+		stream[s + 1] = SampleToU8(sampleR);
 	}
 }
 
-void InitAudio()
+uint32_t QueuedAudioSamples(const AudioQueue& queue)
 {
-	SDL_AudioSpec audioSpec = { };
-	audioSpec.freq = OUTPUT_FREQ;
-	audioSpec.callback = AudioCallback;
-	audioSpec.channels = 2;
-	audioSpec.samples = 4096;
-	audioSpec.format = AUDIO_S8;
+	return (queue.queuedClocks.load(std::memory_order_acquire) + queue.clocksLeft) / CLOCKS_PER_SAMPLE;
+}
+
+static void PushRegisterState(uint32_t clocks)
+{
+	AudioQueue& queue = *audioQueue;
+	uint32_t queued = queue.queuedClocks.load(std::memory_order_relaxed);
+	if (queued >= MAX_QUEUED_CLOCKS)
+		return;
+	clocks = std::min(clocks, MAX_QUEUED_CLOCKS - queued);
 	
-	SDL_AudioSpec realAudioSpec;
-	audioDeviceId = SDL_OpenAudioDevice(nullptr, 0, &audioSpec, &realAudioSpec, 0);
-	if (audioDeviceId == 0 || realAudioSpec.freq != OUTPUT_FREQ)
+	uint32_t queueBack = queue.back.load(std::memory_order_acquire);
+	uint32_t queueFront = queue.front.load(std::memory_order_relaxed);
+	uint32_t nextQueueFront = (queueFront + 1) % AudioQueue::LENGTH;
+	if (nextQueueFront != queueBack)
 	{
-		std::cout << SDL_GetError() << std::endl;
-		return;
+		queue.entries[queueFront].state = apu->reg;
+		queue.entries[queueFront].clocks = clocks;
+		queue.queuedClocks.fetch_add(clocks, std::memory_order_relaxed);
+		queue.front.store(nextQueueFront, std::memory_order_release);
+	}
+}
+
+void SaveAudioState(state::Writer& writer)
+{
+	writer.Write(apu->reg);
+	for (int i = 1; i <= 4; i++)
+	{
+		writer.Write(Channel(i).volSweepTimer);
+		writer.Write(Channel(i).lengthCounter);
+	}
+	writer.Write(apu->channel1FreqSweepSteps);
+	writer.Write(apu->seqStep);
+	writer.Write(apu->lengthClockWasEnabled);
+}
+
+void LoadAudioState(state::Reader& reader)
+{
+	reader.Read(apu->reg);
+	for (int i = 1; i <= 4; i++)
+	{
+		reader.Read(Channel(i).volSweepTimer);
+		reader.Read(Channel(i).lengthCounter);
+	}
+	reader.Read(apu->channel1FreqSweepSteps);
+	reader.Read(apu->seqStep);
+	reader.Read(apu->lengthClockWasEnabled);
+}
+
+size_t AudioMemoryFootprint()
+{
+	return sizeof(AudioQueue::entries);
+}
+
+void SetAudioSpeed(double speed)
+{
+	apu->audioSpeed = (uint32_t)std::clamp<long>(std::lround(speed * AUDIO_SPEED_ONE), 1, 64 * AUDIO_SPEED_ONE);
+}
+
+//Queues the current register state for a number of clocks. Channel resets only apply to the first of them.
+static void QueueRegisterState(uint32_t clocks)
+{
+	//Drops or repeats clocks evenly when not running at normal speed, the waveforms are generated from the
+	//registers when mixing so only the length of each state changes and not the pitch
+	if (apu->audioSpeed != AUDIO_SPEED_ONE)
+	{
+		const uint64_t scaled = (uint64_t)clocks * AUDIO_SPEED_ONE + apu->scaledClocksRemainder;
+		apu->scaledClocksRemainder = scaled % apu->audioSpeed;
+		clocks = (uint32_t)(scaled / apu->audioSpeed);
+	}
+	
+
+	if ((apu->reg.NR14 | apu->reg.NR24 | apu->reg.NR34 | apu->reg.NR44) & NRX4_RESET)
+	{
+		PushRegisterState(1);
+		apu->reg.NR14 &= ~NRX4_RESET;
+		apu->reg.NR24 &= ~NRX4_RESET;
+		apu->reg.NR34 &= ~NRX4_RESET;
+		apu->reg.NR44 &= ~NRX4_RESET;
+		clocks -= std::min(clocks, 1U);
+	}
+	if (clocks > 0)
+		PushRegisterState(clocks);
+}
+
+static void StepSequencer()
+{
+	if (apu->seqStep == 2 || apu->seqStep == 6)
+	{
+		uint32_t sweepTime = (apu->reg.NR10 >> 4) & 7;
+		uint32_t shift = apu->reg.NR10 & 7;
+		if (sweepTime != 0)
+		{
+			if (apu->channel1FreqSweepSteps++ == sweepTime)
+			{
+				apu->channel1FreqSweepSteps = 0;
+				int deltaFreq = apu->reg.channel1Freq >> shift;
+				apu->reg.channel1Freq = std::max(std::min((int)apu->reg.channel1Freq + ((apu->reg.NR10 & (1 << 3)) ? -deltaFreq : deltaFreq), 2048), 0);
+				if (apu->reg.channel1Freq >= 2048)
+				{
+					apu->reg.NR52 &= ~(uint8_t)1;
+				}
+			}
+		}
+	}
+	
+	if ((apu->seqStep % 2) == 0)
+	{
+		UpdateChannelElapsed(apu->channel1, apu->reg.NR14, 0);
+		UpdateChannelElapsed(apu->channel2, apu->reg.NR24, 1);
+		UpdateChannelElapsed(apu->channel3, apu->reg.NR34, 2);
+		UpdateChannelElapsed(apu->channel4, apu->reg.NR44, 3);
+	}
+	
+	if (apu->seqStep == 7)
+	{
+		UpdateChannelVolume(apu->channel1, apu->reg.channel1Volume, apu->reg.NR12);
+		UpdateChannelVolume(apu->channel2, apu->reg.channel2Volume, apu->reg.NR22);
+		UpdateChannelVolume(apu->channel4, apu->reg.channel4Volume, apu->reg.NR42);
 	}
 	
-	SDL_PauseAudioDevice(audioDeviceId, 0);
+	apu->seqStep = (apu->seqStep + 1) % 8;
 }
 
-void UpdateAudio()
+void UpdateAudio(uint32_t clocks)
 {
-	if (!(audioReg.NR52 & (1 << 7)))
+	if (clocks == 0)
+		return;
+	
+	//Register writes only happen between calls, so their effects are applied once up front
+	if (!(apu->reg.NR52 & (1 << 7)))
 	{
-		memset(&audioReg, 0, offsetof(AudioRegisterState, waveMem));
-		seqStep = 0;
-		seqTimer = 0;
+		//While the APU is off the sequencer is held at its first step
+		memset(&apu->reg, 0, offsetof(AudioRegisterState, waveMem));
+		apu->seqStep = 0;
+		StepSequencer();
+		QueueRegisterState(clocks);
+		return;
 	}
 	else
 	{
 		//Extra length clocking
-		static bool lengthClockWasEnabled[4];
 		bool lengthClockIsEnabled[4] =
 		{
-			(bool)(audioReg.NR14 & NRX4_ENABLE_LC),
-			(bool)(audioReg.NR24 & NRX4_ENABLE_LC),
-			(bool)(audioReg.NR34 & NRX4_ENABLE_LC),
-			(bool)(audioReg.NR44 & NRX4_ENABLE_LC)
+			(bool)(apu->reg.NR14 & NRX4_ENABLE_LC),
+			(bool)(apu->reg.NR24 & NRX4_ENABLE_LC),
+			(bool)(apu->reg.NR34 & NRX4_ENABLE_LC),
+			(bool)(apu->reg.NR44 & NRX4_ENABLE_LC)
 		};
 		for (int i = 0; i < 4; i++)
 		{
-			if (!lengthClockWasEnabled[i] && lengthClockIsEnabled[i] && (seqStep % 2) != 0)
+			if (!apu->lengthClockWasEnabled[i] && lengthClockIsEnabled[i] && (apu->seqStep % 2) != 0)
 			{
-				UpdateChannelElapsed(*channels[i + 1], NRX4_ENABLE_LC, i);
+				UpdateChannelElapsed(Channel(i + 1), NRX4_ENABLE_LC, i);
 			}
-			lengthClockWasEnabled[i] = lengthClockIsEnabled[i];
+			apu->lengthClockWasEnabled[i] = lengthClockIsEnabled[i];
 		}
 		
-		if (audioReg.NR14 & NRX4_RESET)
+		if (apu->reg.NR14 & NRX4_RESET)
 		{
 			//Reset channel 1
-			channel1FreqSweepSteps = 0;
-			channel1.volSweepTimer = 0;
-			if (channel1.lengthCounter == 0)
-				channel1.lengthCounter = 64 - ((seqStep % 2) && (audioReg.NR14 & NRX4_ENABLE_LC));
-			audioReg.channel1Volume = audioReg.NR12 >> 4;
-			audioReg.channel1Freq = GetChannelFrequency(audioReg.NR13, audioReg.NR14);
-			audioReg.NR52 |= 1 << 0;
+			apu->channel1FreqSweepSteps = 0;
+			apu->channel1.volSweepTimer = 0;
+			if (apu->channel1.lengthCounter == 0)
+				apu->channel1.lengthCounter = 64 - ((apu->seqStep % 2) && (apu->reg.NR14 & NRX4_ENABLE_LC));
+			apu->reg.channel1Volume = apu->reg.NR12 >> 4;
+			apu->reg.channel1Freq = GetChannelFrequency(apu->reg.NR13, apu->reg.NR14);
+			apu->reg.NR52 |= 1 << 0;
 		}
 		
-		if (audioReg.NR24 & NRX4_RESET)
+		if (apu->reg.NR24 & NRX4_RESET)
 		{
 			//Reset channel 2
-			channel2.volSweepTimer = 0;
-			if (channel2.lengthCounter == 0)
-				channel2.lengthCounter = 64 - ((seqStep % 2) && (audioReg.NR24 & NRX4_ENABLE_LC));
-			audioReg.channel2Volume = audioReg.NR22 >> 4;
-			audioReg.NR52 |= 1 << 1;
+			apu->channel2.volSweepTimer = 0;
+			if (apu->channel2.lengthCounter == 0)
+				apu->channel2.lengthCounter = 64 - ((apu->seqStep % 2) && (apu->reg.NR24 & NRX4_ENABLE_LC));
+			apu->reg.channel2Volume = apu->reg.NR22 >> 4;
+			apu->reg.NR52 |= 1 << 1;
 		}
 		
-		if (audioReg.NR34 & NRX4_RESET)
+		if (apu->reg.NR34 & NRX4_RESET)
 		{
 			//Reset channel 3
-			if (channel3.lengthCounter == 0)
-				channel3.lengthCounter = 256 - ((seqStep % 2) && (audioReg.NR34 & NRX4_ENABLE_LC));
-			audioReg.NR52 |= 1 << 2;
+			if (apu->channel3.lengthCounter == 0)
+				apu->channel3.lengthCounter = 256 - ((apu->seqStep % 2) && (apu->reg.NR34 & NRX4_ENABLE_LC));
+			apu->reg.NR52 |= 1 << 2;
 		}
 		
-		if (audioReg.NR44 & NRX4_RESET)
+		if (apu->reg.NR44 & NRX4_RESET)
 		{
 			//Reset channel 4
-			channel4.volSweepTimer = 0;
-			if (channel4.lengthCounter == 0)
-				channel4.lengthCounter = 64 - ((seqStep % 2) && (audioReg.NR44 & NRX4_ENABLE_LC));
-			audioReg.channel4Volume = audioReg.NR42 >> 4;
-			audioReg.NR52 |= 1 << 3;
+			apu->channel4.volSweepTimer = 0;
+			if (apu->channel4.lengthCounter == 0)
+				apu->channel4.lengthCounter = 64 - ((apu->seqStep % 2) && (apu->reg.NR44 & NRX4_ENABLE_LC));
+			apu->reg.channel4Volume = apu->reg.NR42 >> 4;
+			apu->reg.NR52 |= 1 << 3;
 		}
 		
-		if (!(audioReg.NR12 & 0xF8))
-			audioReg.NR52 &= ~1;
-		if (!(audioReg.NR22 & 0xF8))
-			audioReg.NR52 &= ~2;
-		if (!(audioReg.NR30 & (1 << 7)))
-			audioReg.NR52 &= ~4;
-		if (!(audioReg.NR42 & 0xF8))
-			audioReg.NR52 &= ~8;
+		if (!(apu->reg.NR12 & 0xF8))
+			apu->reg.NR52 &= ~1;
+		if (!(apu->reg.NR22 & 0xF8))
+			apu->reg.NR52 &= ~2;
+		if (!(apu->reg.NR30 & (1 << 7)))
+			apu->reg.NR52 &= ~4;
+		if (!(apu->reg.NR42 & 0xF8))
+			apu->reg.NR52 &= ~8;
 	}
 	
-	if (--seqTimer <= 0)
-	{
-		seqTimer = HALF_CLOCK_RATE / SEQUENCER_FREQ;
-		
-		if (seqStep == 2 || seqStep == 6)
-		{
-			uint32_t sweepTime = (audioReg.NR10 >> 4) & 7;
-			uint32_t shift = audioReg.NR10 & 7;
-			if (sweepTime != 0)
-			{
-				if (channel1FreqSweepSteps++ == sweepTime)
-				{
-					channel1FreqSweepSteps = 0;
-					int deltaFreq = audioReg.channel1Freq >> shift;
-					audioReg.channel1Freq = std::max(std::min((int)audioReg.channel1Freq + ((audioReg.NR10 & (1 << 3)) ? -deltaFreq : deltaFreq), 2048), 0);
-					if (audioReg.channel1Freq >= 2048)
-					{
-						audioReg.NR52 &= ~(uint8_t)1;
-					}
-				}
-			}
-		}
-		
-		if ((seqStep % 2) == 0)
-		{
-			UpdateChannelElapsed(channel1, audioReg.NR14, 0);
-			UpdateChannelElapsed(channel2, audioReg.NR24, 1);
-			UpdateChannelElapsed(channel3, audioReg.NR34, 2);
-			UpdateChannelElapsed(channel4, audioReg.NR44, 3);
-		}
-		
-		if (seqStep == 7)
-		{
-			UpdateChannelVolume(channel1, audioReg.channel1Volume, audioReg.NR12);
-			UpdateChannelVolume(channel2, audioReg.channel2Volume, audioReg.NR22);
-			UpdateChannelVolume(channel4, audioReg.channel4Volume, audioReg.NR42);
-		}
-		
-		seqStep = (seqStep + 1) % 8;
-	}
-	
-	uint32_t queueBack = regStateQueueBack.load(std::memory_order_acquire);
-	uint32_t queueFront = regStateQueueFront.load(std::memory_order_relaxed);
-	uint32_t nextQueueFront = (queueFront + 1) % REG_QUEUE_LEN;
-	if (nextQueueFront != queueBack)
-	{
-		regStateQueue[queueFront] = audioReg;
-		regStateQueueFront.store(nextQueueFront, std::memory_order_release);
-	}
-	
-	audioReg.NR14 &= ~NRX4_RESET;
-	audioReg.NR24 &= ~NRX4_RESET;
-	audioReg.NR34 &= ~NRX4_RESET;
-	audioReg.NR44 &= ~NRX4_RESET;
+	QueueRegisterState(clocks);
+}
+
+void StepAudioSequencer()
+{
+	//While the APU is off UpdateAudio holds the sequencer at its first step
+	if (apu->reg.NR52 & (1 << 7))
+		StepSequencer();
 }
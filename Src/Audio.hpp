@@ -2,8 +2,8 @@
 
 #include <mutex>
 #include <cstdint>
-
-void InitAudio();
+#include <cstddef>
+#include <atomic>
 
 void ResetAudioChannel1();
 void ResetAudioChannel2();
@@ -43,6 +43,100 @@ struct AudioRegisterState
 	uint32_t channel1Freq;
 };
 
-extern AudioRegisterState audioReg;
+struct ChannelData
+{
+	uint32_t volSweepTimer = 0;
+	uint32_t timer = 0;
+	uint32_t pos = 0;
+	uint32_t lengthCounter = 0;
+};
+
+//Emulated clocks per queued clock in 1/256ths, see SetAudioSpeed
+constexpr uint32_t AUDIO_SPEED_ONE = 256;
+
+//The APU of a machine, only used on the CPU thread
+struct APU
+{
+	AudioRegisterState reg;
+	
+	//The length and volume state of each channel, the wave position is kept by the audio callback in AudioQueue
+	ChannelData channel1;
+	ChannelData channel2;
+	ChannelData channel3;
+	ChannelData channel4;
+	
+	uint32_t channel1FreqSweepSteps = 0;
+	uint32_t seqStep = 0;
+	bool lengthClockWasEnabled[4] = { };
+	
+	uint32_t audioSpeed = AUDIO_SPEED_ONE;
+	uint32_t scaledClocksRemainder = 0;
+};
+
+//The APU of the machine bound to the calling thread, see Machine::Bind
+extern thread_local APU* apu;
+
+//Register states queued by the CPU thread for the audio callback, each entry holds the state for a run of clocks
+struct AudioQueue
+{
+	static constexpr size_t LENGTH = 4096;
+	
+	struct Entry
+	{
+		AudioRegisterState state;
+		uint32_t clocks;
+	};
+	
+	Entry entries[LENGTH];
+	std::atomic_uint32_t front { 0 };
+	std::atomic_uint32_t back { 0 };
+	std::atomic_uint32_t queuedClocks { 0 };
+	
+	//Only used by the audio callback
+	AudioRegisterState current;
+	uint32_t clocksLeft = 0;
+	ChannelData channel1;
+	ChannelData channel2;
+	ChannelData channel3;
+	ChannelData channel4;
+	uint16_t channel4LFSR = 0;
+};
+
+//The queue of the machine bound to the calling thread, see Machine::Bind
+extern thread_local AudioQueue* audioQueue;
+
+//Sample rate of the sound made by MixAudio
+constexpr uint32_t AUDIO_OUTPUT_FREQ = 65536;
+
+//Plays the queued register states into len bytes of interleaved signed 8 bit stereo samples. Called by an audio sink,
+//all calls for a queue must be made from the same thread. Plays silence once the queue runs out.
+void MixAudio(AudioQueue& queue, int8_t* stream, int len);
+
+//Samples MixAudio can make from what has been queued so far
+uint32_t QueuedAudioSamples(const AudioQueue& queue);
+
+//Bytes used by the queue of register states waiting for the audio callback
+size_t AudioMemoryFootprint();
+
+namespace state
+{
+	struct Writer;
+	struct Reader;
+}
+
+//The registers and the channel state kept by the CPU thread. What the audio callback is in the middle of playing isn't included.
+void SaveAudioState(state::Writer& writer);
+void LoadAudioState(state::Reader& reader);
+
+//Advances the APU by a number of clocks (at half the CPU clock rate)
+void UpdateAudio(uint32_t clocks);
+
+//Makes the APU queue sound for 1/speed of the clocks it runs, so that it keeps playing in real time while the machine
+//runs faster or slower than the real hardware. Called on the CPU thread, the default is 1.
+void SetAudioSpeed(double speed);
+
+//Clocks between steps of the frame sequencer, which runs the length counters, sweep and envelopes at 512 Hz
+constexpr uint32_t AUDIO_SEQUENCER_CLOCKS = 4096;
 
-void UpdateAudio();
+//Runs the next step of the frame sequencer, called by the scheduler once the APU has been synced
+void StepAudioSequencer();
@@ -0,0 +1,117 @@
+#include "Autosave.hpp"
+#include "Memory.hpp"
+#include "Common.hpp"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+
+namespace autosave
+{
+	static constexpr int64_t CHECK_INTERVAL_NS = 250000000;
+	
+	//A save is queued once no RAM has been written for this long, or at the latest this long after the first unsaved write
+	static constexpr int64_t QUIET_PERIOD_NS = 2000000000;
+	static constexpr int64_t MAX_DELAY_NS = 30000000000;
+	
+	thread_local Saver* saver;
+	
+	static void SaveThreadTarget(SaveQueue* queue)
+	{
+		mem::SaveSnapshot toSave;
+		std::unique_lock<std::mutex> lock(queue->mutex);
+		while (true)
+		{
+			queue->condition.wait(lock, [&] { return queue->saveQueued || queue->stopRequested; });
+			if (!queue->saveQueued)
+				return;
+			
+			std::swap(toSave, queue->snapshot);
+			queue->saveQueued = false;
+			
+			lock.unlock();
+			mem::WriteSave(queue->savePath, toSave);
+			lock.lock();
+		}
+	}
+	
+	static void QueueSave()
+	{
+		{
+			std::lock_guard<std::mutex> lock(saver->activeQueue->mutex);
+			saver->activeQueue->snapshot = saver->snapshot;
+			saver->activeQueue->saveQueued = true;
+		}
+		saver->activeQueue->condition.notify_one();
+		saver->unsaved = false;
+	}
+	
+	void Start(const std::string& path)
+	{
+		if (!mem::HasBattery())
+			return;
+		
+		saver->snapshot = { };
+		mem::UpdateSaveSnapshot(saver->snapshot);
+		saver->unsaved = false;
+		saver->nextCheckTime = NanoTime() + CHECK_INTERVAL_NS;
+		saver->activeQueue.reset(new SaveQueue);
+		saver->activeQueue->savePath = path;
+		saver->saveThread = std::thread(SaveThreadTarget, saver->activeQueue.get());
+		saver->running = true;
+	}
+	
+	void Update()
+	{
+		if (!saver->running)
+			return;
+		
+		const int64_t time = NanoTime();
+		if (time < saver->nextCheckTime)
+			return;
+		saver->nextCheckTime = time + CHECK_INTERVAL_NS;
+		
+		if (mem::UpdateSaveSnapshot(saver->snapshot))
+		{
+			if (!saver->unsaved)
+				saver->firstChangeTime = time;
+			saver->lastChangeTime = time;
+			saver->unsaved = true;
+		}
+		
+		if (saver->unsaved && (time - saver->lastChangeTime >= QUIET_PERIOD_NS || time - saver->firstChangeTime >= MAX_DELAY_NS))
+			QueueSave();
+	}
+	
+	//Waits for the save thread to write the save it has been given, if any, and exit
+	static void StopSaveThread(Saver& stopping)
+	{
+		{
+			std::lock_guard<std::mutex> lock(stopping.activeQueue->mutex);
+			stopping.activeQueue->stopRequested = true;
+		}
+		stopping.activeQueue->condition.notify_one();
+		stopping.saveThread.join();
+		stopping.activeQueue.reset();
+		stopping.running = false;
+	}
+	
+	void Stop()
+	{
+		if (!saver->running)
+			return;
+		
+		//The clock has moved on since the save was loaded even if the RAM wasn't written
+		if (mem::UpdateSaveSnapshot(saver->snapshot) || saver->unsaved || !saver->snapshot.rtc.empty())
+			QueueSave();
+		
+		StopSaveThread(*saver);
+	}
+	
+	Saver::~Saver()
+	{
+		if (running)
+			StopSaveThread(*this);
+	}
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "Memory.hpp"
+
+#include <string>
+#include <thread>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+
+//Writes battery backed RAM to the save file while the game runs, so that a crash loses at most the last few seconds.
+//Written RAM is collected on the CPU thread and handed to a save thread, which compresses and writes it.
+namespace autosave
+{
+	//Handed to the save thread under mutex
+	struct SaveQueue
+	{
+		std::string savePath;
+		std::mutex mutex;
+		std::condition_variable condition;
+		mem::SaveSnapshot snapshot;
+		bool saveQueued = false;
+		bool stopRequested = false;
+	};
+	
+	//The autosave state of a machine, only used by the CPU thread
+	struct Saver
+	{
+		bool running;
+		mem::SaveSnapshot snapshot;
+		bool unsaved;
+		int64_t nextCheckTime;
+		int64_t firstChangeTime;
+		int64_t lastChangeTime;
+		std::unique_ptr<SaveQueue> activeQueue;
+		std::thread saveThread;
+		
+		//Stops the save thread if Stop wasn't called. Only a save that was already queued is written.
+		~Saver();
+	};
+	
+	//The autosave state of the machine bound to the calling thread, see Machine::Bind
+	extern thread_local Saver* saver;
+	
+	//Starts the save thread. Does nothing for cartridges without a battery.
+	void Start(const std::string& path);
+	
+	//Called on the CPU thread between slices. Every so often collects the RAM written since the last check,
+	//and queues a save once the game has stopped writing for a while.
+	void Update();
+	
+	//Saves anything not yet saved and waits for the save thread to finish. Called on the CPU thread once it has stopped running the game.
+	void Stop();
+}
@@ -0,0 +1,63 @@
+#include "MachinePool.hpp"
+
+#include <algorithm>
+
+MachinePool::MachinePool(unsigned numWorkers)
+{
+	if (numWorkers == 0)
+		numWorkers = std::max(std::thread::hardware_concurrency(), 1U);
+	for (unsigned i = 0; i < numWorkers; i++)
+		m_workers.emplace_back(&MachinePool::WorkerTarget, this);
+}
+
+MachinePool::~MachinePool()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stopping = true;
+	}
+	m_workCondition.notify_all();
+	for (std::thread& worker : m_workers)
+		worker.join();
+}
+
+void MachinePool::Add(std::function<void()> job)
+{
+	m_added.push_back(std::move(job));
+}
+
+void MachinePool::Run()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_jobs.swap(m_added);
+	m_nextJob = 0;
+	m_numDone = 0;
+	m_workCondition.notify_all();
+	
+	m_doneCondition.wait(lock, [&] { return m_numDone == m_jobs.size(); });
+	m_jobs.clear();
+	m_nextJob = 0;
+}
+
+void MachinePool::WorkerTarget()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (true)
+	{
+		m_workCondition.wait(lock, [&] { return m_nextJob < m_jobs.size() || m_stopping; });
+		if (m_nextJob == m_jobs.size())
+			break;
+		
+		const size_t job = m_nextJob++;
+		lock.unlock();
+		{
+			Machine machine;
+			machine.Bind();
+			m_jobs[job]();
+		}
+		lock.lock();
+		
+		if (++m_numDone == m_jobs.size())
+			m_doneCondition.notify_one();
+	}
+}
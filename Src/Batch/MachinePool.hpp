@@ -0,0 +1,49 @@
+#pragma once
+
+#include "Machine.hpp"
+
+#include <functional>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+//Runs jobs on a fixed number of worker threads, which live as long as the pool. A worker takes the next job from a
+//queue shared by all workers, creates a machine for it, binds the machine to itself and runs the job there, so no
+//thread is started per job. The machine is freed as soon as its job is done.
+class MachinePool
+{
+public:
+	//Starts one worker per hardware thread if numWorkers is 0
+	explicit MachinePool(unsigned numWorkers);
+	
+	//Waits for the workers to exit, Run must have returned
+	~MachinePool();
+	
+	MachinePool(const MachinePool&) = delete;
+	MachinePool& operator=(const MachinePool&) = delete;
+	
+	unsigned MaxRunning() const { return (unsigned)m_workers.size(); }
+	
+	//Only called while Run isn't running
+	void Add(std::function<void()> job);
+	
+	//Runs all added jobs and returns once they are done, after which new jobs can be added
+	void Run();
+
+private:
+	void WorkerTarget();
+	
+	std::vector<std::function<void()>> m_added;
+	
+	//The jobs of the current Run. Workers take them in order, m_nextJob is the first that hasn't been taken.
+	std::mutex m_mutex;
+	std::condition_variable m_workCondition;
+	std::condition_variable m_doneCondition;
+	std::vector<std::function<void()>> m_jobs;
+	size_t m_nextJob = 0;
+	size_t m_numDone = 0;
+	bool m_stopping = false;
+	
+	std::vector<std::thread> m_workers;
+};
@@ -0,0 +1,323 @@
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <cstdlib>
+
+#include "CPU.hpp"
+#include "GPU.hpp"
+#include "Memory.hpp"
+#include "Common.hpp"
+#include "Emulator.hpp"
+#include "IdleLoop.hpp"
+#include "Machine.hpp"
+#include "Sinks.hpp"
+#include "SaveState.hpp"
+#include "MachinePool.hpp"
+
+//Runs many ROMs at once, each as fast as the host allows. Every job gets a machine of its own, and the worker of the
+//machine pool that took the job runs the CPU and draws the lines it finishes.
+
+//Cycles run between drawing the lines sent so far, small enough that the PPU's queues never fill up
+static constexpr int CYCLES_PER_SLICE = 1024;
+
+struct Job
+{
+	std::string romPath;
+	long numFrames;
+	std::string inputPath;
+	std::string videoPath;
+	std::string audioPath;
+};
+
+struct JobResult
+{
+	std::string error;
+	long frames = 0;
+	uint64_t cycles = 0;
+	int64_t wallTimeNS = 0;
+	uint64_t frameHash = 0;
+	uint64_t stateHash = 0;
+};
+
+template <typename T>
+static uint64_t HashFNV1a(const T* values, size_t count)
+{
+	uint64_t hash = 0xCBF29CE484222325ULL;
+	for (size_t i = 0; i < count; i++)
+	{
+		hash ^= values[i];
+		hash *= 0x100000001B3ULL;
+	}
+	return hash;
+}
+
+//Hashes each frame before passing it on, so runs can be compared without storing their video
+class FrameHasher : public VideoSink
+{
+public:
+	explicit FrameHasher(VideoSink& next) : m_next(&next) { }
+	
+	uint64_t LastHash() const { return m_lastHash; }
+	
+	void PresentFrame(const uint32_t* pixels) override
+	{
+		m_lastHash = HashFNV1a(pixels, RES_X * RES_Y);
+		m_next->PresentFrame(pixels);
+	}
+
+private:
+	VideoSink* m_next;
+	uint64_t m_lastHash = 0;
+};
+
+static void PrintUsage()
+{
+	std::cerr << "Usage: gbemu-batch [-jobs path] [-frames N] [-threads N] [-jit] [-jitcheck] [-noidle] [rom...]\n"
+		"  -jobs path   Reads jobs from path, one per line: rom [-frames N] [-input path] [-video path] [-audio path]\n"
+		"  -frames N    Frames to run for jobs that don't say, the default is 600\n"
+		"  -threads N   Jobs to run at the same time, the default is one per hardware thread\n"
+		"  -jitcheck    Runs every job with and without the JIT and fails the jobs where the two runs differ\n"
+		"The input, video and audio files are the same as for gbemu-headless.\n";
+}
+
+static bool ParseJobLine(const std::string& line, long defaultFrames, Job& job)
+{
+	std::istringstream stream(line);
+	std::string word;
+	if (!(stream >> job.romPath))
+		return false;
+	
+	job.numFrames = defaultFrames;
+	while (stream >> word)
+	{
+		std::string value;
+		if (!(stream >> value))
+			return false;
+		
+		if (word == "-frames")
+			job.numFrames = strtol(value.c_str(), nullptr, 10);
+		else if (word == "-input")
+			job.inputPath = value;
+		else if (word == "-video")
+			job.videoPath = value;
+		else if (word == "-audio")
+			job.audioPath = value;
+		else
+			return false;
+	}
+	return true;
+}
+
+//Runs on a worker of the pool, with the job's machine bound
+static void RunJob(const Job& job, JobResult& result)
+{
+	std::unique_ptr<VideoSink> videoSink = std::make_unique<NullVideoSink>();
+	std::unique_ptr<AudioSink> audioSink = std::make_unique<NullAudioSink>();
+	std::unique_ptr<InputSource> inputSource = std::make_unique<NullInputSource>();
+	if (!job.videoPath.empty())
+	{
+		auto file = std::make_unique<RawVideoFile>(job.videoPath);
+		if (!file->IsOpen())
+		{
+			result.error = "failed to open '" + job.videoPath + "' for writing";
+			return;
+		}
+		videoSink = std::move(file);
+	}
+	if (!job.audioPath.empty())
+	{
+		auto file = std::make_unique<RawAudioFile>(job.audioPath);
+		if (!file->IsOpen())
+		{
+			result.error = "failed to open '" + job.audioPath + "' for writing";
+			return;
+		}
+		audioSink = std::move(file);
+	}
+	if (!job.inputPath.empty())
+	{
+		auto file = std::make_unique<RawInputFile>(job.inputPath);
+		if (!file->IsOpen())
+		{
+			result.error = "failed to open '" + job.inputPath + "' for reading";
+			return;
+		}
+		inputSource = std::move(file);
+	}
+	
+	FrameHasher hasher(*videoSink);
+	
+	const int64_t startTime = NanoTime();
+	
+	if (!mem::Init(job.romPath.c_str()))
+	{
+		result.error = "failed to load ROM";
+		return;
+	}
+	
+	gpu::Init();
+	InitCPU();
+	gpu::ReloadVideoMemory();
+	
+	//Input is applied at the start of each frame, which happens on the same cycle on every run
+	inputSource->Update();
+	while (result.frames < job.numFrames)
+	{
+		RunCycles(CYCLES_PER_SLICE);
+		audioSink->Update(*audioQueue);
+		
+		if (const int frames = gpu::RenderPending(hasher))
+		{
+			result.frames += frames;
+			inputSource->Update();
+		}
+	}
+	
+	result.cycles = emulator->cycleCounter;
+	result.wallTimeNS = NanoTime() - startTime;
+	result.frameHash = hasher.LastHash();
+	
+	std::vector<uint8_t> finalState;
+	state::Save(finalState);
+	result.stateHash = HashFNV1a(finalState.data(), finalState.size());
+}
+
+static void RunJobs(const std::vector<Job>& jobs, std::vector<JobResult>& results, MachinePool& pool)
+{
+	results.assign(jobs.size(), JobResult());
+	for (size_t i = 0; i < jobs.size(); i++)
+		pool.Add([&, i] { RunJob(jobs[i], results[i]); });
+	pool.Run();
+}
+
+int main(int argc, char** argv)
+{
+	//Parses arguments
+	long numFrames = 600;
+	unsigned numThreads = 0;
+	bool jitCheck = false;
+	std::vector<std::string> romPaths;
+	std::vector<std::string> jobFiles;
+	for (int i = 1; i < argc; i++)
+	{
+		std::string_view arg(argv[i]);
+		bool hasValue = i + 1 < argc;
+		if (arg == "-frames" && hasValue)
+			numFrames = strtol(argv[++i], nullptr, 10);
+		else if (arg == "-threads" && hasValue)
+			numThreads = (unsigned)strtoul(argv[++i], nullptr, 10);
+		else if (arg == "-jobs" && hasValue)
+			jobFiles.emplace_back(argv[++i]);
+		else if (arg == "-jit")
+			jitMode = true;
+		else if (arg == "-jitcheck")
+			jitCheck = true;
+		else if (arg == "-noidle")
+			idle::enabled = false;
+		else if (argv[i][0] != '-')
+			romPaths.emplace_back(argv[i]);
+		else
+		{
+			PrintUsage();
+			return 2;
+		}
+	}
+	
+	std::vector<Job> jobs;
+	for (const std::string& romPath : romPaths)
+		jobs.push_back({ romPath, numFrames });
+	
+	for (const std::string& jobFile : jobFiles)
+	{
+		std::ifstream stream(jobFile);
+		if (!stream)
+		{
+			std::cerr << "Failed to open file for reading: '" << jobFile << "'.\n";
+			return 2;
+		}
+		
+		std::string line;
+		for (int lineNumber = 1; std::getline(stream, line); lineNumber++)
+		{
+			if (line.find_first_not_of(" \t\r") == std::string::npos || line[line.find_first_not_of(" \t")] == '#')
+				continue;
+			
+			Job job;
+			if (!ParseJobLine(line, numFrames, job))
+			{
+				std::cerr << jobFile << ":" << lineNumber << ": invalid job\n";
+				return 2;
+			}
+			jobs.push_back(std::move(job));
+		}
+	}
+	
+	if (jobs.empty())
+	{
+		PrintUsage();
+		return 2;
+	}
+	
+	std::vector<JobResult> results;
+	MachinePool pool(numThreads);
+	
+	const int64_t startTime = NanoTime();
+	if (jitCheck)
+		jitMode = false;
+	RunJobs(jobs, results, pool);
+	
+	//The JIT has to leave every machine exactly as the interpreter does, down to the cycle
+	if (jitCheck)
+	{
+		std::vector<JobResult> jitResults;
+		jitMode = true;
+		RunJobs(jobs, jitResults, pool);
+		for (size_t i = 0; i < jobs.size(); i++)
+		{
+			JobResult& result = results[i];
+			const JobResult& jitResult = jitResults[i];
+			if (!result.error.empty())
+				continue;
+			if (!jitResult.error.empty())
+				result.error = "with the JIT: " + jitResult.error;
+			else if (jitResult.cycles != result.cycles)
+				result.error = "the JIT ran " + std::to_string(jitResult.cycles) + " cycles instead of " + std::to_string(result.cycles);
+			else if (jitResult.frameHash != result.frameHash)
+				result.error = "the JIT drew a different last frame";
+			else if (jitResult.stateHash != result.stateHash)
+				result.error = "the JIT left the machine in a different state";
+		}
+	}
+	
+	const int64_t wallTimeNS = NanoTime() - startTime;
+	
+	//Prints the summary in the order the jobs were given
+	int numFailed = 0;
+	std::cout << std::left << std::setw(40) << "ROM" << std::right << std::setw(8) << "Frames" << std::setw(14) << "Cycles"
+		<< std::setw(10) << "Wall ms" << "  Frame hash\n";
+	for (size_t i = 0; i < jobs.size(); i++)
+	{
+		const JobResult& result = results[i];
+		std::cout << std::left << std::setw(40) << jobs[i].romPath << std::right;
+		if (!result.error.empty())
+		{
+			std::cout << "  " << result.error << "\n";
+			numFailed++;
+			continue;
+		}
+		std::cout << std::setw(8) << result.frames << std::setw(14) << result.cycles << std::setw(10) << result.wallTimeNS / 1000000
+			<< "  " << std::hex << std::setfill('0') << std::setw(16) << result.frameHash << std::dec << std::setfill(' ') << "\n";
+	}
+	
+	std::cout << jobs.size() << " jobs on " << pool.MaxRunning() << " threads in " << wallTimeNS / 1000000 << " ms";
+	if (numFailed != 0)
+		std::cout << ", " << numFailed << " failed";
+	std::cout << "\n";
+	
+	return numFailed != 0 ? 1 : 0;
+}
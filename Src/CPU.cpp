@@ -1,16 +1,23 @@
 #include "CPU.hpp"
 #include "Memory.hpp"
 #include "Common.hpp"
+#include "DecodeCache.hpp"
+#include "JIT.hpp"
+#include "Profiler.hpp"
+#include "Trace.hpp"
+#include "Emulator.hpp"
 
 #include <iostream>
 #include <iomanip>
 #include <vector>
+#include <array>
+#include <utility>
 #include <algorithm>
 #include <signal.h>
 
-CPU cpu;
+thread_local CPU* cpu;
 
-const int OpRegToRegIdx[8] = 
+constexpr int OpRegToRegIdx[8] =
 {
 	REG_B,
 	REG_C,
@@ -24,13 +31,13 @@ const int OpRegToRegIdx[8] =
 
 inline uint8_t ReadPCMem()
 {
-	return mem::Read(cpu.pc++);
+	return mem::Read(cpu->pc++);
 }
 
 inline uint16_t ReadPCMem16()
 {
-	uint16_t val = mem::Read16(cpu.pc);
-	cpu.pc += 2;
+	uint16_t val = mem::Read16(cpu->pc);
+	cpu->pc += 2;
 	return val;
 }
 
@@ -42,11 +49,6 @@ enum class FlagMode
 	Dep
 };
 
-inline uint8_t CarryBit()
-{
-	return (cpu.reg8[REG_F] >> FLAG_CARRY) & 1;
-}
-
 inline uint8_t GetAddFlags(uint8_t oldVal, uint8_t newVal)
 {
 	return (
@@ -66,997 +68,1129 @@ inline uint8_t GetSubFlags(uint8_t oldVal, uint8_t newVal)
 	);
 }
 
+uint8_t GetFlags(const CPU& _cpu)
+{
+	const uint8_t zero = (uint8_t)(_cpu.flagResult == 0) << FLAG_ZERO;
+	const uint8_t a = _cpu.flagOperand;
+	const uint8_t d = _cpu.flagDelta;
+	const int c = _cpu.flagCarryIn;
+	
+	switch (_cpu.flagOp)
+	{
+	case FlagOp::None:
+		return _cpu.reg8[REG_F];
+	case FlagOp::Add:
+		return GetAddFlags(a, _cpu.flagResult);
+	case FlagOp::Adc:
+		return zero |
+			((uint8_t)(a + d + c > 0xFF) << FLAG_CARRY) |
+			((uint8_t)((a & 0xF) + (d & 0xF) + c > 0xF) << FLAG_HCARRY);
+	case FlagOp::Sub:
+		return GetSubFlags(a, _cpu.flagResult);
+	case FlagOp::Sbc:
+		return zero | ((uint8_t)1 << FLAG_SUB) |
+			((uint8_t)((int)a - (int)d - c < 0) << FLAG_CARRY) |
+			((uint8_t)((int)(a & 0xF) - (int)(d & 0xF) - c < 0) << FLAG_HCARRY);
+	case FlagOp::And:
+		return zero | (1 << FLAG_HCARRY);
+	case FlagOp::Logic:
+		return zero;
+	case FlagOp::Inc:
+		return zero |
+			((uint8_t)((_cpu.flagResult & 0xF) == 0) << FLAG_HCARRY) |
+			(_cpu.reg8[REG_F] & (1 << FLAG_CARRY));
+	case FlagOp::Dec:
+		return zero | (1 << FLAG_SUB) |
+			((uint8_t)((_cpu.flagResult & 0xF) == 0xF) << FLAG_HCARRY) |
+			(_cpu.reg8[REG_F] & (1 << FLAG_CARRY));
+	}
+	return _cpu.reg8[REG_F];
+}
+
+void MaterializeFlags()
+{
+	cpu->reg8[REG_F] = GetFlags(*cpu);
+	cpu->flagOp = FlagOp::None;
+}
+
+inline void SetFlags(uint8_t flags)
+{
+	cpu->reg8[REG_F] = flags;
+	cpu->flagOp = FlagOp::None;
+}
+
+inline uint8_t CarryBit()
+{
+	switch (cpu->flagOp)
+	{
+	case FlagOp::Add:
+		return cpu->flagResult < cpu->flagOperand;
+	case FlagOp::Adc:
+		return cpu->flagOperand + cpu->flagDelta + cpu->flagCarryIn > 0xFF;
+	case FlagOp::Sub:
+		return cpu->flagResult > cpu->flagOperand;
+	case FlagOp::Sbc:
+		return (int)cpu->flagOperand - (int)cpu->flagDelta - (int)cpu->flagCarryIn < 0;
+	case FlagOp::And:
+	case FlagOp::Logic:
+		return 0;
+	default:
+		return (cpu->reg8[REG_F] >> FLAG_CARRY) & 1;
+	}
+}
+
+inline bool ZeroFlag()
+{
+	if (cpu->flagOp == FlagOp::None)
+		return cpu->reg8[REG_F] & (1 << FLAG_ZERO);
+	return cpu->flagResult == 0;
+}
+
+//The ALU helpers only record their operands, F is evaluated when something reads it
 inline void DoAccAdd(uint8_t delta)
 {
-	uint8_t oldVal = cpu.reg8[REG_A];
-	cpu.reg8[REG_A] += delta;
-	cpu.reg8[REG_F] = GetAddFlags(oldVal, cpu.reg8[REG_A]);
+	cpu->flagOp = FlagOp::Add;
+	cpu->flagOperand = cpu->reg8[REG_A];
+	cpu->reg8[REG_A] += delta;
+	cpu->flagResult = cpu->reg8[REG_A];
 }
 
 inline void DoAccAdc(uint8_t delta)
 {
-	uint16_t c = CarryBit();
-	
-	uint16_t oldVal = cpu.reg8[REG_A];
-	uint16_t newVal = (uint16_t)oldVal + (uint16_t)delta + c;
-	cpu.reg8[REG_A] = newVal;
-	
-	cpu.reg8[REG_F] =
-		((uint8_t)(cpu.reg8[REG_A] == 0) << FLAG_ZERO) |
-		((uint8_t)(newVal > 0xFF) << FLAG_CARRY) |
-		((uint8_t)((oldVal & 0xF) + (delta & 0xF) + c > 0xF) << FLAG_HCARRY);
+	const uint8_t c = CarryBit();
+	cpu->flagOp = FlagOp::Adc;
+	cpu->flagOperand = cpu->reg8[REG_A];
+	cpu->flagDelta = delta;
+	cpu->flagCarryIn = c;
+	cpu->reg8[REG_A] += delta + c;
+	cpu->flagResult = cpu->reg8[REG_A];
 }
 
 inline void DoAccSub(uint8_t delta)
 {
-	uint8_t oldVal = cpu.reg8[REG_A];
-	cpu.reg8[REG_A] -= delta;
-	cpu.reg8[REG_F] = GetSubFlags(oldVal, cpu.reg8[REG_A]);
+	cpu->flagOp = FlagOp::Sub;
+	cpu->flagOperand = cpu->reg8[REG_A];
+	cpu->reg8[REG_A] -= delta;
+	cpu->flagResult = cpu->reg8[REG_A];
 }
 
 inline void DoAccSbc(uint8_t delta)
 {
-	int8_t c = CarryBit();
-	
-	uint8_t oldVal = cpu.reg8[REG_A];
-	int deltaI = (int)delta + (int)c;
-	
-	cpu.reg8[REG_A] -= delta + c;
-	
-	cpu.reg8[REG_F] =
-		((uint8_t)(cpu.reg8[REG_A] == 0) << FLAG_ZERO) |
-		((uint8_t)1 << FLAG_SUB) |
-		((uint8_t)((int)oldVal - deltaI < 0) << FLAG_CARRY) |
-		((uint8_t)((int)(oldVal & 0xF) - (int)(delta & 0xF) - (int)c < 0) << FLAG_HCARRY);
+	const uint8_t c = CarryBit();
+	cpu->flagOp = FlagOp::Sbc;
+	cpu->flagOperand = cpu->reg8[REG_A];
+	cpu->flagDelta = delta;
+	cpu->flagCarryIn = c;
+	cpu->reg8[REG_A] -= delta + c;
+	cpu->flagResult = cpu->reg8[REG_A];
 }
 
 template <bool SetHCarry>
 inline void DoAccLogic(uint8_t newVal)
 {
-	cpu.reg8[REG_A] = newVal;
-	cpu.reg8[REG_F] = ((uint8_t)(newVal == 0) << FLAG_ZERO) | ((uint8_t)SetHCarry << FLAG_HCARRY);
+	cpu->reg8[REG_A] = newVal;
+	cpu->flagOp = SetHCarry ? FlagOp::And : FlagOp::Logic;
+	cpu->flagResult = newVal;
+}
+
+//Runs one of the eight accumulator operations selected by bits 3-5 of the opcode
+template <int AluOp>
+inline void DoAccOp(uint8_t val)
+{
+	if constexpr (AluOp == 0)
+		DoAccAdd(val);
+	else if constexpr (AluOp == 1)
+		DoAccAdc(val);
+	else if constexpr (AluOp == 2)
+		DoAccSub(val);
+	else if constexpr (AluOp == 3)
+		DoAccSbc(val);
+	else if constexpr (AluOp == 4)
+		DoAccLogic<true>(cpu->reg8[REG_A] & val);
+	else if constexpr (AluOp == 5)
+		DoAccLogic<false>(cpu->reg8[REG_A] ^ val);
+	else if constexpr (AluOp == 6)
+		DoAccLogic<false>(cpu->reg8[REG_A] | val);
+	else
+	{
+		cpu->flagOp = FlagOp::Sub;
+		cpu->flagOperand = cpu->reg8[REG_A];
+		cpu->flagResult = cpu->reg8[REG_A] - val;
+	}
 }
 
 inline uint16_t DoAdd16(uint16_t oldVal, uint16_t delta)
 {
 	uint16_t newVal = oldVal + delta;
-	cpu.reg8[REG_F] =
-		(cpu.reg8[REG_F] & (1 << FLAG_ZERO)) |
+	SetFlags(
+		((uint8_t)ZeroFlag() << FLAG_ZERO) |
 		((uint8_t)(newVal < oldVal) << FLAG_CARRY) |
-		((uint8_t)((newVal & 0x7FF) < (oldVal & 0x7FF)) << FLAG_HCARRY);
+		((uint8_t)((newVal & 0x7FF) < (oldVal & 0x7FF)) << FLAG_HCARRY));
 	return newVal;
 }
 
 uint16_t DoAddSP(int8_t add)
 {
-	cpu.reg8[REG_F] =
-		(((uint32_t)(cpu.sp & 0xFF) + (uint32_t)((uint8_t)add & 0xFF) > 0xFFU) << FLAG_CARRY) | 
-		(((uint32_t)(cpu.sp & 0xF) + (uint32_t)((uint8_t)add & 0xF) > 0xFU) << FLAG_HCARRY);
-	return cpu.sp + add;
+	SetFlags(
+		(((uint32_t)(cpu->sp & 0xFF) + (uint32_t)((uint8_t)add & 0xFF) > 0xFFU) << FLAG_CARRY) |
+		(((uint32_t)(cpu->sp & 0xF) + (uint32_t)((uint8_t)add & 0xF) > 0xFU) << FLAG_HCARRY));
+	return cpu->sp + add;
 }
 
+//INC and DEC keep the carry flag, so only that bit is evaluated and kept in F
 inline void UpdateFlagsAfterInc(uint8_t oldValue)
 {
-	cpu.reg8[REG_F] =
-		((uint8_t)(oldValue == 0xFF) << FLAG_ZERO) |
-		((uint8_t)((oldValue & 0xF) == 0xF) << FLAG_HCARRY) |
-		(cpu.reg8[REG_F] & (1 << FLAG_CARRY));
+	cpu->reg8[REG_F] = CarryBit() << FLAG_CARRY;
+	cpu->flagOp = FlagOp::Inc;
+	cpu->flagResult = oldValue + 1;
 }
 
 inline void UpdateFlagsAfterDec(uint8_t oldValue)
 {
-	cpu.reg8[REG_F] =
-		((uint8_t)(oldValue == 1) << FLAG_ZERO) |
-		(1 << FLAG_SUB) |
-		((uint8_t)((oldValue & 0xF) == 0) << FLAG_HCARRY) |
-		(cpu.reg8[REG_F] & (1 << FLAG_CARRY));
+	cpu->reg8[REG_F] = CarryBit() << FLAG_CARRY;
+	cpu->flagOp = FlagOp::Dec;
+	cpu->flagResult = oldValue - 1;
+}
+
+//Evaluates one of the four branch conditions (NZ, Z, NC, C) selected by bits 3-4 of the opcode
+template <int Cond>
+inline bool CheckCondition()
+{
+	if constexpr (Cond == 0)
+		return !ZeroFlag();
+	else if constexpr (Cond == 1)
+		return ZeroFlag();
+	else if constexpr (Cond == 2)
+		return !CarryBit();
+	else
+		return CarryBit();
 }
 
 inline void DoCall(uint16_t dst)
 {
-	cpu.sp -= 2;
-	mem::Write16(cpu.sp, cpu.pc);
-	cpu.pc = dst;
+	cpu->sp -= 2;
+	mem::Write16(cpu->sp, cpu->pc);
+	cpu->pc = dst;
 }
 
 inline void DoRet()
 {
-	cpu.pc = mem::Read16(cpu.sp);
-	cpu.sp += 2;
+	cpu->pc = mem::Read16(cpu->sp);
+	cpu->sp += 2;
 }
 
-static const uint16_t INTERRUPT_TARGETS[] = { 0x40, 0x48, 0x50, 0x58, 0x60 };
+inline uint8_t DoRLC(uint8_t val)
+{
+	const uint8_t newVal = (val << 1) | (val >> 7);
+	SetFlags(((val >> 7) << FLAG_CARRY) | ((uint8_t)(newVal == 0) << FLAG_ZERO));
+	return newVal;
+}
 
-void InitCPU()
+inline uint8_t DoRL(uint8_t val)
+{
+	const uint8_t newVal = (val << 1) | CarryBit();
+	SetFlags(((val >> 7) << FLAG_CARRY) | ((uint8_t)(newVal == 0) << FLAG_ZERO));
+	return newVal;
+}
+
+inline uint8_t DoRRC(uint8_t val)
 {
-	cpu.reg16[REG_AF] = 0x11B0;
-	cpu.reg16[REG_BC] = 0x0013;
-	cpu.reg16[REG_DE] = 0x00D8;
-	cpu.reg16[REG_HL] = 0x014F;
-	cpu.sp = 0xFFFE;
-	cpu.pc = 0x100;
-	cpu.halted = false;
-	cpu.intEnableMaster = true;
-	cpu.intEnableReg = 0;
+	const uint8_t newVal = (val >> 1) | ((val & 1U) << 7);
+	SetFlags(((val & 1U) << FLAG_CARRY) | ((uint8_t)(newVal == 0) << FLAG_ZERO));
+	return newVal;
 }
 
-std::vector<uint16_t> breakpoints;
+inline uint8_t DoRR(uint8_t val)
+{
+	const uint8_t newVal = (val >> 1) | (CarryBit() << 7);
+	SetFlags(((val & 1U) << FLAG_CARRY) | ((uint8_t)(newVal == 0) << FLAG_ZERO));
+	return newVal;
+}
 
-void AddBreakpoint(uint16_t pc)
+inline uint8_t DoSLA(uint8_t val)
 {
-	breakpoints.push_back(pc);
+	const uint8_t newVal = val << 1;
+	SetFlags(((val >> 7) << FLAG_CARRY) | ((uint8_t)(newVal == 0) << FLAG_ZERO));
+	return newVal;
 }
 
-int StepCPU()
+inline uint8_t DoSRA(uint8_t val)
+{
+	const uint8_t newVal = (val >> 1) | (val & 0x80U);
+	SetFlags(((val & 1U) << FLAG_CARRY) | ((uint8_t)(newVal == 0) << FLAG_ZERO));
+	return newVal;
+}
+
+inline uint8_t DoSRL(uint8_t val)
+{
+	const uint8_t newVal = val >> 1;
+	SetFlags(((val & 1U) << FLAG_CARRY) | ((uint8_t)(newVal == 0) << FLAG_ZERO));
+	return newVal;
+}
+
+inline uint8_t DoSWAP(uint8_t val)
+{
+	const uint8_t newVal = ((val & 0x0FU) << 4) | ((val & 0xF0U) >> 4);
+	SetFlags(((uint8_t)(newVal == 0) << FLAG_ZERO));
+	return newVal;
+}
+
+//Runs one of the eight CB-prefixed shift operations selected by bits 3-5 of the second opcode byte
+template <int ShiftOp>
+inline uint8_t DoShiftOp(uint8_t val)
+{
+	if constexpr (ShiftOp == 0)
+		return DoRLC(val);
+	else if constexpr (ShiftOp == 1)
+		return DoRRC(val);
+	else if constexpr (ShiftOp == 2)
+		return DoRL(val);
+	else if constexpr (ShiftOp == 3)
+		return DoRR(val);
+	else if constexpr (ShiftOp == 4)
+		return DoSLA(val);
+	else if constexpr (ShiftOp == 5)
+		return DoSRA(val);
+	else if constexpr (ShiftOp == 6)
+		return DoSWAP(val);
+	else
+		return DoSRL(val);
+}
+
+static const uint16_t INTERRUPT_TARGETS[] = { 0x40, 0x48, 0x50, 0x58, 0x60 };
+
+//One bit per address. Breakpoints in 0x4000-0x7FFF that only apply to one ROM bank are kept per bank.
+static uint64_t breakpointBits[0x10000 / 64];
+static std::vector<std::array<uint64_t, 0x4000 / 64>> romBankBreakpointBits;
+static bool hasBreakpoints;
+
+void AddBreakpoint(uint16_t pc, int romBank)
 {
-	//Checks for interrupts
-	if (uint32_t intFlags = cpu.intEnableReg & ioReg[IOREG_IF])
+	if (romBank >= 0 && pc >= 0x4000 && pc < 0x8000)
 	{
-		int interrupt = __builtin_ctz(intFlags);
-		if (cpu.intEnableMaster)
-		{
-			ioReg[IOREG_IF] &= ~(1 << interrupt);
-			if (verboseMode)
-				std::cout << "INT " << interrupt << "\n";
-			
-			cpu.intEnableMaster = false;
-			DoCall(INTERRUPT_TARGETS[interrupt]);
-			
-			if (cpu.halted)
-			{
-				cpu.halted = false;
-				return 24;
-			}
-			return 20;
-		}
-		else if (cpu.halted)
-		{
-			cpu.halted = false;
-			return 4;
-		}
+		if ((size_t)romBank >= romBankBreakpointBits.size())
+			romBankBreakpointBits.resize(romBank + 1);
+		romBankBreakpointBits[romBank][(pc - 0x4000) / 64] |= 1ULL << (pc % 64);
+	}
+	else
+	{
+		breakpointBits[pc / 64] |= 1ULL << (pc % 64);
 	}
 	
-	if (cpu.halted)
-		return 4;
-	
-	if (verboseMode)
-		PrintNextInstruction();
+	//Breakpoints added before a machine is bound take effect through InitCPU
+	hasBreakpoints = true;
+	if (emulator != nullptr)
+		emulator->debugHooksEnabled = true;
+}
+
+static bool IsBreakpoint(uint16_t pc)
+{
+	if (breakpointBits[pc / 64] & (1ULL << (pc % 64)))
+		return true;
 	
-	if (std::find(breakpoints.begin(), breakpoints.end(), cpu.pc) != breakpoints.end())
+	if (pc >= 0x4000 && pc < 0x8000)
 	{
-		std::cout << "@" << std::hex << cpu.pc << std::endl;
-		//raise(SIGTRAP);
+		const uint32_t bank = mem::ActiveRomBank();
+		return bank < romBankBreakpointBits.size() && (romBankBreakpointBits[bank][(pc - 0x4000) / 64] & (1ULL << (pc % 64)));
 	}
+	return false;
+}
+
+void InitCPU()
+{
+	cpu->reg16[REG_AF] = 0x11B0;
+	cpu->flagOp = FlagOp::None;
+	cpu->reg16[REG_BC] = 0x0013;
+	cpu->reg16[REG_DE] = 0x00D8;
+	cpu->reg16[REG_HL] = 0x014F;
+	cpu->sp = 0xFFFE;
+	cpu->pc = 0x100;
+	cpu->halted = false;
+	cpu->intEnableMaster = true;
+	cpu->intEnableReg = 0;
 	
-	uint8_t instruction = ReadPCMem();
+	ResetEvents();
 	
+	emulator->debugHooksEnabled = verboseMode || hasBreakpoints || profiler::enabled;
+}
+
+[[noreturn]] static void UnknownOpcode(uint8_t instruction)
+{
+	std::cerr << "Unknown opcode " << std::hex << (int)instruction << "\n";
+	std::abort();
+}
+
+//Returns the number of immediate operand bytes following an opcode
+constexpr int OperandLength(uint8_t instruction)
+{
 	switch (instruction)
 	{
-#define DEFINST_LD_REG_REG(x, y)\
-	case (0b01000000 | ((int)(OP_REG_ ## x) << 3) | OP_REG_ ## y): \
-		cpu.reg8[REG_ ## x] = cpu.reg8[REG_ ## y]; \
-		return 4;
-	DEFINST_LD_REG_REG(A, A)
-	DEFINST_LD_REG_REG(A, B)
-	DEFINST_LD_REG_REG(A, C)
-	DEFINST_LD_REG_REG(A, D)
-	DEFINST_LD_REG_REG(A, E)
-	DEFINST_LD_REG_REG(A, H)
-	DEFINST_LD_REG_REG(A, L)
-	DEFINST_LD_REG_REG(B, A)
-	DEFINST_LD_REG_REG(B, B)
-	DEFINST_LD_REG_REG(B, C)
-	DEFINST_LD_REG_REG(B, D)
-	DEFINST_LD_REG_REG(B, E)
-	DEFINST_LD_REG_REG(B, H)
-	DEFINST_LD_REG_REG(B, L)
-	DEFINST_LD_REG_REG(C, A)
-	DEFINST_LD_REG_REG(C, B)
-	DEFINST_LD_REG_REG(C, C)
-	DEFINST_LD_REG_REG(C, D)
-	DEFINST_LD_REG_REG(C, E)
-	DEFINST_LD_REG_REG(C, H)
-	DEFINST_LD_REG_REG(C, L)
-	DEFINST_LD_REG_REG(D, A)
-	DEFINST_LD_REG_REG(D, B)
-	DEFINST_LD_REG_REG(D, C)
-	DEFINST_LD_REG_REG(D, D)
-	DEFINST_LD_REG_REG(D, E)
-	DEFINST_LD_REG_REG(D, H)
-	DEFINST_LD_REG_REG(D, L)
-	DEFINST_LD_REG_REG(E, A)
-	DEFINST_LD_REG_REG(E, B)
-	DEFINST_LD_REG_REG(E, C)
-	DEFINST_LD_REG_REG(E, D)
-	DEFINST_LD_REG_REG(E, E)
-	DEFINST_LD_REG_REG(E, H)
-	DEFINST_LD_REG_REG(E, L)
-	DEFINST_LD_REG_REG(H, A)
-	DEFINST_LD_REG_REG(H, B)
-	DEFINST_LD_REG_REG(H, C)
-	DEFINST_LD_REG_REG(H, D)
-	DEFINST_LD_REG_REG(H, E)
-	DEFINST_LD_REG_REG(H, H)
-	DEFINST_LD_REG_REG(H, L)
-	DEFINST_LD_REG_REG(L, A)
-	DEFINST_LD_REG_REG(L, B)
-	DEFINST_LD_REG_REG(L, C)
-	DEFINST_LD_REG_REG(L, D)
-	DEFINST_LD_REG_REG(L, E)
-	DEFINST_LD_REG_REG(L, H)
-	DEFINST_LD_REG_REG(L, L)
-	
-#define DEFINST_LD_IMM_REG(reg)\
-	case (0b00000110 | ((int)(OP_REG_ ## reg) << 3)): \
-		cpu.reg8[REG_ ## reg] = ReadPCMem(); \
-		return 8;
-	DEFINST_LD_IMM_REG(A)
-	DEFINST_LD_IMM_REG(B)
-	DEFINST_LD_IMM_REG(C)
-	DEFINST_LD_IMM_REG(D)
-	DEFINST_LD_IMM_REG(E)
-	DEFINST_LD_IMM_REG(H)
-	DEFINST_LD_IMM_REG(L)
-	
-#define DEFINST_LD_HLMEM_REG(reg)\
-	case (0b01000110 | ((int)(OP_REG_ ## reg) << 3)): \
-		cpu.reg8[REG_ ## reg] = mem::Read(cpu.reg16[REG_HL]); \
-		return 8;
-	DEFINST_LD_HLMEM_REG(A)
-	DEFINST_LD_HLMEM_REG(B)
-	DEFINST_LD_HLMEM_REG(C)
-	DEFINST_LD_HLMEM_REG(D)
-	DEFINST_LD_HLMEM_REG(E)
-	DEFINST_LD_HLMEM_REG(H)
-	DEFINST_LD_HLMEM_REG(L)
-	
-#define DEFINST_LD_REG_HLMEM(reg)\
-	case (0b01110000 | OP_REG_ ## reg): \
-		mem::Write(cpu.reg16[REG_HL], cpu.reg8[REG_ ## reg]); \
-		return 8;
-	DEFINST_LD_REG_HLMEM(A)
-	DEFINST_LD_REG_HLMEM(B)
-	DEFINST_LD_REG_HLMEM(C)
-	DEFINST_LD_REG_HLMEM(D)
-	DEFINST_LD_REG_HLMEM(E)
-	DEFINST_LD_REG_HLMEM(H)
-	DEFINST_LD_REG_HLMEM(L)
-	
-	//Operations for loading and storing registers to memory
-	case 0x36: //LD (HL) n
-		mem::Write(cpu.reg16[REG_HL], ReadPCMem());
-		return 12;
-	case 0x0A: //LD A (BC)
-		cpu.reg8[REG_A] = mem::Read(cpu.reg16[REG_BC]);
-		return 8;
-	case 0x1A: //LD A (DE)
-		cpu.reg8[REG_A] = mem::Read(cpu.reg16[REG_DE]);
-		return 8;
-	case 0xFA: //LD A (nn)
-		cpu.reg8[REG_A] = mem::Read(ReadPCMem16());
-		return 16;
-	case 0x02: //LD (BC) A
-		mem::Write(cpu.reg16[REG_BC], cpu.reg8[REG_A]);
-		return 8;
-	case 0x12: //LD (DE) A
-		mem::Write(cpu.reg16[REG_DE], cpu.reg8[REG_A]);
-		return 8;
-	case 0xEA: //LD (nn) A
-		mem::Write(ReadPCMem16(), cpu.reg8[REG_A]);
-		return 16;
-	case 0x08: //LD (nn) SP
-		mem::Write16(ReadPCMem16(), cpu.sp);
-		return 20;
-	
-	//Operations for loading and storing to I/O registers
-	case 0xF0: //LD A (FF00+n)
-		cpu.reg8[REG_A] = mem::Read(0xFF00 + ReadPCMem());
-		return 12;
-	case 0xE0: //LD (FF00+n) A
-		mem::Write(0xFF00 + ReadPCMem(), cpu.reg8[REG_A]);
-		return 12;
-	case 0xF2: //LD A (FF00+C)
-		cpu.reg8[REG_A] = mem::Read(0xFF00 + cpu.reg8[REG_C]);
-		return 8;
-	case 0xE2: //LD (FF00+C) A
-		mem::Write(0xFF00 + cpu.reg8[REG_C], cpu.reg8[REG_A]);
-		return 8;
-	
-	//Operations for loading and storing the A register to memory at HL and incrementing/decrementing HL
-	case 0x22: //LDI (HL) A
-		mem::Write(cpu.reg16[REG_HL]++, cpu.reg8[REG_A]);
-		return 8;
-	case 0x2A: //LDI A (HL)
-		cpu.reg8[REG_A] = mem::Read(cpu.reg16[REG_HL]++);
-		return 8;
-	case 0x32: //LDD (HL) A:
-		mem::Write(cpu.reg16[REG_HL]--, cpu.reg8[REG_A]);
-		return 8;
-	case 0x3A: //LDD A (HL):
-		cpu.reg8[REG_A] = mem::Read(cpu.reg16[REG_HL]--);
-		return 8;
-	
-	//Operations for loading 16-bit immediate values to 16-bit registers
-	case 0x01: //LD BC nn:
-		cpu.reg16[REG_BC] = ReadPCMem16();
-		return 12;
-	case 0x11: //LD DE nn:
-		cpu.reg16[REG_DE] = ReadPCMem16();
-		return 12;
-	case 0x21: //LD HL nn:
-		cpu.reg16[REG_HL] = ReadPCMem16();
-		return 12;
-	case 0x31: //LD SP nn:
-		cpu.sp = ReadPCMem16();
-		return 12;
-	case 0xF9: //LD SP HL
-		cpu.sp = cpu.reg16[REG_HL];
-		return 8;
-	
-	//Stack push instructions
-	case 0xC5: //PUSH BC:
-		cpu.sp -= 2;
-		mem::Write16(cpu.sp, cpu.reg16[REG_BC]);
-		return 16;
-	case 0xD5: //PUSH DE:
-		cpu.sp -= 2;
-		mem::Write16(cpu.sp, cpu.reg16[REG_DE]);
-		return 16;
-	case 0xE5: //PUSH HL:
-		cpu.sp -= 2;
-		mem::Write16(cpu.sp, cpu.reg16[REG_HL]);
-		return 16;
-	case 0xF5: //PUSH AF:
-		cpu.sp -= 2;
-		mem::Write16(cpu.sp, cpu.reg16[REG_AF]);
-		return 16;
-	
-	//Stack pop instructions
-	case 0xC1: //POP BC:
-		cpu.reg16[REG_BC] = mem::Read16(cpu.sp);
-		cpu.sp += 2;
-		return 12;
-	case 0xD1: //POP DE:
-		cpu.reg16[REG_DE] = mem::Read16(cpu.sp);
-		cpu.sp += 2;
-		return 12;
-	case 0xE1: //POP HL:
-		cpu.reg16[REG_HL] = mem::Read16(cpu.sp);
-		cpu.sp += 2;
-		return 12;
-	case 0xF1: //POP AF:
-		cpu.reg16[REG_AF] = mem::Read16(cpu.sp) & 0xFFF0U;
-		cpu.sp += 2;
-		return 12;
-	
-#define DEFINSTS_ARITHMETIC(reg)\
-	case (0b10000000 | OP_REG_ ## reg): /* ADD A reg */ \
-		DoAccAdd(cpu.reg8[REG_ ## reg]); \
-		return 4; \
-	case (0b10001000 | OP_REG_ ## reg): /* ADC A reg */ \
-		DoAccAdc(cpu.reg8[REG_ ## reg]); \
-		return 4; \
-	case (0b10010000 | OP_REG_ ## reg): /* SUB A reg */ \
-		DoAccSub(cpu.reg8[REG_ ## reg]); \
-		return 4; \
-	case (0b10011000 | OP_REG_ ## reg): /* SBC A reg */ \
-		DoAccSbc(cpu.reg8[REG_ ## reg]); \
-		return 4; \
-	case (0b10100000 | OP_REG_ ## reg): /* AND A reg */ \
-		DoAccLogic<true>(cpu.reg8[REG_A] & cpu.reg8[REG_ ## reg]); \
-		return 4; \
-	case (0b10101000 | OP_REG_ ## reg): /* XOR A reg */ \
-		DoAccLogic<false>(cpu.reg8[REG_A] ^ cpu.reg8[REG_ ## reg]); \
-		return 4; \
-	case (0b10110000 | OP_REG_ ## reg): /* OR A reg */ \
-		DoAccLogic<false>(cpu.reg8[REG_A] | cpu.reg8[REG_ ## reg]); \
-		return 4; \
-	case (0b10111000 | OP_REG_ ## reg): /* CP A reg */ \
-		cpu.reg8[REG_F] = GetSubFlags(cpu.reg8[REG_A], cpu.reg8[REG_A] - cpu.reg8[REG_ ## reg]); \
-		return 4; \
-	case (0b00000100 | ((int)(OP_REG_ ## reg) << 3)): /* INC reg */ { \
-		UpdateFlagsAfterInc(cpu.reg8[REG_ ## reg]++); \
-		return 4; } \
-	case (0b00000101 | ((int)(OP_REG_ ## reg) << 3)): /* DEC reg */ { \
-		UpdateFlagsAfterDec(cpu.reg8[REG_ ## reg]--); \
-		return 4; }
-	
-	DEFINSTS_ARITHMETIC(A)
-	DEFINSTS_ARITHMETIC(B)
-	DEFINSTS_ARITHMETIC(C)
-	DEFINSTS_ARITHMETIC(D)
-	DEFINSTS_ARITHMETIC(E)
-	DEFINSTS_ARITHMETIC(H)
-	DEFINSTS_ARITHMETIC(L)
-	
-	case 0xC6: //ADD A n
-		DoAccAdd(ReadPCMem());
-		return 8;
-	case 0x86: //ADD A (HL)
-		DoAccAdd(mem::Read(cpu.reg16[REG_HL]));
-		return 8;
-	case 0xCE: //ADC A n
-		DoAccAdc(ReadPCMem());
-		return 8;
-	case 0x8E: //ADC A (HL)
-		DoAccAdc(mem::Read(cpu.reg16[REG_HL]));
-		return 8;
-	case 0xD6: //SUB A n
-		DoAccSub(ReadPCMem());
-		return 8;
-	case 0x96: //SUB A (HL)
-		DoAccSub(mem::Read(cpu.reg16[REG_HL]));
-		return 8;
-	case 0xDE: //SBC A n
-		DoAccSbc(ReadPCMem());
-		return 8;
-	case 0x9E: //SBC A (HL)
-		DoAccSbc(mem::Read(cpu.reg16[REG_HL]));
-		return 8;
-	case 0xE6: //AND A n
-		DoAccLogic<true>(cpu.reg8[REG_A] & ReadPCMem());
-		return 8;
-	case 0xA6: //AND A (HL)
-		DoAccLogic<true>(cpu.reg8[REG_A] & mem::Read(cpu.reg16[REG_HL]));
-		return 8;
-	case 0xEE: //XOR A n
-		DoAccLogic<false>(cpu.reg8[REG_A] ^ ReadPCMem());
-		return 8;
-	case 0xAE: //XOR A (HL)
-		DoAccLogic<false>(cpu.reg8[REG_A] ^ mem::Read(cpu.reg16[REG_HL]));
-		return 8;
-	case 0xF6: //OR A n
-		DoAccLogic<false>(cpu.reg8[REG_A] | ReadPCMem());
-		return 8;
-	case 0xB6: //OR A (HL)
-		DoAccLogic<false>(cpu.reg8[REG_A] | mem::Read(cpu.reg16[REG_HL]));
-		return 8;
-		
-	case 0xFE: //CP A n
-		cpu.reg8[REG_F] = GetSubFlags(cpu.reg8[REG_A], cpu.reg8[REG_A] - ReadPCMem()); \
-		return 8;
-	case 0xBE: //CP A (HL)
-		cpu.reg8[REG_F] = GetSubFlags(cpu.reg8[REG_A], cpu.reg8[REG_A] - mem::Read(cpu.reg16[REG_HL])); \
+	case 0x01: case 0x11: case 0x21: case 0x31: //LD rr nn
+	case 0x08: case 0xEA: case 0xFA:            //LD (nn) SP, LD (nn) A, LD A (nn)
+	case 0xC3: case 0xC2: case 0xCA: case 0xD2: case 0xDA: //JP
+	case 0xCD: case 0xC4: case 0xCC: case 0xD4: case 0xDC: //CALL
+		return 2;
+	case 0x06: case 0x0E: case 0x16: case 0x1E: case 0x26: case 0x2E: case 0x36: case 0x3E: //LD r n
+	case 0xC6: case 0xCE: case 0xD6: case 0xDE: case 0xE6: case 0xEE: case 0xF6: case 0xFE: //ALU A n
+	case 0x18: case 0x20: case 0x28: case 0x30: case 0x38: //JR
+	case 0xE0: case 0xF0: case 0xE8: case 0xF8: case 0xCB:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+template <size_t... I>
+constexpr std::array<uint8_t, 256> MakeOperandLengthTable(std::index_sequence<I...>)
+{
+	return { { (uint8_t)OperandLength(I)... } };
+}
+
+static constexpr std::array<uint8_t, 256> OPERAND_LENGTH = MakeOperandLengthTable(std::make_index_sequence<256>());
+
+int InstructionLength(uint8_t opcode)
+{
+	return 1 + OPERAND_LENGTH[opcode];
+}
+
+//Cycles used by each opcode, conditional instructions use the cycle count for when the condition is false
+static constexpr uint8_t INSTRUCTION_CYCLES[256] =
+{
+	 4, 12,  8,  8,  4,  4,  8,  4, 20,  8,  8,  8,  4,  4,  8,  4,
+	 4, 12,  8,  8,  4,  4,  8,  4, 12,  8,  8,  8,  4,  4,  8,  4,
+	 8, 12,  8,  8,  4,  4,  8,  4,  8,  8,  8,  8,  4,  4,  8,  4,
+	 8, 12,  8,  8, 12, 12, 12,  4,  8,  8,  8,  8,  4,  4,  8,  4,
+	 4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4,
+	 4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4,
+	 4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4,
+	 8,  8,  8,  8,  8,  8,  4,  8,  4,  4,  4,  4,  4,  4,  8,  4,
+	 4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4,
+	 4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4,
+	 4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4,
+	 4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4,
+	 8, 12, 12, 16, 12, 16,  8, 16,  8, 16, 12,  0, 12, 24,  8, 16,
+	 8, 12, 12,  0, 12, 16,  8, 16,  8, 16, 12,  0, 12,  0,  8, 16,
+	12, 12,  8,  0,  0, 16,  8, 16, 16,  4, 16,  0,  0,  0,  8, 16,
+	12, 12,  8,  4,  0, 16,  8, 16, 12,  8, 16,  4,  0,  0,  8, 16
+};
+
+constexpr uint8_t CBInstructionCycles(uint8_t op2)
+{
+	if ((op2 & 7) != 6)
 		return 8;
+	return (op2 & 0xC0) == 0x40 ? 12 : 16;
+}
+
+/*
+ * Opcode handlers. Each handler receives the immediate operand that followed the opcode
+ * (already consumed from the instruction stream) and returns the number of cycles used.
+ * The primary templates decode the register / condition fields of regular opcode groups
+ * at compile time, the remaining opcodes are explicit specializations below.
+ */
+
+template <uint8_t OP>
+int ExecCBOp(uint16_t)
+{
+	constexpr int REG = OpRegToRegIdx[OP & 7];
+	constexpr uint8_t BIT = (OP >> 3) & 7;
 	
-	case 0x34: //INC (HL):
+	if constexpr (OP < 0x40) //RLC, RRC, RL, RR, SLA, SRA, SWAP, SRL
 	{
-		uint8_t val = mem::Read(cpu.reg16[REG_HL]);
-		mem::Write(cpu.reg16[REG_HL], val + 1);
-		UpdateFlagsAfterInc(val);
-		return 12;
+		if constexpr (REG == -1)
+		{
+			const uint16_t addr = cpu->reg16[REG_HL];
+			mem::Write(addr, DoShiftOp<BIT>(mem::Read(addr)));
+			return 16;
+		}
+		else
+		{
+			cpu->reg8[REG] = DoShiftOp<BIT>(cpu->reg8[REG]);
+			return 8;
+		}
 	}
-	case 0x35: //DEC (HL):
+	else if constexpr (OP < 0x80) //BIT
 	{
-		uint8_t val = mem::Read(cpu.reg16[REG_HL]);
-		mem::Write(cpu.reg16[REG_HL], val - 1);
-		UpdateFlagsAfterDec(val);
-		return 12;
+		const uint8_t val = REG == -1 ? mem::Read(cpu->reg16[REG_HL]) : cpu->reg8[REG];
+		SetFlags(((~(val >> BIT) & 1) << FLAG_ZERO) | (1 << FLAG_HCARRY) | (CarryBit() << FLAG_CARRY));
+		return REG == -1 ? 12 : 8;
 	}
-	
-	case 0x27: //DAA
+	else //RES, SET
 	{
-		int add = 0;
-		bool carry = cpu.reg8[REG_F] & (1 << FLAG_CARRY);
-		const bool sub = cpu.reg8[REG_F] & (1 << FLAG_SUB);
-		if ((cpu.reg8[REG_F] & (1 << FLAG_HCARRY)) || (!sub && (cpu.reg8[REG_A] & 0xf) > 9)) {
-			add = 6;
+		auto Apply = [] (uint8_t val) -> uint8_t
+		{
+			if constexpr (OP < 0xC0)
+				return val & ~(1 << BIT);
+			else
+				return val | (1 << BIT);
+		};
+		
+		if constexpr (REG == -1)
+		{
+			const uint16_t addr = cpu->reg16[REG_HL];
+			mem::Write(addr, Apply(mem::Read(addr)));
+			return 16;
 		}
-		if (carry || (!sub && cpu.reg8[REG_A] > 0x99)) {
-			add |= 0x60;
-			carry = 1;
+		else
+		{
+			cpu->reg8[REG] = Apply(cpu->reg8[REG]);
+			return 8;
 		}
-		cpu.reg8[REG_A] += sub ? -add : add;
-		
-		cpu.reg8[REG_F] = (cpu.reg8[REG_F] & (1 << FLAG_SUB)) |
-			((cpu.reg8[REG_A] == 0) << FLAG_ZERO) | ((uint8_t)carry << FLAG_CARRY);
-		
-		return 4;
 	}
+}
+
+template <uint8_t OP>
+int ExecOp(uint16_t imm)
+{
+	constexpr int DST = OpRegToRegIdx[(OP >> 3) & 7];
+	constexpr int SRC = OpRegToRegIdx[OP & 7];
+	constexpr int REG16 = ((OP >> 4) & 3) + REG_BC; //BC, DE, HL or (SP/AF)
+	constexpr int COND = (OP >> 3) & 3;
 	
-	case 0x2F: //CPL A
-		cpu.reg8[REG_A] = ~cpu.reg8[REG_A];
-		cpu.reg8[REG_F] = (cpu.reg8[REG_F] & ((1 << FLAG_ZERO) | (1 << FLAG_CARRY))) | (1 << FLAG_SUB) | (1 << FLAG_HCARRY);
-		return 4;
-	
-	case 0x09: //ADD HL BC
-		cpu.reg16[REG_HL] = DoAdd16(cpu.reg16[REG_HL], cpu.reg16[REG_BC]);
-		return 8;
-	case 0x19: //ADD HL DE
-		cpu.reg16[REG_HL] = DoAdd16(cpu.reg16[REG_HL], cpu.reg16[REG_DE]);
-		return 8;
-	case 0x29: //ADD HL HL
-		cpu.reg16[REG_HL] = DoAdd16(cpu.reg16[REG_HL], cpu.reg16[REG_HL]);
-		return 8;
-	case 0x39: //ADD HL SP
-		cpu.reg16[REG_HL] = DoAdd16(cpu.reg16[REG_HL], cpu.sp);
-		return 8;
-	case 0x03: //INC BC
-		cpu.reg16[REG_BC]++;
-		return 8;
-	case 0x13: //INC DE
-		cpu.reg16[REG_DE]++;
-		return 8;
-	case 0x23: //INC HL
-		cpu.reg16[REG_HL]++;
-		return 8;
-	case 0x33: //INC SP
-		cpu.sp++;
-		return 8;
-	case 0x0B: //DEC BC
-		cpu.reg16[REG_BC]--;
-		return 8;
-	case 0x1B: //DEC DE
-		cpu.reg16[REG_DE]--;
-		return 8;
-	case 0x2B: //DEC HL
-		cpu.reg16[REG_HL]--;
-		return 8;
-	case 0x3B: //DEC SP
-		cpu.sp--;
-		return 8;
-	case 0xE8: //ADD SP n
-	{
-		cpu.sp = DoAddSP((int8_t)ReadPCMem());
-		return 16;
-	}
-	case 0xF8: //LD HL SP+n
+	if constexpr (OP >= 0x40 && OP < 0x80) //LD reg reg, LD reg (HL), LD (HL) reg
 	{
-		cpu.reg16[REG_HL] = DoAddSP((int8_t)ReadPCMem());
-		return 12;
+		if constexpr (SRC == -1)
+		{
+			cpu->reg8[DST] = mem::Read(cpu->reg16[REG_HL]);
+			return 8;
+		}
+		else if constexpr (DST == -1)
+		{
+			mem::Write(cpu->reg16[REG_HL], cpu->reg8[SRC]);
+			return 8;
+		}
+		else
+		{
+			cpu->reg8[DST] = cpu->reg8[SRC];
+			return 4;
+		}
 	}
-	
-	case 0x07: //RLCA:
+	else if constexpr (OP >= 0x80 && OP < 0xC0) //ALU A reg, ALU A (HL)
 	{
-		uint8_t sout = cpu.reg8[REG_A] >> 7;
-		cpu.reg8[REG_A] = (cpu.reg8[REG_A] << 1) | sout;
-		cpu.reg8[REG_F] = sout << FLAG_CARRY;
-		return 4;
+		if constexpr (SRC == -1)
+		{
+			DoAccOp<(OP >> 3) & 7>(mem::Read(cpu->reg16[REG_HL]));
+			return 8;
+		}
+		else
+		{
+			DoAccOp<(OP >> 3) & 7>(cpu->reg8[SRC]);
+			return 4;
+		}
 	}
-	case 0x17: //RLA:
+	else if constexpr ((OP & 0xC7) == 0xC6) //ALU A n
 	{
-		uint8_t sout = cpu.reg8[REG_A] >> 7;
-		cpu.reg8[REG_A] = (cpu.reg8[REG_A] << 1) | CarryBit();
-		cpu.reg8[REG_F] = sout << FLAG_CARRY;
-		return 4;
+		DoAccOp<(OP >> 3) & 7>((uint8_t)imm);
+		return 8;
 	}
-	case 0x0F: //RRCA:
+	else if constexpr ((OP & 0xC7) == 0x04) //INC reg, INC (HL)
 	{
-		uint8_t sout = cpu.reg8[REG_A] & 1U;
-		cpu.reg8[REG_A] = (cpu.reg8[REG_A] >> 1) | (sout << 7);
-		cpu.reg8[REG_F] = sout << FLAG_CARRY;
-		return 4;
+		if constexpr (DST == -1)
+		{
+			uint8_t val = mem::Read(cpu->reg16[REG_HL]);
+			mem::Write(cpu->reg16[REG_HL], val + 1);
+			UpdateFlagsAfterInc(val);
+			return 12;
+		}
+		else
+		{
+			UpdateFlagsAfterInc(cpu->reg8[DST]++);
+			return 4;
+		}
 	}
-	case 0x1F: //RRA:
+	else if constexpr ((OP & 0xC7) == 0x05) //DEC reg, DEC (HL)
 	{
-		uint8_t sout = cpu.reg8[REG_A] & 1U;
-		cpu.reg8[REG_A] = (cpu.reg8[REG_A] >> 1) | (CarryBit() << 7);
-		cpu.reg8[REG_F] = sout << FLAG_CARRY;
-		return 4;
-	}
-	case 0xCB:
-	{
-		auto DoRLC = [] (uint8_t val)
-		{
-			const uint8_t newVal = (val << 1) | (val >> 7);
-			cpu.reg8[REG_F] = ((val >> 7) << FLAG_CARRY) | ((uint8_t)(newVal == 0) << FLAG_ZERO);
-			return newVal;
-		};
-		
-		auto DoRL = [] (uint8_t val)
+		if constexpr (DST == -1)
 		{
-			const uint8_t newVal = (val << 1) | CarryBit();
-			cpu.reg8[REG_F] = ((val >> 7) << FLAG_CARRY) | ((uint8_t)(newVal == 0) << FLAG_ZERO);
-			return newVal;
-		};
-		
-		auto DoRRC = [] (uint8_t val)
-		{
-			const uint8_t newVal = (val >> 1) | ((val & 1U) << 7);
-			cpu.reg8[REG_F] = ((val & 1U) << FLAG_CARRY) | ((uint8_t)(newVal == 0) << FLAG_ZERO);
-			return newVal;
-		};
-		
-		auto DoRR = [] (uint8_t val)
-		{
-			const uint8_t newVal = (val >> 1) | (CarryBit() << 7);
-			cpu.reg8[REG_F] = ((val & 1U) << FLAG_CARRY) | ((uint8_t)(newVal == 0) << FLAG_ZERO);
-			return newVal;
-		};
-		
-		auto DoSLA = [] (uint8_t val)
-		{
-			const uint8_t newVal = val << 1;
-			cpu.reg8[REG_F] = ((val >> 7) << FLAG_CARRY) | ((uint8_t)(newVal == 0) << FLAG_ZERO);
-			return newVal;
-		};
-		
-		auto DoSRA = [] (uint8_t val)
-		{
-			const uint8_t newVal = (val >> 1) | (val & 0x80U);
-			cpu.reg8[REG_F] = ((val & 1U) << FLAG_CARRY) | ((uint8_t)(newVal == 0) << FLAG_ZERO);
-			return newVal;
-		};
-		
-		auto DoSRL = [] (uint8_t val)
-		{
-			const uint8_t newVal = val >> 1;
-			cpu.reg8[REG_F] = ((val & 1U) << FLAG_CARRY) | ((uint8_t)(newVal == 0) << FLAG_ZERO);
-			return newVal;
-		};
-		
-		auto DoSWAP = [] (uint8_t val)
-		{
-			const uint8_t newVal = ((val & 0x0FU) << 4) | ((val & 0xF0U) >> 4);
-			cpu.reg8[REG_F] = ((uint8_t)(newVal == 0) << FLAG_ZERO);
-			return newVal;
-		};
-		
-		uint8_t op2 = ReadPCMem();
-		if (uint8_t bitOp = (op2 & 0xC0U))
-		{
-			uint8_t bit = (op2 >> 3) & 7;
-			auto DoTest = [&] (uint8_t val)
-			{
-				cpu.reg8[REG_F] = ((~(val >> bit) & 1) << FLAG_ZERO) | (1 << FLAG_HCARRY) | (cpu.reg8[REG_F] & (1 << FLAG_CARRY));
-			};
-			auto DoSet = [&] (uint8_t val)
-			{
-				return (val & ~(1 << bit)) | (1 << bit);
-			};
-			auto DoRes = [&] (uint8_t val)
-			{
-				return (val & ~(1 << bit));
-			};
-			
-			if ((op2 & 7) == 6)
-			{
-				const uint16_t addr = cpu.reg16[REG_HL];
-				uint8_t val = mem::Read(addr);
-				if (bitOp == 0x40)
-				{
-					DoTest(val);
-					return 12;
-				}
-				
-				if (bitOp == 0xC0)
-					val = DoSet(val);
-				else // bitOp == 0x80
-					val = DoRes(val);
-				mem::Write(addr, val);
-				return 16;
-			}
-			
-			int reg = OpRegToRegIdx[op2 & 7];
-			if (bitOp == 0x40)
-				DoTest(cpu.reg8[reg]);
-			else if (bitOp == 0xC0)
-				cpu.reg8[reg] = DoSet(cpu.reg8[reg]);
-			else // bitOp == 0x80
-				cpu.reg8[reg] = DoRes(cpu.reg8[reg]);
-			return 8;
-		}
-		
-		switch (op2)
-		{
-#define DEFINSTS_BIT(reg) \
-		case (0b00000000 | OP_REG_ ## reg): /* RLC reg */ { \
-			cpu.reg8[REG_ ## reg] = DoRLC(cpu.reg8[REG_ ## reg]); \
-			return 8; } \
-		case (0b00010000 | OP_REG_ ## reg): /* RL reg */ { \
-			cpu.reg8[REG_ ## reg] = DoRL(cpu.reg8[REG_ ## reg]); \
-			return 8; } \
-		case (0b00001000 | OP_REG_ ## reg): /* RRC reg */ { \
-			cpu.reg8[REG_ ## reg] = DoRRC(cpu.reg8[REG_ ## reg]); \
-			return 8; } \
-		case (0b00011000 | OP_REG_ ## reg): /* RR reg */ { \
-			cpu.reg8[REG_ ## reg] = DoRR(cpu.reg8[REG_ ## reg]); \
-			return 8; } \
-		case (0b00100000 | OP_REG_ ## reg): /* SLA reg */ { \
-			cpu.reg8[REG_ ## reg] = DoSLA(cpu.reg8[REG_ ## reg]); \
-			return 8; } \
-		case (0b00101000 | OP_REG_ ## reg): /* SRA reg */ { \
-			cpu.reg8[REG_ ## reg] = DoSRA(cpu.reg8[REG_ ## reg]); \
-			return 8; } \
-		case (0b00111000 | OP_REG_ ## reg): /* SRL reg */ { \
-			cpu.reg8[REG_ ## reg] = DoSRL(cpu.reg8[REG_ ## reg]); \
-			return 8; } \
-		case (0b00110000 | OP_REG_ ## reg): /* SWAP reg */ { \
-			cpu.reg8[REG_ ## reg] = DoSWAP(cpu.reg8[REG_ ## reg]); \
-			return 8; }
-			
-		DEFINSTS_BIT(A)
-		DEFINSTS_BIT(B)
-		DEFINSTS_BIT(C)
-		DEFINSTS_BIT(D)
-		DEFINSTS_BIT(E)
-		DEFINSTS_BIT(H)
-		DEFINSTS_BIT(L)
-			
-		case 0x06: //RLC (HL)
-		{
-			const uint16_t addr = cpu.reg16[REG_HL];
-			mem::Write(addr, DoRLC(mem::Read(addr)));
-			return 16;
-		}
-		case 0x16: //RL (HL)
-		{
-			const uint16_t addr = cpu.reg16[REG_HL];
-			mem::Write(addr, DoRL(mem::Read(addr)));
-			return 16;
-		}
-		case 0x0E: //RRC (HL)
-		{
-			const uint16_t addr = cpu.reg16[REG_HL];
-			mem::Write(addr, DoRRC(mem::Read(addr)));
-			return 16;
-		}
-		case 0x1E: //RR (HL)
-		{
-			const uint16_t addr = cpu.reg16[REG_HL];
-			mem::Write(addr, DoRR(mem::Read(addr)));
-			return 16;
-		}
-		case 0x26: //SLA (HL)
-		{
-			const uint16_t addr = cpu.reg16[REG_HL];
-			mem::Write(addr, DoSLA(mem::Read(addr)));
-			return 16;
-		}
-		case 0x2E: //SRA (HL)
-		{
-			const uint16_t addr = cpu.reg16[REG_HL];
-			mem::Write(addr, DoSRA(mem::Read(addr)));
-			return 16;
-		}
-		case 0x3E: //SRL (HL)
-		{
-			const uint16_t addr = cpu.reg16[REG_HL];
-			mem::Write(addr, DoSRL(mem::Read(addr)));
-			return 16;
+			uint8_t val = mem::Read(cpu->reg16[REG_HL]);
+			mem::Write(cpu->reg16[REG_HL], val - 1);
+			UpdateFlagsAfterDec(val);
+			return 12;
 		}
-		case 0x36: //SWAP (HL)
+		else
 		{
-			const uint16_t addr = cpu.reg16[REG_HL];
-			mem::Write(addr, DoSWAP(mem::Read(addr)));
-			return 16;
-		}
+			UpdateFlagsAfterDec(cpu->reg8[DST]--);
+			return 4;
 		}
-		break;
 	}
-	
-	case 0x3F: //CCF
-		cpu.reg8[REG_F] ^= 1 << FLAG_CARRY;
-		cpu.reg8[REG_F] &= 0x90;
-		return 4;
-	case 0x37: //SCF
-		cpu.reg8[REG_F] |= 1 << FLAG_CARRY;
-		cpu.reg8[REG_F] &= 0x90;
-		return 4;
-	
-	case 0x00: //NOP
-		return 4;
-	case 0x76: //HALT
-		cpu.halted = true;
-		return 4;
-	case 0x10: //STOP
-		if (cgbMode && ioReg[IOREG_KEY1] & 1)
+	else if constexpr ((OP & 0xC7) == 0x06) //LD reg n, LD (HL) n
+	{
+		if constexpr (DST == -1)
 		{
-			cpu.doubleSpeed = !cpu.doubleSpeed;
-			ioReg[IOREG_KEY1] &= 0xFE;
+			mem::Write(cpu->reg16[REG_HL], (uint8_t)imm);
+			return 12;
 		}
 		else
 		{
-			cpu.halted = true;
+			cpu->reg8[DST] = (uint8_t)imm;
+			return 8;
 		}
-		return 4;
-	case 0xF3: //DI
-		cpu.intEnableMaster = false;
-		return 4;
-	case 0xFB: //EI
-		cpu.intEnableMaster = true;
-		return 4;
-	
-	case 0xC3: //JP nn
-		cpu.pc = mem::Read16(cpu.pc);
-		return 16;
-	case 0xE9: //JP HL
-		cpu.pc = cpu.reg16[REG_HL];
-		return 4;
-	case 0xC2: //JP [NZ] nn
+	}
+	else if constexpr ((OP & 0xCF) == 0x01) //LD reg16 nn
 	{
-		uint16_t jmp = ReadPCMem16();
-		if (!(cpu.reg8[REG_F] & (1 << FLAG_ZERO)))
-		{
-			cpu.pc = jmp;
-			return 16;
-		}
+		if constexpr (REG16 > REG_HL)
+			cpu->sp = imm;
+		else
+			cpu->reg16[REG16] = imm;
 		return 12;
 	}
-	case 0xCA: //JP [Z] nn
+	else if constexpr ((OP & 0xCF) == 0x03) //INC reg16
 	{
-		uint16_t jmp = ReadPCMem16();
-		if (cpu.reg8[REG_F] & (1 << FLAG_ZERO))
-		{
-			cpu.pc = jmp;
-			return 16;
-		}
-		return 12;
+		if constexpr (REG16 > REG_HL)
+			cpu->sp++;
+		else
+			cpu->reg16[REG16]++;
+		return 8;
 	}
-	case 0xD2: //JP [NC] nn
+	else if constexpr ((OP & 0xCF) == 0x0B) //DEC reg16
 	{
-		uint16_t jmp = ReadPCMem16();
-		if (!(cpu.reg8[REG_F] & (1 << FLAG_CARRY)))
+		if constexpr (REG16 > REG_HL)
+			cpu->sp--;
+		else
+			cpu->reg16[REG16]--;
+		return 8;
+	}
+	else if constexpr ((OP & 0xCF) == 0x09) //ADD HL reg16
+	{
+		cpu->reg16[REG_HL] = DoAdd16(cpu->reg16[REG_HL], REG16 > REG_HL ? cpu->sp : cpu->reg16[REG16 & 3]);
+		return 8;
+	}
+	else if constexpr ((OP & 0xCF) == 0xC5) //PUSH reg16
+	{
+		if constexpr (REG16 > REG_HL)
+			MaterializeFlags();
+		cpu->sp -= 2;
+		mem::Write16(cpu->sp, cpu->reg16[REG16 & 3]);
+		return 16;
+	}
+	else if constexpr ((OP & 0xCF) == 0xC1) //POP reg16
+	{
+		if constexpr (REG16 > REG_HL)
 		{
-			cpu.pc = jmp;
-			return 16;
+			cpu->reg16[REG_AF] = mem::Read16(cpu->sp) & 0xFFF0U;
+			cpu->flagOp = FlagOp::None;
 		}
+		else
+			cpu->reg16[REG16] = mem::Read16(cpu->sp);
+		cpu->sp += 2;
 		return 12;
 	}
-	case 0xDA: //JP [C] nn
+	else if constexpr ((OP & 0xE7) == 0xC2) //JP [cond] nn
 	{
-		uint16_t jmp = ReadPCMem16();
-		if (cpu.reg8[REG_F] & (1 << FLAG_CARRY))
+		if (CheckCondition<COND>())
 		{
-			cpu.pc = jmp;
+			cpu->pc = imm;
 			return 16;
 		}
 		return 12;
 	}
-		
-	case 0x18: //JR n
-		cpu.pc += (int8_t)mem::Read(cpu.pc) + 1;
-		return 12;
-	case 0x20: //JR [NZ] n
+	else if constexpr ((OP & 0xE7) == 0x20) //JR [cond] n
 	{
-		int8_t jmp = (int8_t)ReadPCMem();
-		if (!(cpu.reg8[REG_F] & (1 << FLAG_ZERO)))
+		if (CheckCondition<COND>())
 		{
-			cpu.pc += jmp;
+			cpu->pc += (int8_t)imm;
 			return 12;
 		}
 		return 8;
 	}
-	case 0x28: //JR [Z] n
+	else if constexpr ((OP & 0xE7) == 0xC4) //CALL [cond] nn
 	{
-		int8_t jmp = (int8_t)ReadPCMem();
-		if (cpu.reg8[REG_F] & (1 << FLAG_ZERO))
+		if (CheckCondition<COND>())
 		{
-			cpu.pc += jmp;
-			return 12;
+			DoCall(imm);
+			return 24;
 		}
-		return 8;
+		return 12;
 	}
-	case 0x30: //JR [NC] n
+	else if constexpr ((OP & 0xE7) == 0xC0) //RET [cond]
 	{
-		int8_t jmp = (int8_t)ReadPCMem();
-		if (!(cpu.reg8[REG_F] & (1 << FLAG_CARRY)))
+		if (CheckCondition<COND>())
 		{
-			cpu.pc += jmp;
-			return 12;
+			DoRet();
+			return 20;
 		}
 		return 8;
 	}
-	case 0x38: //JR [C] n
+	else if constexpr ((OP & 0xC7) == 0xC7) //RST
 	{
-		int8_t jmp = (int8_t)ReadPCMem();
-		if (cpu.reg8[REG_F] & (1 << FLAG_CARRY))
-		{
-			cpu.pc += jmp;
-			return 12;
-		}
-		return 8;
+		DoCall(OP & 0x38);
+		return 16;
 	}
-	
-	case 0xCD: //CALL nn
-		DoCall(ReadPCMem16());
-		return 24;
-	case 0xC4: //CALL [NZ] nn
+	else
 	{
-		uint16_t jmp = ReadPCMem16();
-		if (!(cpu.reg8[REG_F] & (1 << FLAG_ZERO)))
-		{
-			DoCall(jmp);
-			return 24;
-		}
-		return 12;
+		UnknownOpcode(OP);
+	}
+}
+
+#define DEFINST(op) template <> int ExecOp<op>(uint16_t imm)
+
+//Operations for loading and storing registers to memory
+DEFINST(0x0A) //LD A (BC)
+{
+	cpu->reg8[REG_A] = mem::Read(cpu->reg16[REG_BC]);
+	return 8;
+}
+DEFINST(0x1A) //LD A (DE)
+{
+	cpu->reg8[REG_A] = mem::Read(cpu->reg16[REG_DE]);
+	return 8;
+}
+DEFINST(0xFA) //LD A (nn)
+{
+	cpu->reg8[REG_A] = mem::Read(imm);
+	return 16;
+}
+DEFINST(0x02) //LD (BC) A
+{
+	mem::Write(cpu->reg16[REG_BC], cpu->reg8[REG_A]);
+	return 8;
+}
+DEFINST(0x12) //LD (DE) A
+{
+	mem::Write(cpu->reg16[REG_DE], cpu->reg8[REG_A]);
+	return 8;
+}
+DEFINST(0xEA) //LD (nn) A
+{
+	mem::Write(imm, cpu->reg8[REG_A]);
+	return 16;
+}
+DEFINST(0x08) //LD (nn) SP
+{
+	mem::Write16(imm, cpu->sp);
+	return 20;
+}
+
+//Operations for loading and storing to I/O registers
+DEFINST(0xF0) //LD A (FF00+n)
+{
+	cpu->reg8[REG_A] = mem::Read(0xFF00 + imm);
+	return 12;
+}
+DEFINST(0xE0) //LD (FF00+n) A
+{
+	mem::Write(0xFF00 + imm, cpu->reg8[REG_A]);
+	return 12;
+}
+DEFINST(0xF2) //LD A (FF00+C)
+{
+	cpu->reg8[REG_A] = mem::Read(0xFF00 + cpu->reg8[REG_C]);
+	return 8;
+}
+DEFINST(0xE2) //LD (FF00+C) A
+{
+	mem::Write(0xFF00 + cpu->reg8[REG_C], cpu->reg8[REG_A]);
+	return 8;
+}
+
+//Operations for loading and storing the A register to memory at HL and incrementing/decrementing HL
+DEFINST(0x22) //LDI (HL) A
+{
+	mem::Write(cpu->reg16[REG_HL]++, cpu->reg8[REG_A]);
+	return 8;
+}
+DEFINST(0x2A) //LDI A (HL)
+{
+	cpu->reg8[REG_A] = mem::Read(cpu->reg16[REG_HL]++);
+	return 8;
+}
+DEFINST(0x32) //LDD (HL) A
+{
+	mem::Write(cpu->reg16[REG_HL]--, cpu->reg8[REG_A]);
+	return 8;
+}
+DEFINST(0x3A) //LDD A (HL)
+{
+	cpu->reg8[REG_A] = mem::Read(cpu->reg16[REG_HL]--);
+	return 8;
+}
+
+DEFINST(0xF9) //LD SP HL
+{
+	cpu->sp = cpu->reg16[REG_HL];
+	return 8;
+}
+
+DEFINST(0x27) //DAA
+{
+	MaterializeFlags();
+	int add = 0;
+	bool carry = cpu->reg8[REG_F] & (1 << FLAG_CARRY);
+	const bool sub = cpu->reg8[REG_F] & (1 << FLAG_SUB);
+	if ((cpu->reg8[REG_F] & (1 << FLAG_HCARRY)) || (!sub && (cpu->reg8[REG_A] & 0xf) > 9)) {
+		add = 6;
+	}
+	if (carry || (!sub && cpu->reg8[REG_A] > 0x99)) {
+		add |= 0x60;
+		carry = 1;
 	}
-	case 0xCC: //CALL [Z] nn
+	cpu->reg8[REG_A] += sub ? -add : add;
+	
+	cpu->reg8[REG_F] = (cpu->reg8[REG_F] & (1 << FLAG_SUB)) |
+		((cpu->reg8[REG_A] == 0) << FLAG_ZERO) | ((uint8_t)carry << FLAG_CARRY);
+	
+	return 4;
+}
+
+DEFINST(0x2F) //CPL A
+{
+	MaterializeFlags();
+	cpu->reg8[REG_A] = ~cpu->reg8[REG_A];
+	cpu->reg8[REG_F] = (cpu->reg8[REG_F] & ((1 << FLAG_ZERO) | (1 << FLAG_CARRY))) | (1 << FLAG_SUB) | (1 << FLAG_HCARRY);
+	return 4;
+}
+
+DEFINST(0xE8) //ADD SP n
+{
+	cpu->sp = DoAddSP((int8_t)imm);
+	return 16;
+}
+DEFINST(0xF8) //LD HL SP+n
+{
+	cpu->reg16[REG_HL] = DoAddSP((int8_t)imm);
+	return 12;
+}
+
+DEFINST(0x07) //RLCA
+{
+	uint8_t sout = cpu->reg8[REG_A] >> 7;
+	cpu->reg8[REG_A] = (cpu->reg8[REG_A] << 1) | sout;
+	SetFlags(sout << FLAG_CARRY);
+	return 4;
+}
+DEFINST(0x17) //RLA
+{
+	uint8_t sout = cpu->reg8[REG_A] >> 7;
+	cpu->reg8[REG_A] = (cpu->reg8[REG_A] << 1) | CarryBit();
+	SetFlags(sout << FLAG_CARRY);
+	return 4;
+}
+DEFINST(0x0F) //RRCA
+{
+	uint8_t sout = cpu->reg8[REG_A] & 1U;
+	cpu->reg8[REG_A] = (cpu->reg8[REG_A] >> 1) | (sout << 7);
+	SetFlags(sout << FLAG_CARRY);
+	return 4;
+}
+DEFINST(0x1F) //RRA
+{
+	uint8_t sout = cpu->reg8[REG_A] & 1U;
+	cpu->reg8[REG_A] = (cpu->reg8[REG_A] >> 1) | (CarryBit() << 7);
+	SetFlags(sout << FLAG_CARRY);
+	return 4;
+}
+
+DEFINST(0x3F) //CCF
+{
+	MaterializeFlags();
+	cpu->reg8[REG_F] ^= 1 << FLAG_CARRY;
+	cpu->reg8[REG_F] &= 0x90;
+	return 4;
+}
+DEFINST(0x37) //SCF
+{
+	MaterializeFlags();
+	cpu->reg8[REG_F] |= 1 << FLAG_CARRY;
+	cpu->reg8[REG_F] &= 0x90;
+	return 4;
+}
+
+DEFINST(0x00) //NOP
+{
+	return 4;
+}
+DEFINST(0x76) //HALT
+{
+	cpu->halted = true;
+	return 4;
+}
+DEFINST(0x10) //STOP
+{
+	if (mem::memory->cgbMode && mem::memory->ioReg[IOREG_KEY1] & 1)
 	{
-		uint16_t jmp = ReadPCMem16();
-		if (cpu.reg8[REG_F] & (1 << FLAG_ZERO))
-		{
-			DoCall(jmp);
-			return 24;
-		}
-		return 12;
+		cpu->doubleSpeed = !cpu->doubleSpeed;
+		mem::memory->ioReg[IOREG_KEY1] &= 0xFE;
 	}
-	case 0xD4: //CALL [NC] nn
+	else
 	{
-		uint16_t jmp = ReadPCMem16();
-		if (!(cpu.reg8[REG_F] & (1 << FLAG_CARRY)))
-		{
-			DoCall(jmp);
-			return 24;
-		}
-		return 12;
+		cpu->halted = true;
 	}
-	case 0xDC: //CALL [C] nn
+	return 4;
+}
+DEFINST(0xF3) //DI
+{
+	cpu->intEnableMaster = false;
+	return 4;
+}
+DEFINST(0xFB) //EI
+{
+	cpu->intEnableMaster = true;
+	return 4;
+}
+
+DEFINST(0xC3) //JP nn
+{
+	cpu->pc = imm;
+	return 16;
+}
+DEFINST(0xE9) //JP HL
+{
+	cpu->pc = cpu->reg16[REG_HL];
+	return 4;
+}
+DEFINST(0x18) //JR n
+{
+	cpu->pc += (int8_t)imm;
+	return 12;
+}
+DEFINST(0xCD) //CALL nn
+{
+	DoCall(imm);
+	return 24;
+}
+DEFINST(0xC9) //RET
+{
+	DoRet();
+	return 16;
+}
+DEFINST(0xD9) //RETI
+{
+	DoRet();
+	cpu->intEnableMaster = true;
+	return 16;
+}
+
+template <size_t... I>
+constexpr std::array<OpHandler, 256> MakeOpTable(std::index_sequence<I...>)
+{
+	return { { &ExecOp<(uint8_t)I>... } };
+}
+
+template <size_t... I>
+constexpr std::array<OpHandler, 256> MakeCBOpTable(std::index_sequence<I...>)
+{
+	return { { &ExecCBOp<(uint8_t)I>... } };
+}
+
+static constexpr std::array<OpHandler, 256> cbOpTable = MakeCBOpTable(std::make_index_sequence<256>());
+
+DEFINST(0xCB) //CB prefix
+{
+	return cbOpTable[(uint8_t)imm](0);
+}
+
+static constexpr std::array<OpHandler, 256> opTable = MakeOpTable(std::make_index_sequence<256>());
+
+//Expands X(00) ... X(FF) for every opcode, used to generate switch cases and goto labels
+#define FOR_EACH_OPCODE_ROW(X, hi) \
+	X(hi##0) X(hi##1) X(hi##2) X(hi##3) X(hi##4) X(hi##5) X(hi##6) X(hi##7) \
+	X(hi##8) X(hi##9) X(hi##A) X(hi##B) X(hi##C) X(hi##D) X(hi##E) X(hi##F)
+#define FOR_EACH_OPCODE(X) \
+	FOR_EACH_OPCODE_ROW(X, 0) FOR_EACH_OPCODE_ROW(X, 1) FOR_EACH_OPCODE_ROW(X, 2) FOR_EACH_OPCODE_ROW(X, 3) \
+	FOR_EACH_OPCODE_ROW(X, 4) FOR_EACH_OPCODE_ROW(X, 5) FOR_EACH_OPCODE_ROW(X, 6) FOR_EACH_OPCODE_ROW(X, 7) \
+	FOR_EACH_OPCODE_ROW(X, 8) FOR_EACH_OPCODE_ROW(X, 9) FOR_EACH_OPCODE_ROW(X, A) FOR_EACH_OPCODE_ROW(X, B) \
+	FOR_EACH_OPCODE_ROW(X, C) FOR_EACH_OPCODE_ROW(X, D) FOR_EACH_OPCODE_ROW(X, E) FOR_EACH_OPCODE_ROW(X, F)
+
+template <DispatchMode Mode>
+inline int DispatchInstruction(uint8_t instruction, uint16_t imm)
+{
+	if constexpr (Mode == DispatchMode::Switch)
 	{
-		uint16_t jmp = ReadPCMem16();
-		if (cpu.reg8[REG_F] & (1 << FLAG_CARRY))
+		switch (instruction)
 		{
-			DoCall(jmp);
-			return 24;
+#define DISPATCH_CASE(n) case 0x##n: return ExecOp<0x##n>(imm);
+		FOR_EACH_OPCODE(DISPATCH_CASE)
+#undef DISPATCH_CASE
 		}
-		return 12;
+		return 0;
 	}
+#ifdef GBEMU_COMPUTED_GOTO
+	else if constexpr (Mode == DispatchMode::LabelTable)
+	{
+		//The CB prefix jumps straight into the second label table instead of going through a handler
+#define DISPATCH_LABEL_ADDR(n) (0x##n == 0xCB ? &&opcode_cb_prefix : &&opcode_##n),
+#define DISPATCH_LABEL(n) opcode_##n: return ExecOp<0x##n>(imm);
+#define DISPATCH_CB_LABEL_ADDR(n) &&cbopcode_##n,
+#define DISPATCH_CB_LABEL(n) cbopcode_##n: return ExecCBOp<0x##n>(0);
+		static void* const labels[256] = { FOR_EACH_OPCODE(DISPATCH_LABEL_ADDR) };
+		static void* const cbLabels[256] = { FOR_EACH_OPCODE(DISPATCH_CB_LABEL_ADDR) };
 		
-	case 0xC9: //RET
-		DoRet();
-		return 16;
-	case 0xC0: //RET [NZ]
-		if (!(cpu.reg8[REG_F] & (1 << FLAG_ZERO)))
+		goto *labels[instruction];
+		FOR_EACH_OPCODE(DISPATCH_LABEL)
+	opcode_cb_prefix:
+		goto *cbLabels[(uint8_t)imm];
+		FOR_EACH_OPCODE(DISPATCH_CB_LABEL)
+#undef DISPATCH_LABEL_ADDR
+#undef DISPATCH_LABEL
+#undef DISPATCH_CB_LABEL_ADDR
+#undef DISPATCH_CB_LABEL
+	}
+#endif
+	else
+	{
+		return opTable[instruction](imm);
+	}
+}
+
+bool DecodeInstruction(uint16_t address, DecodedInstruction& entry)
+{
+	const uint8_t instruction = mem::Read(address);
+	
+	entry.length = 1 + OPERAND_LENGTH[instruction];
+	if (address < 0x8000 && (address & 0x3FFF) + entry.length > 0x4000)
+		return false;
+	
+	if (entry.length == 2)
+		entry.imm = mem::Read(address + 1);
+	else if (entry.length == 3)
+		entry.imm = mem::Read16(address + 1);
+	else
+		entry.imm = 0;
+	
+	if (instruction == 0xCB)
+	{
+		entry.handler = cbOpTable[entry.imm];
+		entry.cycles = CBInstructionCycles(entry.imm);
+	}
+	else
+	{
+		entry.handler = opTable[instruction];
+		entry.cycles = INSTRUCTION_CYCLES[instruction];
+	}
+	return true;
+}
+
+//Checks for interrupts and the halted state, returns a non-zero cycle count if no instruction should run
+template <bool DebugHooks>
+inline int ServiceInterrupts()
+{
+	if (uint32_t intFlags = cpu->intEnableReg & mem::memory->ioReg[IOREG_IF])
+	{
+		int interrupt = __builtin_ctz(intFlags);
+		if (cpu->intEnableMaster)
 		{
-			DoRet();
+			if (DebugHooks && verboseMode)
+				trace::RecordInterrupt(interrupt);
+			mem::memory->ioReg[IOREG_IF] &= ~(1 << interrupt);
+			
+			cpu->intEnableMaster = false;
+			DoCall(INTERRUPT_TARGETS[interrupt]);
+			
+			if (cpu->halted)
+			{
+				cpu->halted = false;
+				return 24;
+			}
 			return 20;
 		}
-		return 8;
-	case 0xC8: //RET [Z]
-		if (cpu.reg8[REG_F] & (1 << FLAG_ZERO))
+		else if (cpu->halted)
 		{
-			DoRet();
-			return 20;
+			cpu->halted = false;
+			return 4;
 		}
-		return 8;
-	case 0xD0: //RET [NC]
-		if (!(cpu.reg8[REG_F] & (1 << FLAG_CARRY)))
+	}
+	
+	if (cpu->halted)
+		return 4;
+	return 0;
+}
+
+template <DispatchMode Mode, bool DebugHooks>
+inline int ExecuteInstruction()
+{
+	if constexpr (DebugHooks)
+	{
+		if (verboseMode)
+			trace::RecordInstruction();
+		
+		if (IsBreakpoint(cpu->pc))
 		{
-			DoRet();
-			return 20;
+			std::cout << "@" << std::hex << cpu->pc << std::endl;
+			if (verboseMode)
+				trace::Flush();
+			//raise(SIGTRAP);
 		}
-		return 8;
-	case 0xD8: //RET [C]
-		if (cpu.reg8[REG_F] & (1 << FLAG_CARRY))
+	}
+	
+	if constexpr (Mode == DispatchMode::Predecoded)
+	{
+		DecodedInstruction* entry = decode::Lookup(cpu->pc);
+		if (entry != nullptr && (entry->handler != nullptr || DecodeInstruction(cpu->pc, *entry)))
 		{
-			DoRet();
-			return 20;
+			cpu->pc += entry->length;
+			return entry->handler(entry->imm);
 		}
-		return 8;
-		
-	case 0xD9: //RETI
-		DoRet();
-		cpu.intEnableMaster = true;
-		return 16;
-		
-	case 0xC7: //RST 00
-		DoCall(0x00);
-		return 16;
-	case 0xD7: //RST 10
-		DoCall(0x10);
-		return 16;
-	case 0xE7: //RST 20
-		DoCall(0x20);
-		return 16;
-	case 0xF7: //RST 30
-		DoCall(0x30);
-		return 16;
-	case 0xCF: //RST 08
-		DoCall(0x08);
-		return 16;
-	case 0xDF: //RST 18
-		DoCall(0x18);
-		return 16;
-	case 0xEF: //RST 28
-		DoCall(0x28);
-		return 16;
-	case 0xFF: //RST 38
-		DoCall(0x38);
-		return 16;
 	}
 	
-	std::cerr << "Unknown opcode " << std::hex << (int)instruction << "\n";
-	std::abort();
+	const uint8_t instruction = ReadPCMem();
 	
-	return 0;
+	uint16_t imm = 0;
+	if (OPERAND_LENGTH[instruction] == 1)
+		imm = ReadPCMem();
+	else if (OPERAND_LENGTH[instruction] == 2)
+		imm = ReadPCMem16();
+	
+	return DispatchInstruction<Mode>(instruction, imm);
+}
+
+template <DispatchMode Mode>
+static int ExecuteInstructionProfiled()
+{
+	const uint8_t instruction = mem::Read(cpu->pc);
+	const int opcode = instruction == 0xCB ? 0x100 | mem::Read(cpu->pc + 1) : instruction;
+	
+	const uint64_t startTicks = profiler::ReadTimestamp();
+	const int cycles = ExecuteInstruction<Mode, true>();
+	
+	profiler::OpcodeStats& stats = profiler::opcodeStats[opcode];
+	stats.ticks += profiler::ReadTimestamp() - startTicks;
+	stats.cycles += cycles;
+	stats.count++;
+	return cycles;
+}
+
+template <DispatchMode Mode, bool DebugHooks>
+int StepCPUWithDispatch()
+{
+	if (int cycles = ServiceInterrupts<DebugHooks>())
+		return cycles;
+	if constexpr (DebugHooks)
+	{
+		if (profiler::enabled)
+			return ExecuteInstructionProfiled<Mode>();
+	}
+	return ExecuteInstruction<Mode, DebugHooks>();
+}
+
+template int StepCPUWithDispatch<DispatchMode::Switch, false>();
+template int StepCPUWithDispatch<DispatchMode::Table, false>();
+template int StepCPUWithDispatch<DispatchMode::Predecoded, false>();
+template int StepCPUWithDispatch<DispatchMode::Predecoded, true>();
+#ifdef GBEMU_COMPUTED_GOTO
+template int StepCPUWithDispatch<DispatchMode::LabelTable, false>();
+#endif
+
+int StepCPU()
+{
+	if (emulator->debugHooksEnabled)
+		return StepCPUWithDispatch<DEFAULT_DISPATCH_MODE, true>();
+	return StepCPUWithDispatch<DEFAULT_DISPATCH_MODE, false>();
+}
+
+int StepCPUJit(int maxCycles)
+{
+	//Blocks skip the per instruction checks, so they never run while debugging
+	if (emulator->debugHooksEnabled)
+		return StepCPUWithDispatch<DEFAULT_DISPATCH_MODE, true>();
+	
+	if (int cycles = ServiceInterrupts<false>())
+		return cycles;
+	
+	//Blocks are only compiled from ROM
+	if (cpu->pc < 0x8000)
+	{
+		if (int cycles = jit::RunBlock(cpu->pc, *decode::Lookup(cpu->pc), maxCycles))
+			return cycles;
+	}
+	
+	return ExecuteInstruction<DEFAULT_DISPATCH_MODE, false>();
 }
@@ -50,6 +50,20 @@ enum
 	INT_JOYPAD   = 4
 };
 
+//ALU operation whose flags haven't been written to F yet
+enum class FlagOp : uint8_t
+{
+	None,
+	Add,
+	Adc,
+	Sub,
+	Sbc,
+	And,
+	Logic,
+	Inc,
+	Dec
+};
+
 struct CPU
 {
 	union
@@ -64,17 +78,65 @@ struct CPU
 	
 	uint8_t intEnableReg;
 	bool intEnableMaster;
+	
+	//F is evaluated lazily from the operands of the last ALU operation, so reg8[REG_F] is only
+	//up to date when flagOp is None. Code outside the CPU core should read F through GetFlags.
+	FlagOp flagOp;
+	uint8_t flagOperand;
+	uint8_t flagDelta;
+	uint8_t flagCarryIn;
+	uint8_t flagResult;
 };
 
-extern CPU cpu;
+//The CPU of the machine bound to the calling thread, see Machine::Bind
+extern thread_local CPU* cpu;
+
+uint8_t GetFlags(const CPU& _cpu);
+
+//Writes pending lazy flags to F so that reg8[REG_F] and reg16[REG_AF] can be accessed directly
+void MaterializeFlags();
 
 void InitInstructionDebug();
-void PrintNextInstruction();
 
-void AddBreakpoint(uint16_t pc);
+//Returns the length in bytes of the instruction starting with an opcode, including the opcode
+int InstructionLength(uint8_t opcode);
+
+//Returns the name of an opcode, CB prefixed opcodes are 0x100 + the second byte. Requires InitInstructionDebug.
+const char* InstructionName(int opcode);
+
+//Breaks at an address in any ROM bank, or only when romBank is mapped at 0x4000 if it isn't -1
+void AddBreakpoint(uint16_t pc, int romBank = -1);
 
 std::ostream& operator<<(std::ostream&, const CPU& _cpu);
 
 void InitCPU();
 
+//Labels as values are a GNU extension, other compilers fall back to the handler table
+#if defined(__GNUC__) && !defined(GBEMU_NO_COMPUTED_GOTO)
+#define GBEMU_COMPUTED_GOTO
+#endif
+
+//Switch and Table call the same handlers. LabelTable jumps to them through a table of label addresses, with one
+//central indirect jump per instruction. Predecoded looks instructions up in the decode cache and falls back to the
+//handler table.
+enum class DispatchMode
+{
+	Switch,
+	Table,
+	LabelTable,
+	Predecoded
+};
+
+constexpr DispatchMode DEFAULT_DISPATCH_MODE = DispatchMode::Predecoded;
+
+//DebugHooks compiles in verbose printing and breakpoint checks, instantiations without them pay nothing for the debugger
+template <DispatchMode Mode, bool DebugHooks = false>
+int StepCPUWithDispatch();
+
+//Runs one instruction, with debug hooks if debugHooksEnabled is set
 int StepCPU();
+
+//Like StepCPU, but may run a whole block of recompiled instructions. Stops once maxCycles have been used.
+int StepCPUJit(int maxCycles);
+
+void RunDispatchBenchmark(const char* romPath);
@@ -0,0 +1,84 @@
+#include "CPU.hpp"
+#include "Memory.hpp"
+#include "GPU.hpp"
+#include "Common.hpp"
+#include "JIT.hpp"
+#include "Emulator.hpp"
+#include "IdleLoop.hpp"
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+
+static constexpr uint64_t BENCHMARK_CYCLES = (uint64_t)CLOCK_RATE * 60;
+static constexpr uint32_t CYCLES_PER_LINE = 456;
+
+//Runs the loaded ROM for a fixed number of emulated cycles using one dispatch strategy.
+//Stepping the CPU directly doesn't run scheduled events, so unless step is RunCycles, LY and the VBlank interrupt
+//are faked to keep games progressing. step is called with the number of cycles left until the next line, or a whole line
+//when lines aren't faked, and returns the cycles it used.
+template <typename StepFn>
+static void RunBenchmarkPass(const char* romPath, const char* name, StepFn step, bool fakeLines = true)
+{
+	if (!mem::Init(romPath))
+	{
+		std::cerr << "Failed to load ROM for benchmark\n";
+		return;
+	}
+	InitCPU();
+	
+	uint64_t elapsedCycles = 0;
+	uint64_t instructions = 0;
+	uint32_t lineCycles = 0;
+	
+	auto startTime = std::chrono::high_resolution_clock::now();
+	
+	while (elapsedCycles < BENCHMARK_CYCLES)
+	{
+		//RunCycles keeps the lines itself, so it's always given a whole line
+		int cycles = step(fakeLines ? CYCLES_PER_LINE - lineCycles : CYCLES_PER_LINE);
+		elapsedCycles += cycles;
+		instructions++;
+		
+		if (!fakeLines)
+			continue;
+		
+		lineCycles += cycles;
+		if (lineCycles >= CYCLES_PER_LINE)
+		{
+			lineCycles -= CYCLES_PER_LINE;
+			gpu::ppu->reg.ly = (gpu::ppu->reg.ly + 1) % 154;
+			if (gpu::ppu->reg.ly == RES_Y)
+				mem::memory->ioReg[IOREG_IF] |= 1 << INT_VBLANK;
+		}
+	}
+	
+	double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - startTime).count();
+	
+	std::cout << std::left << std::setw(14) << name << std::right << std::fixed << std::setprecision(2)
+		<< std::setw(10) << (instructions / seconds / 1E6) << " MIPS"
+		<< std::setw(10) << (seconds * 1E9 / instructions) << " ns/inst"
+		<< std::setw(10) << (elapsedCycles / seconds / CLOCK_RATE) << "x realtime\n";
+}
+
+void RunDispatchBenchmark(const char* romPath)
+{
+	std::cout << "Running " << (BENCHMARK_CYCLES / CLOCK_RATE) << " emulated seconds per dispatch mode\n";
+	
+	RunBenchmarkPass(romPath, "switch", [] (int) { return StepCPUWithDispatch<DispatchMode::Switch>(); });
+	RunBenchmarkPass(romPath, "table", [] (int) { return StepCPUWithDispatch<DispatchMode::Table>(); });
+#ifdef GBEMU_COMPUTED_GOTO
+	RunBenchmarkPass(romPath, "label table", [] (int) { return StepCPUWithDispatch<DispatchMode::LabelTable>(); });
+#endif
+	RunBenchmarkPass(romPath, "predecoded", [] (int) { return StepCPUWithDispatch<DispatchMode::Predecoded>(); });
+#ifdef GBEMU_JIT
+	RunBenchmarkPass(romPath, "jit", StepCPUJit);
+#endif
+	
+	idle::enabled = false;
+	RunBenchmarkPass(romPath, "run cycles", RunCycles, false);
+	idle::enabled = true;
+	RunBenchmarkPass(romPath, "idle skipping", RunCycles, false);
+	idle::PrintStats(std::cout);
+	PrintMemoryFootprint(std::cout);
+}
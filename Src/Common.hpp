@@ -6,14 +6,13 @@
 #include "CPU.hpp"
 
 extern bool devMode;
-extern bool cgbMode;
 extern bool verboseMode;
 
 constexpr int CLOCK_RATE = 4194304;
 
 inline int64_t NSPerClockCycle()
 {
-	return cpu.doubleSpeed ? (500000000LL / CLOCK_RATE) : (1000000000LL / CLOCK_RATE);
+	return cpu->doubleSpeed ? (500000000LL / CLOCK_RATE) : (1000000000LL / CLOCK_RATE);
 }
 
 inline int64_t NanoTime()
@@ -0,0 +1,101 @@
+#include "DecodeCache.hpp"
+#include "Memory.hpp"
+
+#include <vector>
+#include <memory>
+#include <cstring>
+
+namespace decode
+{
+	static constexpr size_t ROM_BANK_SIZE = 16 * 1024;
+	static constexpr size_t WRAM_SIZE = 32 * 1024;
+	
+	thread_local Cache* cache;
+	
+	void Clear()
+	{
+		cache->romEntries.clear();
+		cache->wramEntries.reset();
+		std::memset(cache->hramEntries, 0, sizeof(cache->hramEntries));
+		cache->romBank0Entries = nullptr;
+		cache->romBankEntries = nullptr;
+	}
+	
+	static DecodedInstruction* GetRomBankEntries(uint32_t bankIdx)
+	{
+		if (bankIdx >= cache->romEntries.size())
+			cache->romEntries.resize(bankIdx + 1);
+		if (!cache->romEntries[bankIdx])
+			cache->romEntries[bankIdx].reset(new DecodedInstruction[ROM_BANK_SIZE]());
+		return cache->romEntries[bankIdx].get();
+	}
+	
+	void OnRomBankChanged(uint32_t bankIdx)
+	{
+		cache->currentRomBank = bankIdx;
+		cache->romBankEntries = bankIdx < cache->romEntries.size() ? cache->romEntries[bankIdx].get() : nullptr;
+	}
+	
+	void InvalidateRAM(const uint8_t* ptr)
+	{
+		//An instruction is at most 3 bytes long, so the written byte can belong to one starting up to 2 bytes earlier
+		if (cache->wramEntries && ptr >= mem::memory->wram && ptr < mem::memory->wram + WRAM_SIZE)
+		{
+			size_t offset = ptr - mem::memory->wram;
+			for (size_t i = offset >= 2 ? offset - 2 : 0; i <= offset; i++)
+				cache->wramEntries[i].handler = nullptr;
+		}
+		else if (ptr >= mem::memory->hram && ptr < mem::memory->hram + HRAM_SIZE)
+		{
+			size_t offset = ptr - mem::memory->hram;
+			for (size_t i = offset >= 2 ? offset - 2 : 0; i <= offset; i++)
+				cache->hramEntries[i].handler = nullptr;
+		}
+	}
+	
+	size_t MemoryFootprint()
+	{
+		size_t entries = HRAM_SIZE;
+		for (const std::unique_ptr<DecodedInstruction[]>& bankEntries : cache->romEntries)
+		{
+			if (bankEntries)
+				entries += ROM_BANK_SIZE;
+		}
+		if (cache->wramEntries)
+			entries += WRAM_SIZE;
+		return entries * sizeof(DecodedInstruction) + cache->romEntries.capacity() * sizeof(cache->romEntries[0]);
+	}
+	
+	void ClearRAM()
+	{
+		if (cache->wramEntries)
+			std::memset(cache->wramEntries.get(), 0, sizeof(DecodedInstruction) * WRAM_SIZE);
+		std::memset(cache->hramEntries, 0, sizeof(cache->hramEntries));
+	}
+	
+	DecodedInstruction* LookupSlow(uint16_t address)
+	{
+		switch (address)
+		{
+		case 0x0000 ... 0x3FFF:
+			cache->romBank0Entries = GetRomBankEntries(0);
+			return &cache->romBank0Entries[address];
+		case 0x4000 ... 0x7FFF:
+			cache->romBankEntries = GetRomBankEntries(cache->currentRomBank);
+			return &cache->romBankEntries[address - 0x4000];
+		case 0xC000 ... 0xFDFF:
+		{
+			//Instructions that cross into the next 4KB block aren't cached since that block may be banked
+			if ((address & 0xFFF) > 0xFFD)
+				return nullptr;
+			if (!cache->wramEntries)
+				cache->wramEntries.reset(new DecodedInstruction[WRAM_SIZE]());
+			return &cache->wramEntries[mem::GetHostPointer(address) - mem::memory->wram];
+		}
+		case 0xFF80 ... 0xFFFC:
+			return &cache->hramEntries[address - 0xFF80];
+		default:
+			return nullptr;
+		}
+	}
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <memory>
+
+using OpHandler = int(*)(uint16_t imm);
+
+struct DecodedInstruction
+{
+	OpHandler handler; //nullptr until the instruction has been decoded
+	uint16_t imm;
+	uint8_t length;
+	uint8_t cycles;    //Cycles used, or the cycles for the untaken path of conditional instructions
+	uint16_t jitHits;  //Times the JIT has seen this address as a block entry
+	uint16_t jitBlock; //1-based index of the compiled block starting here, 0 if there is none
+};
+
+//Fills in a decode cache entry, returns false if the instruction crosses into a bank that may be switched.
+//Implemented in CPU.cpp since it needs the opcode handler tables.
+bool DecodeInstruction(uint16_t address, DecodedInstruction& entry);
+
+namespace decode
+{
+	static constexpr size_t HRAM_SIZE = 127;
+	
+	//The decoded instructions of a machine, only used on the CPU thread
+	struct Cache
+	{
+		//The entries of ROM bank 0 and of the bank mapped at 0x4000, null until the bank is first looked up
+		DecodedInstruction* romBank0Entries;
+		DecodedInstruction* romBankEntries;
+		
+		uint32_t currentRomBank;
+		std::vector<std::unique_ptr<DecodedInstruction[]>> romEntries;
+		
+		std::unique_ptr<DecodedInstruction[]> wramEntries;
+		DecodedInstruction hramEntries[HRAM_SIZE];
+	};
+	
+	//The cache of the machine bound to the calling thread, see Machine::Bind
+	extern thread_local Cache* cache;
+	
+	//Resets all cached decodings, must be called when a new cartridge is loaded
+	void Clear();
+	
+	void OnRomBankChanged(uint32_t bankIdx);
+	
+	//Drops cached decodings that overlap a byte of WRAM / HRAM that was just written
+	void InvalidateRAM(const uint8_t* ptr);
+	
+	//Drops all cached decodings in WRAM and HRAM, for when all of RAM is replaced at once
+	void ClearRAM();
+	
+	DecodedInstruction* LookupSlow(uint16_t address);
+	
+	//Bytes used by the entries allocated so far
+	size_t MemoryFootprint();
+	
+	//Returns the cache entry for the instruction at an address, or nullptr if the address can't be cached
+	inline DecodedInstruction* Lookup(uint16_t address)
+	{
+		if (address < 0x4000 && cache->romBank0Entries)
+			return &cache->romBank0Entries[address];
+		if (address >= 0x4000 && address < 0x8000 && cache->romBankEntries)
+			return &cache->romBankEntries[address - 0x4000];
+		return LookupSlow(address);
+	}
+}
@@ -0,0 +1,311 @@
+#include "Emulator.hpp"
+#include "CPU.hpp"
+#include "Memory.hpp"
+#include "Audio.hpp"
+#include "GPU.hpp"
+#include "DecodeCache.hpp"
+#include "JIT.hpp"
+#include "SaveState.hpp"
+#include "IdleLoop.hpp"
+#include "Trace.hpp"
+#include "Common.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <iomanip>
+
+thread_local EmulatorState* emulator;
+bool jitMode;
+bool devMode;
+bool verboseMode;
+
+//RunCycles looks for interrupts queued by other threads at least this often
+static constexpr uint64_t MAX_EVENT_INTERVAL = 128;
+
+thread_local EventQueue* eventQueue;
+
+void QueueInterrupt(int index)
+{
+	eventQueue->pendingInterrupts.fetch_or(1U << index, std::memory_order_release);
+}
+
+void StallCPU(uint32_t cycles)
+{
+	emulator->cycleCounter += cycles;
+}
+
+void RescheduleEvents()
+{
+	emulator->nextEventCycle = emulator->cycleCounter;
+}
+
+void ScheduleEvent(Event event, uint64_t cycle)
+{
+	emulator->eventCycles[(int)event] = cycle;
+	if (cycle < emulator->nextEventCycle)
+		emulator->nextEventCycle = cycle;
+}
+
+static uint64_t NextScheduledCycle()
+{
+	return *std::min_element(std::begin(emulator->eventCycles), std::end(emulator->eventCycles));
+}
+
+static constexpr uint32_t CYCLES_PER_TIMER_INC[] =
+{
+	CLOCK_RATE / 4096,
+	CLOCK_RATE / 262144,
+	CLOCK_RATE / 65536,
+	CLOCK_RATE / 16384
+};
+
+void SyncTimer()
+{
+	uint64_t cycles = emulator->cycleCounter - emulator->timerSyncCycle;
+	emulator->timerSyncCycle = emulator->cycleCounter;
+	
+	mem::memory->ioReg[IOREG_DIV] = (emulator->cycleCounter - emulator->divResetCycle) >> 8;
+	
+	const uint8_t tac = mem::memory->ioReg[IOREG_TAC];
+	if (!(tac & 4))
+		return;
+	
+	//Skips directly from one TIMA increment to the next, overflow reloads TIMA on the cycle after the increment
+	const uint32_t period = CYCLES_PER_TIMER_INC[tac & 3];
+	while (cycles > 0)
+	{
+		if (emulator->timerOverflow)
+		{
+			mem::memory->ioReg[IOREG_IF] |= 1 << INT_TIMER;
+			mem::memory->ioReg[IOREG_TIMA] = mem::memory->ioReg[IOREG_TMA];
+			emulator->timerOverflow = false;
+		}
+		
+		const uint64_t untilInc = emulator->cyclesSinceTimerInc < period ? period - emulator->cyclesSinceTimerInc : 1;
+		if (cycles < untilInc)
+		{
+			emulator->cyclesSinceTimerInc += cycles;
+			break;
+		}
+		
+		cycles -= untilInc;
+		emulator->cyclesSinceTimerInc = 0;
+		if (mem::memory->ioReg[IOREG_TIMA]++ == 0xFF)
+			emulator->timerOverflow = true;
+	}
+}
+
+//Returns the cycle on which the timer interrupt will be raised, the timer must have just been synced
+static uint64_t NextTimerEventCycle()
+{
+	const uint8_t tac = mem::memory->ioReg[IOREG_TAC];
+	if (!(tac & 4))
+		return UINT64_MAX;
+	if (emulator->timerOverflow)
+		return emulator->timerSyncCycle + 1;
+	
+	const uint32_t period = CYCLES_PER_TIMER_INC[tac & 3];
+	const uint64_t untilInc = emulator->cyclesSinceTimerInc < period ? period - emulator->cyclesSinceTimerInc : 1;
+	return emulator->timerSyncCycle + untilInc + (uint64_t)(0xFF - mem::memory->ioReg[IOREG_TIMA]) * period + 1;
+}
+
+void WriteTimerRegister(uint8_t reg, uint8_t val)
+{
+	SyncTimer();
+	
+	if (reg == IOREG_DIV)
+	{
+		//Writing any value to this should reset it to 0
+		emulator->divResetCycle = emulator->cycleCounter;
+		mem::memory->ioReg[IOREG_DIV] = 0;
+	}
+	else
+	{
+		mem::memory->ioReg[reg] = val;
+	}
+	
+	ScheduleEvent(Event::Timer, NextTimerEventCycle());
+}
+
+void SyncDMA()
+{
+	mem::UpdateDMA();
+}
+
+void SyncAudio()
+{
+	//The APU is clocked at half the CPU clock rate, or a quarter of it in double speed mode
+	const int cyclesPerClock = cpu->doubleSpeed ? 4 : 2;
+	const uint64_t clocks = (emulator->cycleCounter - emulator->audioSyncCycle) / cyclesPerClock;
+	emulator->audioSyncCycle += clocks * cyclesPerClock;
+	UpdateAudio((uint32_t)clocks);
+}
+
+//The sequencer is clocked by the APU clock, so its period in CPU cycles doubles in double speed mode
+static uint64_t AudioSequencerCycles()
+{
+	return (uint64_t)AUDIO_SEQUENCER_CLOCKS * (cpu->doubleSpeed ? 4 : 2);
+}
+
+void ResetEvents()
+{
+	std::fill(std::begin(emulator->eventCycles), std::end(emulator->eventCycles), UINT64_MAX);
+	
+	SyncTimer();
+	ScheduleEvent(Event::Timer, NextTimerEventCycle());
+	ScheduleEvent(Event::AudioSequencer, emulator->cycleCounter + AudioSequencerCycles());
+	gpu::Reset();
+}
+
+//Each event is run at most a few cycles late, when an instruction or a halt skip ends past it.
+//Periodic events schedule their next occurrence from the cycle they were due on, so they don't drift.
+static void RunEvent(Event event, uint64_t cycle)
+{
+	switch (event)
+	{
+	case Event::PPU:
+		gpu::RunEvent(cycle);
+		break;
+	case Event::Timer:
+		SyncTimer();
+		ScheduleEvent(Event::Timer, NextTimerEventCycle());
+		break;
+	case Event::DMA:
+		SyncDMA();
+		break;
+	case Event::AudioSequencer:
+		SyncAudio();
+		StepAudioSequencer();
+		ScheduleEvent(Event::AudioSequencer, cycle + AudioSequencerCycles());
+		break;
+	case Event::Count:
+		break;
+	}
+}
+
+//Runs events that are due in the order they were scheduled for, including ones scheduled by the events themselves
+static void RunDueEvents()
+{
+	while (true)
+	{
+		const uint64_t* next = std::min_element(std::begin(emulator->eventCycles), std::end(emulator->eventCycles));
+		if (*next > emulator->cycleCounter)
+			break;
+		
+		const uint64_t cycle = *next;
+		const Event event = (Event)(next - emulator->eventCycles);
+		emulator->eventCycles[(int)event] = UINT64_MAX;
+		RunEvent(event, cycle);
+	}
+}
+
+//Runs instructions until the next event, the debug hooks are selected once per event rather than per instruction
+template <bool DebugHooks>
+static void RunToEvent()
+{
+	EmulatorState& emu = *emulator;
+	if (jitMode && !DebugHooks)
+	{
+		while (emu.cycleCounter < emu.nextEventCycle)
+			emu.cycleCounter += StepCPUJit((int)(emu.nextEventCycle - emu.cycleCounter));
+	}
+	else
+	{
+		while (emu.cycleCounter < emu.nextEventCycle)
+			emu.cycleCounter += StepCPUWithDispatch<DEFAULT_DISPATCH_MODE, DebugHooks>();
+	}
+}
+
+int RunCycles(int budget)
+{
+	const uint64_t startCycle = emulator->cycleCounter;
+	const uint64_t endCycle = startCycle + budget;
+	
+	while (emulator->cycleCounter < endCycle)
+	{
+		EventQueue& events = *eventQueue;
+		if (events.pendingInterrupts.load(std::memory_order_relaxed) != 0)
+			mem::memory->ioReg[IOREG_IF] |= events.pendingInterrupts.exchange(0, std::memory_order_acquire);
+		
+		//A halted CPU can only be woken by an event, so it doesn't need to poll for queued interrupts within a slice
+		const bool waiting = cpu->halted && !(cpu->intEnableReg & mem::memory->ioReg[IOREG_IF]);
+		
+		const uint64_t wakeCycle = std::min(endCycle, NextScheduledCycle());
+		emulator->nextEventCycle = waiting ? wakeCycle : std::min(wakeCycle, emulator->cycleCounter + MAX_EVENT_INTERVAL);
+		
+		if (waiting)
+		{
+			//Skips to the event in one go, in the same 4 cycle steps that StepCPU uses while halted
+			emulator->cycleCounter += (emulator->nextEventCycle - emulator->cycleCounter + 3) & ~(uint64_t)3;
+		}
+		else
+		{
+			//Polling loops are skipped ahead in the same way as HALT
+			idle::TrySkip(wakeCycle);
+			
+			if (emulator->debugHooksEnabled)
+				RunToEvent<true>();
+			else
+				RunToEvent<false>();
+		}
+		
+		RunDueEvents();
+	}
+	
+	SyncAudio();
+	
+	trace::FlushIfRequested();
+	
+	return (int)(emulator->cycleCounter - startCycle);
+}
+
+void SaveEmulatorState(state::Writer& writer)
+{
+	writer.Write(*cpu);
+	writer.Write(emulator->cycleCounter);
+	writer.Write(emulator->timerSyncCycle);
+	writer.Write(emulator->divResetCycle);
+	writer.Write(emulator->cyclesSinceTimerInc);
+	writer.Write(emulator->timerOverflow);
+	writer.Write(emulator->audioSyncCycle);
+	writer.Write(emulator->eventCycles);
+}
+
+void LoadEmulatorState(state::Reader& reader)
+{
+	reader.Read(*cpu);
+	reader.Read(emulator->cycleCounter);
+	reader.Read(emulator->timerSyncCycle);
+	reader.Read(emulator->divResetCycle);
+	reader.Read(emulator->cyclesSinceTimerInc);
+	reader.Read(emulator->timerOverflow);
+	reader.Read(emulator->audioSyncCycle);
+	reader.Read(emulator->eventCycles);
+	RescheduleEvents();
+}
+
+void PrintMemoryFootprint(std::ostream& stream)
+{
+	const std::pair<const char*, size_t> parts[] =
+	{
+		{ "Cartridge RAM", mem::memory->extRam.size() },
+		{ "VRAM and OAM", sizeof(mem::memory->vram) + sizeof(mem::memory->oam) + sizeof(mem::memory->backPaletteMemory) + sizeof(mem::memory->spritePaletteMemory) },
+		{ "WRAM and HRAM", sizeof(mem::memory->wram) + sizeof(mem::memory->hram) + sizeof(mem::memory->ioReg) },
+		{ "Audio queue", AudioMemoryFootprint() },
+		{ "Renderer", gpu::MemoryFootprint() },
+		{ "Decode cache", decode::MemoryFootprint() },
+		{ "JIT", jit::MemoryFootprint() }
+	};
+	
+	size_t total = mem::RomIsShared() ? 0 : mem::RomSize();
+	stream << "Memory footprint:\n";
+	stream << "  " << std::left << std::setw(14) << "ROM" << std::right << std::setw(8) << (mem::RomSize() / 1024) << " KB"
+		<< (mem::RomIsShared() ? " (shared file mapping)" : "") << "\n";
+	for (const auto& [name, bytes] : parts)
+	{
+		stream << "  " << std::left << std::setw(14) << name << std::right << std::setw(8) << (bytes + 1023) / 1024 << " KB\n";
+		total += bytes;
+	}
+	stream << "  " << std::left << std::setw(14) << "Total" << std::right << std::setw(8) << (total + 1023) / 1024 << " KB\n";
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstdint>
+#include <iosfwd>
+#include <atomic>
+
+//Runs compiled blocks through the JIT where possible, see StepCPUJit
+extern bool jitMode;
+
+//Runs instructions until at least budget cycles have passed and returns the number of cycles actually run.
+//Peripherals are caught up in bulk at scheduled events rather than after every instruction.
+//While the CPU is halted with no interrupt pending, time skips straight to the next event.
+int RunCycles(int budget);
+
+//Things that happen at a known emulated cycle, each has at most one occurrence scheduled at a time
+enum class Event
+{
+	PPU,            //The next PPU mode change, see gpu::RunEvent
+	Timer,          //TIMA overflowing and raising the timer interrupt
+	DMA,            //The end of an OAM DMA transfer
+	AudioSequencer, //The next step of the APU frame sequencer
+	Count
+};
+
+//The cycle counter, scheduled events and timer of a machine, only used on the CPU thread
+struct EmulatorState
+{
+	//Emulated cycles since startup. While RunCycles is executing an instruction, this is the cycle the instruction started on.
+	uint64_t cycleCounter;
+	
+	//The earliest cycle RunCycles has to stop at, and the cycle each event is scheduled for or UINT64_MAX
+	uint64_t nextEventCycle;
+	uint64_t eventCycles[(int)Event::Count];
+	
+	uint64_t timerSyncCycle;
+	uint64_t divResetCycle;
+	uint32_t cyclesSinceTimerInc;
+	bool timerOverflow;
+	
+	uint64_t audioSyncCycle;
+	
+	//Set when verbose mode or breakpoints need the per instruction debug hooks, see InitCPU and AddBreakpoint
+	bool debugHooksEnabled;
+};
+
+//The state of the machine bound to the calling thread, see Machine::Bind
+extern thread_local EmulatorState* emulator;
+
+//Makes an event happen once cycleCounter reaches cycle, replacing the cycle it was scheduled for before.
+//If RunCycles is running instructions past that cycle, it stops after the current one.
+void ScheduleEvent(Event event, uint64_t cycle);
+
+//Schedules every event from the current state, called by InitCPU
+void ResetEvents();
+
+//Makes RunCycles stop after the current instruction to recompute when the next event happens
+void RescheduleEvents();
+
+//Advances time by cycles in which the CPU is halted by a transfer
+void StallCPU(uint32_t cycles);
+
+//Interrupts raised by other threads, like the joypad interrupt, picked up by the CPU thread between events
+struct EventQueue
+{
+	std::atomic_uint32_t pendingInterrupts { 0 };
+};
+
+//The queue of the machine bound to the calling thread, see Machine::Bind
+extern thread_local EventQueue* eventQueue;
+
+//Bring a peripheral up to date with cycleCounter, called before the CPU accesses its registers
+void SyncTimer();
+void SyncDMA();
+void SyncAudio();
+
+//Handles writes to DIV, TIMA, TMA and TAC
+void WriteTimerRegister(uint8_t reg, uint8_t val);
+
+namespace state
+{
+	struct Writer;
+	struct Reader;
+}
+
+//The CPU registers, cycle counter, timer and scheduled events. Interrupts queued by other threads aren't included.
+void SaveEmulatorState(state::Writer& writer);
+void LoadEmulatorState(state::Reader& reader);
+
+//Prints the host memory used by this instance, split by what it holds. Shared ROM mappings aren't counted in the total.
+void PrintMemoryFootprint(std::ostream& stream);
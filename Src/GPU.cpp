@@ -2,51 +2,337 @@
 #include "Memory.hpp"
 #include "Common.hpp"
 #include "CPU.hpp"
+#include "Emulator.hpp"
+#include "SaveState.hpp"
+#include "Sinks.hpp"
 
-#include <SDL.h>
 #include <bitset>
+#include <atomic>
 #include <mutex>
-#include <thread>
 #include <algorithm>
+#include <chrono>
 
-std::mutex gpu::regMutex;
-gpu::RegisterState gpu::reg;
+thread_local gpu::Shared* gpu::shared;
 
-static uint8_t gpuMode;
+static void DecodeDirtyTiles()
+{
+	gpu::Renderer& renderer = gpu::shared->renderer;
+	for (int bank = 0; bank < 2; bank++)
+	{
+		for (int word = 0; word < 384 / 64; word++)
+		{
+			for (uint64_t bits = renderer.dirtyTiles[bank][word]; bits != 0; bits &= bits - 1)
+			{
+				const int tile = word * 64 + __builtin_ctzll(bits);
+				const gpu::Tile& src = reinterpret_cast<const gpu::Tile*>(renderer.vram[bank])[tile];
+				gpu::DecodedTile* dst = renderer.decodedTiles[bank][tile];
+				
+				for (uint32_t y = 0; y < 8; y++)
+				{
+					for (uint32_t x = 0; x < 8; x++)
+					{
+						const uint8_t color = src.At(x, y);
+						dst[0].pixels[y][x] = color;
+						dst[1].pixels[y][7 - x] = color;
+					}
+				}
+			}
+			renderer.dirtyTiles[bank][word] = 0;
+		}
+	}
+}
+
+static void WakeRenderer()
+{
+	{
+		std::lock_guard<std::mutex> lock(gpu::shared->lineMutex);
+	}
+	gpu::shared->lineCondition.notify_one();
+}
 
-SDL_Texture* gpu::outTexture;
+//Called on the render thread after it takes lines or writes out of the queues, wakes the CPU thread if it is waiting for space
+static void ReleaseCPU()
+{
+	if (!gpu::shared->cpuWaiting.load())
+		return;
+	{
+		std::lock_guard<std::mutex> lock(gpu::shared->lineMutex);
+	}
+	gpu::shared->lineCondition.notify_all();
+}
 
-void gpu::Init(SDL_Renderer* renderer)
+//Blocks the CPU thread until hasSpace returns true or the renderer stops
+template <typename HasSpace>
+static void WaitForRenderer(HasSpace hasSpace)
 {
-	reg = { };
-	reg.lcdc = 0x91;
-	reg.bgp = 0xFC;
-	gpuMode = 1;
-	outTexture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING, RES_X, RES_Y);
+	gpu::Shared& s = *gpu::shared;
+	s.cpuWaiting = true;
+	WakeRenderer();
+	{
+		std::unique_lock<std::mutex> lock(s.lineMutex);
+		s.lineCondition.wait(lock, [&] { return !s.writeLogEnabled.load() || hasSpace(); });
+	}
+	s.cpuWaiting = false;
 }
 
-uint8_t gpu::GetRegisterSTAT()
+void gpu::LogMemoryWrite(VideoMemory target, uint16_t offset, uint8_t val)
+{
+	Shared& s = *shared;
+	if (!s.writeLogEnabled.load(std::memory_order_relaxed))
+		return;
+	
+	const uint64_t index = s.writeIndex.load(std::memory_order_relaxed);
+	if (index - s.readIndex.load(std::memory_order_acquire) >= Shared::WRITE_LOG_SIZE)
+	{
+		WaitForRenderer([&] { return index - s.readIndex.load() < Shared::WRITE_LOG_SIZE; });
+		if (!s.writeLogEnabled.load(std::memory_order_relaxed))
+			return;
+	}
+	
+	s.writeLog[index % Shared::WRITE_LOG_SIZE] = { emulator->cycleCounter, offset, target, val };
+	s.writeIndex.store(index + 1, std::memory_order_release);
+}
+
+void gpu::ReloadVideoMemory()
+{
+	if (!shared->writeLogEnabled)
+		return;
+	
+	{
+		auto& reloaded = shared->reloaded;
+		std::lock_guard<std::mutex> lock(reloaded.mutex);
+		memcpy(reloaded.vram, mem::memory->vram, sizeof(reloaded.vram));
+		memcpy(reloaded.oam, mem::memory->oam, sizeof(reloaded.oam));
+		memcpy(reloaded.backPaletteMemory, mem::memory->backPaletteMemory, sizeof(reloaded.backPaletteMemory));
+		memcpy(reloaded.spritePaletteMemory, mem::memory->spritePaletteMemory, sizeof(reloaded.spritePaletteMemory));
+		reloaded.cgbMode = mem::memory->cgbMode;
+	}
+	LogMemoryWrite(VideoMemory::Reload, 0, 0);
+}
+
+void gpu::ApplyMemoryWrites(uint64_t untilCycle)
+{
+	Renderer& renderer = shared->renderer;
+	const uint64_t end = shared->writeIndex.load(std::memory_order_acquire);
+	uint64_t index = shared->readIndex.load(std::memory_order_relaxed);
+	
+	for (; index < end; index++)
+	{
+		const LoggedWrite& write = shared->writeLog[index % Shared::WRITE_LOG_SIZE];
+		if (write.cycle >= untilCycle)
+			break;
+		
+		switch (write.target)
+		{
+		case VideoMemory::VRAM:
+		{
+			const uint32_t bank = write.offset >> 13;
+			const uint32_t address = write.offset & 0x1FFF;
+			renderer.vram[bank][address] = write.val;
+			if (address < 0x1800)
+				renderer.dirtyTiles[bank][address / (16 * 64)] |= 1ULL << ((address / 16) % 64);
+			break;
+		}
+		case VideoMemory::OAM:
+			renderer.oam[write.offset] = write.val;
+			break;
+		case VideoMemory::BackPalette:
+			renderer.backPaletteMemory[write.offset] = write.val;
+			break;
+		case VideoMemory::SpritePalette:
+			renderer.spritePaletteMemory[write.offset] = write.val;
+			break;
+		case VideoMemory::Reload:
+		{
+			//If there were several reloads since the last call, this already has the memory of the last one,
+			//which the writes between them are applied over until the log reaches it
+			auto& reloaded = shared->reloaded;
+			std::lock_guard<std::mutex> lock(reloaded.mutex);
+			memcpy(renderer.vram, reloaded.vram, sizeof(renderer.vram));
+			memcpy(renderer.oam, reloaded.oam, sizeof(renderer.oam));
+			memcpy(renderer.backPaletteMemory, reloaded.backPaletteMemory, sizeof(renderer.backPaletteMemory));
+			memcpy(renderer.spritePaletteMemory, reloaded.spritePaletteMemory, sizeof(renderer.spritePaletteMemory));
+			renderer.cgbMode = reloaded.cgbMode;
+			memset(renderer.dirtyTiles, 0xFF, sizeof(renderer.dirtyTiles));
+			break;
+		}
+		}
+	}
+	
+	shared->readIndex.store(index);
+	ReleaseCPU();
+	
+	DecodeDirtyTiles();
+}
+
+void gpu::Init()
 {
-	std::lock_guard<std::mutex> lock(regMutex);
-	return (reg.stat & 0xF8U) | ((reg.lyc == reg.ly) << 2) | gpuMode;
+	//The memory the CPU has now arrives through the log once the CPU thread calls ReloadVideoMemory
+	shared->readIndex = shared->writeIndex.load();
+	shared->lineReadIndex = shared->lineWriteIndex.load();
+	shared->writeLogEnabled = true;
+	
+	memset(shared->renderer.dirtyTiles, 0xFF, sizeof(shared->renderer.dirtyTiles));
+	DecodeDirtyTiles();
 }
 
-inline static void SetGPUMode(int8_t mode, int8_t ly)
+void gpu::StopRenderer()
 {
-	std::lock_guard<std::mutex> lock(gpu::regMutex);
-	gpuMode = mode;
-	gpu::reg.ly = ly;
+	shared->writeLogEnabled = false;
+	{
+		std::lock_guard<std::mutex> lock(shared->lineMutex);
+	}
+	shared->lineCondition.notify_all();
 }
 
+thread_local gpu::PPU* gpu::ppu;
+
 // Mode 0 = HBlank
 // Mode 1 = VBlank
 // Mode 2 = Reading OAM
 // Mode 3 = Reading OAM & VRAM
 
-static constexpr int64_t MODE_2_END_NS = 19000;
-static constexpr int64_t MODE_3_END_NS = 40000;
-static constexpr int64_t MODE_0_END_NS = 80000;
-static constexpr int64_t MODE_0_MIN_NS = 30000;
+//Length of each mode in normal speed cycles, in double speed mode the PPU takes twice the cycles
+static constexpr uint32_t MODE_2_CYCLES = 80;
+static constexpr uint32_t MODE_3_CYCLES = 172;
+static constexpr uint32_t MODE_0_CYCLES = 204;
+static constexpr uint32_t LINE_CYCLES = MODE_2_CYCLES + MODE_3_CYCLES + MODE_0_CYCLES;
+static constexpr uint8_t NUM_LINES = 154;
+
+static uint64_t PPUCycles(uint32_t cycles)
+{
+	return (uint64_t)cycles << cpu->doubleSpeed;
+}
+
+static bool LCDEnabled()
+{
+	return gpu::ppu->reg.lcdc & (1 << 7);
+}
+
+static void MaybeTriggerStatInterrupt(uint8_t controlMask)
+{
+	if (LCDEnabled() && (gpu::ppu->reg.stat & controlMask))
+		mem::memory->ioReg[IOREG_IF] |= 1 << INT_LCD_STAT;
+}
+
+static void SendLine(uint64_t cycle, uint8_t ly)
+{
+	gpu::Shared& s = *gpu::shared;
+	if (!s.writeLogEnabled.load(std::memory_order_relaxed))
+		return;
+	
+	const uint64_t index = s.lineWriteIndex.load(std::memory_order_relaxed);
+	if (index - s.lineReadIndex.load(std::memory_order_acquire) >= gpu::Shared::LINE_QUEUE_SIZE)
+	{
+		WaitForRenderer([&] { return index - s.lineReadIndex.load() < gpu::Shared::LINE_QUEUE_SIZE; });
+		if (!s.writeLogEnabled.load(std::memory_order_relaxed))
+			return;
+	}
+	
+	gpu::LineRecord& line = s.lines[index % gpu::Shared::LINE_QUEUE_SIZE];
+	line.cycle = cycle;
+	line.reg = gpu::ppu->reg;
+	line.reg.ly = ly;
+	s.lineWriteIndex.store(index + 1, std::memory_order_release);
+	
+	if (ly == RES_Y)
+		WakeRenderer();
+}
+
+//Moves to the start of the current line, in mode 2 or V-blank
+static void StartLine(uint64_t cycle)
+{
+	gpu::ppu->reg.ly = LCDEnabled() ? gpu::ppu->line : 0;
+	if (gpu::ppu->reg.lyc == gpu::ppu->reg.ly)
+		MaybeTriggerStatInterrupt(1 << 6);
+	
+	if (gpu::ppu->line < RES_Y)
+	{
+		gpu::ppu->mode = 2;
+		MaybeTriggerStatInterrupt(1 << 5);
+		ScheduleEvent(Event::PPU, cycle + PPUCycles(MODE_2_CYCLES));
+		return;
+	}
+	
+	if (gpu::ppu->line == RES_Y)
+	{
+		gpu::ppu->mode = 1;
+		if (LCDEnabled())
+			mem::memory->ioReg[IOREG_IF] |= 1 << INT_VBLANK;
+		MaybeTriggerStatInterrupt(1 << 4);
+		SendLine(cycle, RES_Y);
+	}
+	ScheduleEvent(Event::PPU, cycle + PPUCycles(LINE_CYCLES));
+}
+
+void gpu::Reset()
+{
+	ppu->reg = { };
+	ppu->reg.lcdc = 0x91;
+	ppu->reg.bgp = 0xFC;
+	ppu->line = 0;
+	StartLine(emulator->cycleCounter);
+}
+
+void gpu::RunEvent(uint64_t cycle)
+{
+	switch (ppu->mode)
+	{
+	case 2:
+		ppu->mode = 3;
+		SendLine(cycle, ppu->line);
+		ScheduleEvent(Event::PPU, cycle + PPUCycles(MODE_3_CYCLES));
+		break;
+	case 3:
+		ppu->mode = 0;
+		if (LCDEnabled())
+		{
+			MaybeTriggerStatInterrupt(1 << 3);
+			mem::RunHBlankDMA(1);
+		}
+		ScheduleEvent(Event::PPU, cycle + PPUCycles(MODE_0_CYCLES));
+		break;
+	default:
+		ppu->line = (ppu->line + 1) % NUM_LINES;
+		StartLine(cycle);
+		break;
+	}
+}
+
+void gpu::WriteLCDC(uint8_t val)
+{
+	const bool wasEnabled = LCDEnabled();
+	ppu->reg.lcdc = val;
+	if (!wasEnabled && LCDEnabled())
+	{
+		ppu->line = 0;
+		StartLine(emulator->cycleCounter);
+	}
+	else if (wasEnabled && !LCDEnabled())
+	{
+		ppu->reg.ly = 0;
+	}
+}
+
+uint8_t gpu::GetRegisterSTAT()
+{
+	const uint8_t mode = LCDEnabled() ? ppu->mode : 0;
+	return (ppu->reg.stat & 0xF8U) | ((ppu->reg.lyc == ppu->reg.ly) << 2) | mode;
+}
+
+void gpu::SaveState(state::Writer& writer)
+{
+	writer.Write(ppu->reg);
+	writer.Write(ppu->mode);
+	writer.Write(ppu->line);
+}
+
+void gpu::LoadState(state::Reader& reader)
+{
+	reader.Read(ppu->reg);
+	reader.Read(ppu->mode);
+	reader.Read(ppu->line);
+}
 
 struct Sprite
 {
@@ -64,16 +350,15 @@ inline uint16_t ResolveCGBColor(uint8_t* paletteMem, uint32_t paletteIdx, uint8_
 
 inline std::pair<bool, uint16_t> SampleSprite(const Sprite& sprite, int x)
 {
-	int vramBank = ((bool)sprite.flags & SPF_CGB_VRAM_BANK) && cgbMode;
+	gpu::Renderer& renderer = gpu::shared->renderer;
+	int vramBank = ((bool)sprite.flags & SPF_CGB_VRAM_BANK) && renderer.cgbMode;
 	
-	gpu::Tile* tileMem = reinterpret_cast<gpu::Tile*>(mem::vram[vramBank]);
-	
-	int srcX = (sprite.flags & SPF_FLIP_X) ? (7 - x) : x;
-	uint8_t color = tileMem[sprite.tile].At(srcX, sprite.row);
+	const gpu::DecodedTile& tile = renderer.decodedTiles[vramBank][sprite.tile][(sprite.flags & SPF_FLIP_X) != 0];
+	uint8_t color = tile.pixels[sprite.row][x];
 	uint16_t colorRes;
-	if (cgbMode)
+	if (renderer.cgbMode)
 	{
-		colorRes = ResolveCGBColor(mem::spritePaletteMemory, sprite.flags & 7, color);
+		colorRes = ResolveCGBColor(renderer.spritePaletteMemory, sprite.flags & 7, color);
 	}
 	else
 	{
@@ -82,276 +367,316 @@ inline std::pair<bool, uint16_t> SampleSprite(const Sprite& sprite, int x)
 	return std::make_pair(color == 0, colorRes);
 }
 
-uint8_t gpu::prevOAM[160];
-
-//Tracks the screen pixels in CGB format
-uint16_t pixels[RES_Y][RES_X];
-
 const uint16_t gpu::MONOCHROME_COLORS[] = { 0x7FFF, 0x5294, 0x294A, 0x0 };
 
-inline static void CopyPixelsToTexture()
+inline static void PresentFrame(VideoSink& sink)
 {
-	void* textureData;
-	int texturePitch;
-	SDL_LockTexture(gpu::outTexture, nullptr, &textureData, &texturePitch);
-	
+	gpu::Renderer& renderer = gpu::shared->renderer;
 	for (int y = 0; y < RES_Y; y++)
 	{
-		uint32_t* surfaceRowPtr = reinterpret_cast<uint32_t*>(static_cast<char*>(textureData) + texturePitch * y);
-		
 		for (int x = 0; x < RES_X; x++)
 		{
-			surfaceRowPtr[x] = gpu::ToColor32(pixels[y][x]);
+			renderer.framePixels[y][x] = gpu::ToColor32(renderer.pixels[y][x]);
 		}
 	}
 	
-	SDL_UnlockTexture(gpu::outTexture);
+	sink.PresentFrame(renderer.framePixels[0]);
 }
 
-void gpu::RunOneFrame()
+//Draws line regCpy.ly from the renderer's copy of video memory
+static void DrawLine(const gpu::RegisterState& regCpy)
 {
-	memset(pixels, 0, sizeof(pixels));
+	using namespace gpu;
+	Renderer& renderer = shared->renderer;
+	const int y = regCpy.ly;
 	
-	RegisterState regCpy;
+	std::bitset<RES_X> pixelHasBkgSprite;
+	Sprite sprites[10];
+	int numSprites = 0;
 	
-	auto MaybeTriggerStatInterrupt = [&] (uint8_t controlMask)
+	if (!(regCpy.lcdc & (1 << 7)))
 	{
-		if (regCpy.stat & controlMask)
-		{
-			QueueInterrupt(INT_LCD_STAT);
-		}
-	};
+		std::fill_n(renderer.pixels[y], RES_X, 3);
+		return;
+	}
 	
-	auto startTime = std::chrono::high_resolution_clock::now();
+	std::fill_n(renderer.pixels[y], RES_X, 0);
 	
-	for (int y = 0; y < RES_Y; y++)
+	const bool renderSprites = regCpy.lcdc & 2;
+	bool renderBackground = regCpy.lcdc & 1;
+	const bool renderWindow = regCpy.lcdc & (1 << 5);
+	const bool tileMode8000 = regCpy.lcdc & (1 << 4);
+	uint8_t spriteFlagsMask = 0xFF;
+	
+	if (renderer.cgbMode && !renderBackground)
 	{
-		std::bitset<RES_X> pixelHasBkgSprite;
-		Sprite sprites[10];
-		int numSprites = 0;
-		
-		{
-			std::lock_guard<std::mutex> lock(regMutex);
-			regCpy = reg;
-		}
-		
-		if (!(regCpy.lcdc & (1 << 7)))
-		{
-			std::fill_n(pixels[0], RES_X * RES_Y, 3);
-			CopyPixelsToTexture();
-			return;
-		}
-		
-		const bool renderSprites = regCpy.lcdc & 2;
-		bool renderBackground = regCpy.lcdc & 1;
-		const bool renderWindow = regCpy.lcdc & (1 << 5);
-		const bool tileMode8000 = regCpy.lcdc & (1 << 4);
-		uint8_t spriteFlagsMask = 0xFF;
-		
-		if (cgbMode && !renderBackground)
-		{
-			spriteFlagsMask = (uint8_t)(~SPF_BACKGROUND);
-			renderBackground = true;
-		}
-		
-		uint32_t bTileOffset = ((regCpy.lcdc & (1 << 3)) ? 0x1C00 : 0x1800);
-		uint32_t wTileOffset = ((regCpy.lcdc & (1 << 6)) ? 0x1C00 : 0x1800);
-		
-		const uint8_t* bTileMap     = mem::vram[0] + bTileOffset;
-		const uint8_t* bTileAttrMap = mem::vram[1] + bTileOffset;
-		const uint8_t* wTileMap     = mem::vram[0] + wTileOffset;
-		const uint8_t* wTileAttrMap = mem::vram[1] + wTileOffset;
-		
-		SetGPUMode(2, y);
-		std::unique_lock<std::mutex> oamLock(mem::oamMutex);
-		
-		MaybeTriggerStatInterrupt(1 << 5);
-		if (regCpy.lyc == y)
-			MaybeTriggerStatInterrupt(1 << 6);
+		spriteFlagsMask = (uint8_t)(~SPF_BACKGROUND);
+		renderBackground = true;
+	}
+	
+	uint32_t bTileOffset = ((regCpy.lcdc & (1 << 3)) ? 0x1C00 : 0x1800);
+	uint32_t wTileOffset = ((regCpy.lcdc & (1 << 6)) ? 0x1C00 : 0x1800);
+	
+	const uint8_t* bTileMap     = renderer.vram[0] + bTileOffset;
+	const uint8_t* bTileAttrMap = renderer.vram[1] + bTileOffset;
+	const uint8_t* wTileMap     = renderer.vram[0] + wTileOffset;
+	const uint8_t* wTileAttrMap = renderer.vram[1] + wTileOffset;
+	
+	//Sprites collect phase
+	if (renderSprites)
+	{
+		const bool tallSprites = (regCpy.lcdc & 4);
+		const int spriteMinY = y - (tallSprites ? 16 : 8);
 		
-		//Sprites collect phase
-		if (renderSprites)
+		for (int i = 0; i < 40 && numSprites < 10; i++)
 		{
-			const bool tallSprites = (regCpy.lcdc & 4);
-			const int spriteMinY = y - (tallSprites ? 16 : 8);
-			
-			for (int i = 0; i < 40 && numSprites < 10; i++)
+			int spy = (int)renderer.oam[i * 4 + 0] - 16;
+			int spx = (int)renderer.oam[i * 4 + 1] - 8;
+			if (spx > -8 && spx < RES_X && spy > spriteMinY && spy <= y)
 			{
-				int spy = (int)mem::oam[i * 4 + 0] - 16;
-				int spx = (int)mem::oam[i * 4 + 1] - 8;
-				if (spx > -8 && spx < RES_X && spy > spriteMinY && spy <= y)
+				uint8_t tile = renderer.oam[i * 4 + 2];
+				uint8_t flags = renderer.oam[i * 4 + 3];
+				
+				//Shifts tall sprites
+				if (tallSprites)
 				{
-					uint8_t tile = mem::oam[i * 4 + 2];
-					uint8_t flags = mem::oam[i * 4 + 3];
-					
-					//Shifts tall sprites
-					if (tallSprites)
-					{
-						if ((spy > y - 8) != (bool)(flags & SPF_FLIP_Y))
-							tile &= 0xFE; //Use top tile
-						else
-							tile |= 0x1; //Use bottom tile
-					}
-					
-					int r;
-					if (flags & SPF_FLIP_Y)
-						r = spy - spriteMinY - 1;
+					if ((spy > y - 8) != (bool)(flags & SPF_FLIP_Y))
+						tile &= 0xFE; //Use top tile
 					else
-						r = y - spy;
-					
-					sprites[numSprites].x = spx;
-					sprites[numSprites].row = (uint8_t)r % 8;
-					sprites[numSprites].tile = tile;
-					sprites[numSprites].flags = flags & spriteFlagsMask;
-					sprites[numSprites].palette = (flags & SPF_PALETTE1) ? regCpy.obp1 : regCpy.obp0;
-					
-					numSprites++;
+						tile |= 0x1; //Use bottom tile
 				}
-			}
-			
-			//Sorts sprites to have correct priority
-			if (!cgbMode)
-			{
-				std::stable_sort(sprites, sprites + numSprites, [&] (const Sprite& a, const Sprite& b)
-				{
-					return a.x < b.x;
-				});
+				
+				int r;
+				if (flags & SPF_FLIP_Y)
+					r = spy - spriteMinY - 1;
+				else
+					r = y - spy;
+				
+				sprites[numSprites].x = spx;
+				sprites[numSprites].row = (uint8_t)r % 8;
+				sprites[numSprites].tile = tile;
+				sprites[numSprites].flags = flags & spriteFlagsMask;
+				sprites[numSprites].palette = (flags & SPF_PALETTE1) ? regCpy.obp1 : regCpy.obp0;
+				
+				numSprites++;
 			}
 		}
 		
-		std::this_thread::sleep_until(startTime + std::chrono::nanoseconds(MODE_2_END_NS));
-		
-		SetGPUMode(3, y);
-		std::unique_lock<std::mutex> vramLock(mem::vramMutex);
-		
-		//Renders background sprites
-		if (renderSprites)
+		//Sorts sprites to have correct priority
+		if (!renderer.cgbMode)
 		{
-			for (int s = numSprites - 1; s >= 0; s--)
+			std::stable_sort(sprites, sprites + numSprites, [&] (const Sprite& a, const Sprite& b)
 			{
-				if (!(sprites[s].flags & SPF_BACKGROUND))
-					continue;
-				
-				for (int x = 0; x < 8; x++)
-				{
-					int dst = x + sprites[s].x;
-					if (dst >= 0 && dst < RES_X)
-					{
-						pixels[y][dst] = SampleSprite(sprites[s], x).second;
-						pixelHasBkgSprite.set(dst);
-					}
-				}
-			}
+				return a.x < b.x;
+			});
 		}
-		
-		constexpr uint8_t BGATTR_FLIP_X = 1 << 5;
-		constexpr uint8_t BGATTR_FLIP_Y = 1 << 6;
-		constexpr uint8_t BGATTR_HIGH_PRIORITY = 1 << 7;
-		
-		auto RenderBackPixel = [&] (uint8_t tileIdx, uint8_t tileAttr, uint32_t dstX, uint32_t srcX, uint32_t srcY)
+	}
+	
+	//Renders background sprites
+	if (renderSprites)
+	{
+		for (int s = numSprites - 1; s >= 0; s--)
 		{
-			Tile* tileMem = reinterpret_cast<Tile*>(mem::vram[(tileAttr >> 3) & 1]);
-			Tile& tile = tileMode8000 ? tileMem[tileIdx] : tileMem[256 + (int8_t)tileIdx];
-			
-			uint32_t px = srcX % 8;
-			px = (tileAttr & BGATTR_FLIP_X) ? (7 - px) : px;
+			if (!(sprites[s].flags & SPF_BACKGROUND))
+				continue;
 			
-			uint32_t py = srcY % 8;
-			py = (tileAttr & BGATTR_FLIP_Y) ? (7 - py) : py;
-			
-			uint8_t color = tile.At(px, py);
-			if (color != 0 || !pixelHasBkgSprite[dstX] || (tileAttr & BGATTR_HIGH_PRIORITY))
+			for (int x = 0; x < 8; x++)
 			{
-				if (cgbMode)
+				int dst = x + sprites[s].x;
+				if (dst >= 0 && dst < RES_X)
 				{
-					pixels[y][dstX] = ResolveCGBColor(mem::backPaletteMemory, tileAttr & 7, color);
-				}
-				else
-				{
-					pixels[y][dstX] = gpu::ResolveColorMonochrome(color, regCpy.bgp);
+					renderer.pixels[y][dst] = SampleSprite(sprites[s], x).second;
+					pixelHasBkgSprite.set(dst);
 				}
 			}
-		};
+		}
+	}
+	
+	constexpr uint8_t BGATTR_FLIP_X = 1 << 5;
+	constexpr uint8_t BGATTR_FLIP_Y = 1 << 6;
+	constexpr uint8_t BGATTR_HIGH_PRIORITY = 1 << 7;
+	
+	auto RenderBackPixel = [&] (uint8_t tileIdx, uint8_t tileAttr, uint32_t dstX, uint32_t srcX, uint32_t srcY)
+	{
+		const int tileNum = tileMode8000 ? tileIdx : 256 + (int8_t)tileIdx;
+		const DecodedTile& tile = renderer.decodedTiles[(tileAttr >> 3) & 1][tileNum][(tileAttr & BGATTR_FLIP_X) != 0];
 		
-		//Renders the background
-		if (renderBackground)
+		uint32_t py = srcY % 8;
+		py = (tileAttr & BGATTR_FLIP_Y) ? (7 - py) : py;
+		
+		uint8_t color = tile.pixels[py][srcX % 8];
+		if (color != 0 || !pixelHasBkgSprite[dstX] || (tileAttr & BGATTR_HIGH_PRIORITY))
 		{
-			const uint32_t srcY = (y + regCpy.scy) % 256;
-			const uint32_t tileMapOffset = (srcY / 8) * 32;
-			for (uint32_t dstX = 0; dstX < RES_X; dstX++)
+			if (renderer.cgbMode)
 			{
-				const uint32_t srcX = (dstX + regCpy.scx) % 256;
-				const uint32_t tileMapIdx = tileMapOffset + srcX / 8;
-				const uint8_t tileIdx = bTileMap[tileMapIdx];
-				const uint8_t tileAttr = bTileAttrMap[tileMapIdx];
-				RenderBackPixel(tileIdx, tileAttr, dstX, srcX, srcY);
+				renderer.pixels[y][dstX] = ResolveCGBColor(renderer.backPaletteMemory, tileAttr & 7, color);
 			}
-		}
-		
-		//Renders the window
-		if (renderWindow && y >= regCpy.wy)
-		{
-			const uint32_t srcY = y - regCpy.wy;
-			const int wx = regCpy.wx - 7;
-			const uint32_t tileMapOffset = (srcY / 8) * 32;
-			for (uint32_t dstX = std::max(wx, 0); dstX < RES_X; dstX++)
+			else
 			{
-				const uint32_t srcX = dstX - wx;
-				const uint32_t tileMapIdx = tileMapOffset + srcX / 8;
-				const uint8_t tileIdx = wTileMap[tileMapIdx];
-				const uint8_t tileAttr = wTileAttrMap[tileMapIdx];
-				RenderBackPixel(tileIdx, tileAttr, dstX, srcX, srcY);
+				renderer.pixels[y][dstX] = gpu::ResolveColorMonochrome(color, regCpy.bgp);
 			}
 		}
-		
-		//Renders foreground sprites
-		if (renderSprites)
+	};
+	
+	//Renders the background
+	if (renderBackground)
+	{
+		const uint32_t srcY = (y + regCpy.scy) % 256;
+		const uint32_t tileMapOffset = (srcY / 8) * 32;
+		for (uint32_t dstX = 0; dstX < RES_X; dstX++)
+		{
+			const uint32_t srcX = (dstX + regCpy.scx) % 256;
+			const uint32_t tileMapIdx = tileMapOffset + srcX / 8;
+			const uint8_t tileIdx = bTileMap[tileMapIdx];
+			const uint8_t tileAttr = bTileAttrMap[tileMapIdx];
+			RenderBackPixel(tileIdx, tileAttr, dstX, srcX, srcY);
+		}
+	}
+	
+	//Renders the window
+	if (renderWindow && y >= regCpy.wy)
+	{
+		const uint32_t srcY = y - regCpy.wy;
+		const int wx = regCpy.wx - 7;
+		const uint32_t tileMapOffset = (srcY / 8) * 32;
+		for (uint32_t dstX = std::max(wx, 0); dstX < RES_X; dstX++)
+		{
+			const uint32_t srcX = dstX - wx;
+			const uint32_t tileMapIdx = tileMapOffset + srcX / 8;
+			const uint8_t tileIdx = wTileMap[tileMapIdx];
+			const uint8_t tileAttr = wTileAttrMap[tileMapIdx];
+			RenderBackPixel(tileIdx, tileAttr, dstX, srcX, srcY);
+		}
+	}
+	
+	//Renders foreground sprites
+	if (renderSprites)
+	{
+		for (int s = numSprites - 1; s >= 0; s--)
 		{
-			for (int s = numSprites - 1; s >= 0; s--)
+			if (sprites[s].flags & SPF_BACKGROUND)
+				continue;
+			
+			for (int x = 0; x < 8; x++)
 			{
-				if (sprites[s].flags & SPF_BACKGROUND)
-					continue;
-				
-				for (int x = 0; x < 8; x++)
+				int dst = x + sprites[s].x;
+				if (dst >= 0 && dst < RES_X)
 				{
-					int dst = x + sprites[s].x;
-					if (dst >= 0 && dst < RES_X)
-					{
-						auto [transparent, color] = SampleSprite(sprites[s], x);
-						if (!transparent)
-							pixels[y][dst] = color;
-					}
+					auto [transparent, color] = SampleSprite(sprites[s], x);
+					if (!transparent)
+						renderer.pixels[y][dst] = color;
 				}
 			}
 		}
+	}
+	
+	if (y == RES_Y - 1)
+	{
+		memcpy(renderer.prevOAM, renderer.oam, sizeof(renderer.oam));
+	}
+}
+
+//Draws the lines sent so far, stopping after the first finished frame if stopAtFrame is set
+static int RenderLines(VideoSink& sink, bool stopAtFrame)
+{
+	gpu::Shared& s = *gpu::shared;
+	const uint64_t end = s.lineWriteIndex.load(std::memory_order_acquire);
+	uint64_t index = s.lineReadIndex.load(std::memory_order_relaxed);
+	
+	int frames = 0;
+	while (index < end)
+	{
+		const gpu::LineRecord& line = s.lines[index % gpu::Shared::LINE_QUEUE_SIZE];
+		index++;
+		
+		//The line is drawn from the memory as it was when it entered mode 3, later writes stay in the log until the next line
+		gpu::ApplyMemoryWrites(line.cycle);
 		
-		if (y == RES_Y - 1)
+		if (line.reg.ly < RES_Y)
 		{
-			memcpy(prevOAM, mem::oam, sizeof(mem::oam));
+			DrawLine(line.reg);
+			continue;
 		}
 		
-		oamLock.unlock();
-		vramLock.unlock();
-		
-		std::this_thread::sleep_until(startTime + std::chrono::nanoseconds(MODE_3_END_NS));
-		
-		SetGPUMode(0, y);
-		MaybeTriggerStatInterrupt(1 << 3);
-		
-		auto endTime = startTime + std::chrono::nanoseconds(MODE_0_END_NS);
-		std::this_thread::sleep_until(endTime);
-		startTime = endTime;
+		PresentFrame(sink);
+		frames++;
+		if (stopAtFrame)
+			break;
 	}
 	
-	SetGPUMode(1, RES_Y);
-	QueueInterrupt(INT_VBLANK);
-	MaybeTriggerStatInterrupt(1 << 4);
+	s.lineReadIndex.store(index);
+	ReleaseCPU();
+	return frames;
+}
+
+//Takes the lines up to the last finished frame, drawing only the lines of that frame. Returns the number of frames taken.
+static int RenderLatestFrame(VideoSink& sink)
+{
+	gpu::Shared& s = *gpu::shared;
+	const uint64_t begin = s.lineReadIndex.load(std::memory_order_relaxed);
+	const uint64_t end = s.lineWriteIndex.load(std::memory_order_acquire);
 	
-	for (int y = RES_Y; y <= 153; y++)
+	//Finds where the last finished frame starts and ends, lines after it belong to a frame that isn't done yet
+	int frames = 0;
+	uint64_t drawBegin = begin;
+	uint64_t frameEnd = begin;
+	for (uint64_t index = begin; index < end; index++)
 	{
-		SetGPUMode(1, y);
-		std::this_thread::sleep_for(std::chrono::nanoseconds(MODE_0_END_NS));
+		if (s.lines[index % gpu::Shared::LINE_QUEUE_SIZE].reg.ly == RES_Y)
+		{
+			drawBegin = frameEnd;
+			frameEnd = index + 1;
+			frames++;
+		}
 	}
+	//Without a finished frame the queued lines are still taken, so the CPU thread never waits on
+	//a full write log for a renderer that is waiting on the V-blank line behind those writes
+	if (frames == 0)
+		return RenderLines(sink, true);
 	
-	CopyPixelsToTexture();
+	for (uint64_t index = begin; index < frameEnd; index++)
+	{
+		const gpu::LineRecord& line = s.lines[index % gpu::Shared::LINE_QUEUE_SIZE];
+		gpu::ApplyMemoryWrites(line.cycle);
+		if (index >= drawBegin && line.reg.ly < RES_Y)
+			DrawLine(line.reg);
+	}
+	PresentFrame(sink);
+	
+	s.lineReadIndex.store(frameEnd);
+	ReleaseCPU();
+	return frames;
+}
+
+int gpu::RenderPending(VideoSink& sink)
+{
+	return RenderLines(sink, false);
+}
+
+//The CPU thread wakes this at the end of a frame, or when it is waiting for lines or writes to be taken out of its queues
+static void WaitForLines()
+{
+	std::unique_lock<std::mutex> lock(gpu::shared->lineMutex);
+	gpu::shared->lineCondition.wait_for(lock, std::chrono::milliseconds(1));
+}
+
+void gpu::RunOneFrame(VideoSink& sink)
+{
+	while (RenderLines(sink, true) == 0)
+		WaitForLines();
+}
+
+int gpu::RunLatestFrame(VideoSink& sink)
+{
+	while (true)
+	{
+		if (const int frames = RenderLatestFrame(sink))
+			return frames;
+		WaitForLines();
+	}
+}
+
+size_t gpu::MemoryFootprint()
+{
+	return sizeof(Shared);
 }
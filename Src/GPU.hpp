@@ -1,7 +1,10 @@
 #pragma once
 
 #include <cstdint>
+#include <cstddef>
 #include <mutex>
+#include <atomic>
+#include <condition_variable>
 
 #include "Common.hpp"
 
@@ -9,8 +12,13 @@ constexpr int RES_X = 160;
 constexpr int RES_Y = 144;
 constexpr int PIXEL_SCALE = 4;
 
-struct SDL_Texture;
-struct SDL_Renderer;
+class VideoSink;
+
+namespace state
+{
+	struct Writer;
+	struct Reader;
+}
 
 static constexpr uint8_t SPF_CGB_VRAM_BANK = 0x8;
 static constexpr uint8_t SPF_PALETTE1 = 0x10;
@@ -35,12 +43,44 @@ namespace gpu
 		uint8_t obp1;
 	};
 	
-	extern std::mutex regMutex;
-	extern RegisterState reg;
+	//The PPU as the CPU sees it, only used on the CPU thread
+	struct PPU
+	{
+		//The registers as the CPU sees them. The renderer gets a copy with each line.
+		RegisterState reg;
+		
+		//The mode and line the PPU is at in the frame, which keep advancing while the LCD is off
+		uint8_t mode;
+		uint8_t line;
+	};
 	
-	extern SDL_Texture* outTexture;
+	//The PPU of the machine bound to the calling thread, see Machine::Bind
+	extern thread_local PPU* ppu;
 	
-	extern uint8_t prevOAM[160];
+	enum class VideoMemory : uint8_t
+	{
+		VRAM, //Offset is bank * 8K + address - 0x8000
+		OAM,
+		BackPalette,
+		SpritePalette,
+		Reload //Replaces all of video memory with the copy taken by ReloadVideoMemory
+	};
+	
+	struct LoggedWrite
+	{
+		uint64_t cycle;
+		uint16_t offset;
+		VideoMemory target;
+		uint8_t val;
+	};
+	
+	//Sent to the renderer when a line enters mode 3, with the registers it is drawn with.
+	//A record with reg.ly == RES_Y marks the start of V-blank, when the finished frame is presented.
+	struct LineRecord
+	{
+		uint64_t cycle;
+		RegisterState reg;
+	};
 	
 	struct Tile
 	{
@@ -53,6 +93,100 @@ namespace gpu
 		}
 	};
 	
+	//A tile decoded to one palette index per pixel, indexed by [y][x]
+	struct DecodedTile
+	{
+		uint8_t pixels[8][8];
+	};
+	
+	//Everything only the render thread uses
+	struct Renderer
+	{
+		//Taken from mem when the log reaches a reload
+		bool cgbMode;
+		
+		//The renderer's copies of video memory. The CPU writes its own copies in mem and logs each write,
+		//the log is applied to these before each scanline is drawn.
+		uint8_t vram[2][8 * 1024];
+		uint8_t oam[160];
+		uint8_t backPaletteMemory[64];
+		uint8_t spritePaletteMemory[64];
+		
+		uint8_t prevOAM[160];
+		
+		//The 384 tiles of each VRAM bank decoded as they are and flipped along X, indexed by [bank][tile][flipX].
+		//Tiles written by ApplyMemoryWrites are marked dirty and decoded again before it returns.
+		DecodedTile decodedTiles[2][384][2];
+		
+		//One bit per tile in each VRAM bank, set when the tile's data is written
+		uint64_t dirtyTiles[2][384 / 64];
+		
+		//The screen pixels in CGB format, and the finished frame in the format given to video sinks
+		uint16_t pixels[RES_Y][RES_X];
+		uint32_t framePixels[RES_Y][RES_X];
+	};
+	
+	//State shared by the CPU thread and the render thread of a machine
+	struct Shared
+	{
+		//Single producer single consumer ring like the write log. Each line is drawn from the memory as of its cycle.
+		//Holds a couple dozen frames, so a fast-forwarding CPU rarely has to wait for a renderer that only draws once per refresh.
+		static constexpr uint32_t LINE_QUEUE_SIZE = 4096;
+		LineRecord lines[LINE_QUEUE_SIZE];
+		std::atomic_uint64_t lineWriteIndex { 0 };
+		std::atomic_uint64_t lineReadIndex { 0 };
+		
+		//Signalled by the CPU thread when a frame is done or it is waiting for the renderer,
+		//and by the render thread when it takes lines or writes while cpuWaiting is set
+		std::mutex lineMutex;
+		std::condition_variable lineCondition;
+		std::atomic_bool cpuWaiting { false };
+		
+		//Single producer single consumer ring, the CPU thread only advances writeIndex and the render thread only readIndex.
+		//Big enough to hold the writes of a few frames, so the CPU only has to wait for the renderer if it is far behind.
+		static constexpr uint32_t WRITE_LOG_SIZE = 1 << 14;
+		LoggedWrite writeLog[WRITE_LOG_SIZE];
+		std::atomic_uint64_t writeIndex { 0 };
+		std::atomic_uint64_t readIndex { 0 };
+		
+		//Set while a renderer is drawing, the CPU thread logs nothing and never waits for it otherwise
+		std::atomic_bool writeLogEnabled { false };
+		
+		//Video memory as of the last ReloadVideoMemory, copied to the renderer's memory when the log reaches the reload
+		struct
+		{
+			std::mutex mutex;
+			uint8_t vram[2][8 * 1024];
+			uint8_t oam[160];
+			uint8_t backPaletteMemory[64];
+			uint8_t spritePaletteMemory[64];
+			bool cgbMode;
+		} reloaded;
+		
+		Renderer renderer {};
+	};
+	
+	//The shared state of the machine bound to the calling thread, see Machine::Bind
+	extern thread_local Shared* shared;
+	
+	//Appends a write to the renderer's video memory to the log, stamped with cycleCounter.
+	//Only called from the CPU thread, waits for the renderer if the log is full. Does nothing before Init
+	//or after StopRenderer, so the CPU can run without a renderer.
+	void LogMemoryWrite(VideoMemory target, uint16_t offset, uint8_t val);
+	
+	inline void LogMemoryWrites(VideoMemory target, uint16_t offset, const uint8_t* vals, uint32_t count)
+	{
+		for (uint32_t i = 0; i < count; i++)
+			LogMemoryWrite(target, offset + i, vals[i]);
+	}
+	
+	//Applies logged writes stamped before untilCycle to the renderer's copies
+	void ApplyMemoryWrites(uint64_t untilCycle);
+	
+	//Makes the renderer start over from mem's video memory and mode, called on the CPU thread after all of it is replaced at once
+	//and once the renderer has been initialized
+	void ReloadVideoMemory();
+	
 	struct CGBPalette
 	{
 		uint16_t colors[4];
@@ -75,9 +209,39 @@ namespace gpu
 		return MONOCHROME_COLORS[(palette >> (colorIdx * 2)) & 3];
 	}
 	
-	void Init(SDL_Renderer* renderer);
+	//Starts drawing the lines the CPU thread sends from now on, called on the render thread
+	void Init();
+	
+	//Stops the CPU thread from sending lines or waiting for the renderer, called on the render thread once it is done drawing
+	void StopRenderer();
+	
+	//Resets the registers and starts a frame at the current cycle, called on the CPU thread by ResetEvents
+	void Reset();
+	
+	//Runs the PPU mode change scheduled for cycle and schedules the next one. Raises the STAT and V-blank interrupts,
+	//runs H-blank DMA and sends each line to the renderer. Called on the CPU thread by the scheduler.
+	void RunEvent(uint64_t cycle);
+	
+	//Turning the LCD off holds LY at 0 and turning it on starts a new frame. The PPU keeps sending lines while the LCD is off,
+	//so frames still reach the renderer.
+	void WriteLCDC(uint8_t val);
 	
 	uint8_t GetRegisterSTAT();
 	
-	void RunOneFrame();
+	//The registers and the position within the frame, on the CPU thread
+	void SaveState(state::Writer& writer);
+	void LoadState(state::Reader& reader);
+	
+	//Bytes used by the renderer's video memory, tile cache, write log and framebuffers
+	size_t MemoryFootprint();
+	
+	//Draws the lines sent by the CPU thread until a frame is done and hands it to sink, waiting for the lines that haven't been sent yet
+	void RunOneFrame(VideoSink& sink);
+	
+	//Waits for a frame like RunOneFrame, but if several frames are done only draws and presents the last of them.
+	//The lines of the frames before it only have their memory writes applied. Returns the number of frames taken.
+	int RunLatestFrame(VideoSink& sink);
+	
+	//Draws the lines sent so far without waiting, handing each finished frame to sink. Returns the number of frames finished.
+	int RenderPending(VideoSink& sink);
 }
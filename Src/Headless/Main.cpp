@@ -0,0 +1,186 @@
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <memory>
+#include <atomic>
+#include <cstdlib>
+
+#include "CPU.hpp"
+#include "GPU.hpp"
+#include "Memory.hpp"
+#include "Common.hpp"
+#include "Audio.hpp"
+#include "Emulator.hpp"
+#include "IdleLoop.hpp"
+#include "Trace.hpp"
+#include "Machine.hpp"
+#include "Sinks.hpp"
+
+//Runs a ROM without a window or audio device, drawing into a video sink and mixing into an audio sink.
+//The CPU thread is paced to the speed of the real hardware and this thread draws each frame once the CPU is done with it.
+
+static constexpr int CYCLES_PER_SLICE = 1024;
+
+static std::atomic_bool shouldQuit;
+
+static void PrintUsage()
+{
+	std::cerr << "Usage: gbemu-headless rom [-frames N] [-video path] [-audio path] [-input path] [-jit] [-noidle] [-v] [-d]\n"
+		"  -frames N    Stops after N frames, the default is 600\n"
+		"  -video path  Appends each frame to path as raw RGBA, " << RES_X << "x" << RES_Y << " pixels\n"
+		"  -audio path  Writes the sound to path as raw signed 8 bit stereo at " << AUDIO_OUTPUT_FREQ << " Hz\n"
+		"  -input path  Replays path, one byte of held BTN_* bits per frame\n";
+}
+
+static void CPUThreadTarget(AudioSink& audioSink)
+{
+	auto targetTime = std::chrono::high_resolution_clock::now();
+	
+	while (!shouldQuit)
+	{
+		int cycles = RunCycles(CYCLES_PER_SLICE);
+		audioSink.Update(*audioQueue);
+		
+		targetTime += std::chrono::nanoseconds((int64_t)(NSPerClockCycle() * cycles));
+		std::this_thread::sleep_until(targetTime);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	//Parses arguments
+	const char* romPath = nullptr;
+	long numFrames = 600;
+	std::string videoPath;
+	std::string audioPath;
+	std::string inputPath;
+	for (int i = 1; i < argc; i++)
+	{
+		std::string_view arg(argv[i]);
+		bool hasValue = i + 1 < argc;
+		if (arg == "-frames" && hasValue)
+			numFrames = strtol(argv[++i], nullptr, 10);
+		else if (arg == "-video" && hasValue)
+			videoPath = argv[++i];
+		else if (arg == "-audio" && hasValue)
+			audioPath = argv[++i];
+		else if (arg == "-input" && hasValue)
+			inputPath = argv[++i];
+		else if (arg == "-d")
+			devMode = true;
+		else if (arg == "-v")
+			verboseMode = true;
+		else if (arg == "-jit")
+			jitMode = true;
+		else if (arg == "-noidle")
+			idle::enabled = false;
+		else if (argv[i][0] != '-')
+			romPath = argv[i];
+		else
+		{
+			PrintUsage();
+			return 2;
+		}
+	}
+	
+	if (romPath == nullptr)
+	{
+		PrintUsage();
+		return 2;
+	}
+	
+	std::unique_ptr<VideoSink> videoSink;
+	if (videoPath.empty())
+	{
+		videoSink = std::make_unique<NullVideoSink>();
+	}
+	else
+	{
+		auto file = std::make_unique<RawVideoFile>(videoPath);
+		if (!file->IsOpen())
+		{
+			std::cerr << "Failed to open file for writing: '" << videoPath << "'.\n";
+			return 2;
+		}
+		videoSink = std::move(file);
+	}
+	
+	std::unique_ptr<AudioSink> audioSink;
+	if (audioPath.empty())
+	{
+		audioSink = std::make_unique<NullAudioSink>();
+	}
+	else
+	{
+		auto file = std::make_unique<RawAudioFile>(audioPath);
+		if (!file->IsOpen())
+		{
+			std::cerr << "Failed to open file for writing: '" << audioPath << "'.\n";
+			return 2;
+		}
+		audioSink = std::move(file);
+	}
+	
+	std::unique_ptr<InputSource> inputSource;
+	if (inputPath.empty())
+	{
+		inputSource = std::make_unique<NullInputSource>();
+	}
+	else
+	{
+		auto file = std::make_unique<RawInputFile>(inputPath);
+		if (!file->IsOpen())
+		{
+			std::cerr << "Failed to open file for reading: '" << inputPath << "'.\n";
+			return 2;
+		}
+		inputSource = std::move(file);
+	}
+	
+	if (verboseMode)
+		trace::outputPath = std::string(romPath) + ".trace";
+	
+	Machine machine;
+	machine.Bind();
+	
+	if (!machine.Run([&] { return mem::Init(romPath); }))
+	{
+		std::cerr << "Failed to load ROM: '" << romPath << "'.\n";
+		return 2;
+	}
+	
+	gpu::Init();
+	InitInstructionDebug();
+	
+	machine.Run([]
+	{
+		InitCPU();
+		gpu::ReloadVideoMemory();
+	});
+	
+	machine.Post([&] { CPUThreadTarget(*audioSink); });
+	
+	for (long frame = 0; frame < numFrames; frame++)
+	{
+		inputSource->Update();
+		gpu::RunOneFrame(*videoSink);
+	}
+	
+	shouldQuit = true;
+	gpu::StopRenderer();
+	
+	//Runs once CPUThreadTarget has returned
+	machine.Run([]
+	{
+		if (devMode)
+		{
+			idle::PrintStats(std::cout);
+			PrintMemoryFootprint(std::cout);
+		}
+		if (verboseMode)
+			trace::Flush();
+	});
+}
@@ -0,0 +1,171 @@
+#include "IdleLoop.hpp"
+#include "Emulator.hpp"
+#include "DecodeCache.hpp"
+#include "CPU.hpp"
+#include "Memory.hpp"
+
+#include <vector>
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+
+namespace idle
+{
+	bool enabled = true;
+	
+	static constexpr int MAX_LOOP_INSTRUCTIONS = 8;
+	
+	//Entry points that aren't in a polling loop, or keep changing state like delay loops, are given up on after this many tries without a skip
+	static constexpr uint32_t MAX_MISSES = 64;
+	
+	thread_local Detector* detector;
+	
+	void Clear()
+	{
+		detector->entryPoints.clear();
+		detector->loopStats.clear();
+	}
+	
+	static uint32_t LoopKey(uint16_t address)
+	{
+		return address < 0x4000 ? address : (mem::ActiveRomBank() << 16) | address;
+	}
+	
+	//DIV, TIMA, HDMA5 and the sound registers change without an event being scheduled, so polling them isn't idle
+	static bool IsVolatileAddress(uint16_t address)
+	{
+		return address == (0xFF00 | IOREG_DIV) || address == (0xFF00 | IOREG_TIMA) || address == (0xFF00 | IOREG_HDMA5) ||
+			(address >= (0xFF00 | IOREG_NR10) && address <= 0xFF3F);
+	}
+	
+	//Returns true if an instruction only reads memory and changes nothing but registers other than SP
+	static bool IsPollingInstruction(uint8_t op, uint16_t imm)
+	{
+		const uint16_t hl = cpu->reg16[REG_HL];
+		switch (op)
+		{
+		case 0x00: //NOP
+		case 0x18: case 0x20: case 0x28: case 0x30: case 0x38: //JR
+		case 0xC2: case 0xC3: case 0xCA: case 0xD2: case 0xDA: case 0xE9: //JP
+		case 0x01: case 0x11: case 0x21: //LD rr nn
+		case 0x03: case 0x0B: case 0x13: case 0x1B: case 0x23: case 0x2B: //INC rr, DEC rr
+		case 0x09: case 0x19: case 0x29: case 0x39: case 0xF8: //ADD HL rr, LD HL SP+n
+		case 0x07: case 0x0F: case 0x17: case 0x1F: case 0x27: case 0x2F: case 0x37: case 0x3F:
+		case 0xC6: case 0xCE: case 0xD6: case 0xDE: case 0xE6: case 0xEE: case 0xF6: case 0xFE:
+			return true;
+		case 0x0A: //LD A (BC)
+			return !IsVolatileAddress(cpu->reg16[REG_BC]);
+		case 0x1A: //LD A (DE)
+			return !IsVolatileAddress(cpu->reg16[REG_DE]);
+		case 0x2A: case 0x3A: //LD A (HL+), LD A (HL-)
+			return !IsVolatileAddress(hl);
+		case 0xF0: //LDH A (n)
+			return !IsVolatileAddress(0xFF00 | imm);
+		case 0xF2: //LD A (C)
+			return !IsVolatileAddress(0xFF00 | cpu->reg8[REG_C]);
+		case 0xFA: //LD A (nn)
+			return !IsVolatileAddress(imm);
+		case 0xCB:
+			//Only BIT leaves (HL) untouched
+			if ((imm & 7) == 6)
+				return imm >= 0x40 && imm < 0x80 && !IsVolatileAddress(hl);
+			return true;
+		}
+		
+		//LD r r, LD r (HL), INC r, DEC r, LD r n and ALU operations
+		if (op >= 0x40 && op < 0xC0 && op != 0x76 && (op < 0x70 || op > 0x77))
+			return (op & 7) != 6 || !IsVolatileAddress(hl);
+		if (op < 0x40 && (op & 7) >= 4 && (op & 7) <= 6 && op != 0x34 && op != 0x35 && op != 0x36)
+			return true;
+		return false;
+	}
+	
+	static bool SameState(const CPU& a, const CPU& b)
+	{
+		for (int i = REG_A; i <= REG_H; i++)
+		{
+			if (a.reg8[i] != b.reg8[i])
+				return false;
+		}
+		return GetFlags(a) == GetFlags(b) && a.sp == b.sp && a.pc == b.pc &&
+			a.intEnableMaster == b.intEnableMaster && a.halted == b.halted;
+	}
+	
+	bool TrySkip(uint64_t wakeCycle)
+	{
+		const uint16_t startPC = cpu->pc;
+		if (!enabled || emulator->debugHooksEnabled || cpu->halted || startPC >= 0x8000 || mem::DMACyclesLeft() != 0)
+			return false;
+		
+		EntryPoint& entryPoint = detector->entryPoints[LoopKey(startPC)];
+		if (entryPoint.rejected)
+			return false;
+		
+		const CPU startState = *cpu;
+		const uint64_t startCycle = emulator->cycleCounter;
+		uint16_t loopStart = startPC;
+		
+		//Runs one iteration, checking every instruction before it executes
+		int numInstructions = 0;
+		do
+		{
+			const uint16_t pc = cpu->pc;
+			if (emulator->cycleCounter >= wakeCycle || (cpu->intEnableMaster && (cpu->intEnableReg & mem::memory->ioReg[IOREG_IF])))
+				return false;
+			
+			DecodedInstruction* entry = pc < 0x8000 ? decode::Lookup(pc) : nullptr;
+			if (entry == nullptr || numInstructions == MAX_LOOP_INSTRUCTIONS ||
+				(entry->handler == nullptr && !DecodeInstruction(pc, *entry)) ||
+				!IsPollingInstruction(mem::Read(pc), entry->imm))
+			{
+				break;
+			}
+			
+			emulator->cycleCounter += StepCPU();
+			loopStart = std::min(loopStart, pc);
+			numInstructions++;
+		} while (cpu->pc != startPC);
+		
+		if (numInstructions == 0 || cpu->pc != startPC || !SameState(startState, *cpu))
+		{
+			if (++entryPoint.misses >= MAX_MISSES && entryPoint.skips == 0)
+				entryPoint.rejected = true;
+			return false;
+		}
+		
+		//Stops on the last iteration that starts before wakeCycle, so the instructions around the event run as usual
+		const uint64_t iterationCycles = emulator->cycleCounter - startCycle;
+		if (emulator->cycleCounter + iterationCycles >= wakeCycle)
+			return false;
+		
+		const uint64_t iterations = (wakeCycle - emulator->cycleCounter - 1) / iterationCycles;
+		emulator->cycleCounter += iterations * iterationCycles;
+		entryPoint.skips++;
+		
+		LoopStats& stats = detector->loopStats[LoopKey(loopStart)];
+		stats.skips++;
+		stats.cyclesSkipped += iterations * iterationCycles;
+		stats.iterationCycles = (uint32_t)iterationCycles;
+		return true;
+	}
+	
+	void PrintStats(std::ostream& stream)
+	{
+		std::vector<std::pair<uint32_t, LoopStats>> sorted(detector->loopStats.begin(), detector->loopStats.end());
+		std::sort(sorted.begin(), sorted.end(), [] (const auto& a, const auto& b)
+		{
+			return a.second.cyclesSkipped > b.second.cyclesSkipped;
+		});
+		if (sorted.size() > 16)
+			sorted.resize(16);
+		
+		stream << "Idle loops: " << detector->loopStats.size() << "\n";
+		for (const auto& [key, stats] : sorted)
+		{
+			stream << "  " << std::hex << std::setfill('0') << std::setw(2) << (key >> 16) << ":" << std::setw(4) << (key & 0xFFFF)
+				<< std::dec << std::setfill(' ') << std::setw(12) << stats.skips << " skips"
+				<< std::setw(14) << stats.cyclesSkipped << " cycles"
+				<< std::setw(6) << stats.iterationCycles << " cycles/iteration\n";
+		}
+	}
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+#include <iosfwd>
+#include <unordered_map>
+
+//Detects busy-wait loops that poll memory without changing any state, like "LDH A,(44h); CP n; JR NZ" or "JR -2".
+//Such a loop behaves the same on every iteration until something outside the CPU changes, so it can be skipped to the next event.
+namespace idle
+{
+	extern bool enabled;
+	
+	struct EntryPoint
+	{
+		uint32_t skips;
+		uint32_t misses;
+		bool rejected;
+	};
+	
+	struct LoopStats
+	{
+		uint64_t skips;
+		uint64_t cyclesSkipped;
+		uint32_t iterationCycles;
+	};
+	
+	//The loops a machine has tried to skip, only used on the CPU thread.
+	//Both maps are keyed by ROM bank << 16 | address. Loops are identified by their lowest instruction address.
+	struct Detector
+	{
+		std::unordered_map<uint32_t, EntryPoint> entryPoints;
+		std::unordered_map<uint32_t, LoopStats> loopStats;
+	};
+	
+	//The detector of the machine bound to the calling thread, see Machine::Bind
+	extern thread_local Detector* detector;
+	
+	//Runs one iteration of the loop at the PC. If the iteration only polled memory and left the CPU exactly as it was,
+	//cycleCounter is advanced by whole iterations up to just before wakeCycle. Returns true if cycles were skipped.
+	bool TrySkip(uint64_t wakeCycle);
+	
+	//Forgets all loops, must be called when a new cartridge is loaded
+	void Clear();
+	
+	//Prints the loops that skipped the most cycles
+	void PrintStats(std::ostream& stream);
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cstdint>
+#include <mutex>
 
 enum
 {
@@ -16,6 +17,18 @@ enum
 
 extern const char* BUTTON_SHORT_NAMES[8];
 
+//Buttons held down, written by the thread handling input events and read by the CPU thread through JOYP
+struct InputState
+{
+	std::mutex mutex;
+	uint32_t buttonDownMask = 0xFF;
+};
+
+//The input state of the machine bound to the calling thread, see Machine::Bind
+extern thread_local InputState* inputState;
+
 uint32_t GetButtonMask();
 
-void InitInput();
+//Presses or releases a BTN_* button on the machine bound to the calling thread, 0xFF is ignored
+void SetButtonDown(uint32_t btn);
+void SetButtonUp(uint32_t btn);
@@ -0,0 +1,421 @@
+#include "JIT.hpp"
+#include "DecodeCache.hpp"
+#include "CPU.hpp"
+#include "Memory.hpp"
+#include "Emulator.hpp"
+
+#include <vector>
+#include <cstring>
+
+#ifdef GBEMU_JIT
+#include <sys/mman.h>
+#endif
+
+namespace jit
+{
+	thread_local Compiler* compiler;
+
+#ifdef GBEMU_JIT
+	static constexpr size_t CODE_BUFFER_SIZE = 16 * 1024 * 1024;
+	static constexpr uint16_t HOT_THRESHOLD = 32;
+	static constexpr uint16_t NOT_COMPILABLE = 0xFFFF;
+	static constexpr int MAX_BLOCK_INSTRUCTIONS = 64;
+	
+	void Clear()
+	{
+		compiler->blocks.clear();
+		compiler->codeBufferUsed = 0;
+	}
+	
+	Compiler::~Compiler()
+	{
+		if (codeBuffer != nullptr)
+			munmap(codeBuffer, CODE_BUFFER_SIZE);
+	}
+	
+	enum class OpKind
+	{
+		Normal,
+		EndsBlock,
+		Excluded
+	};
+	
+	//Instructions that change control flow end a block. Instructions that touch I/O registers,
+	//the interrupt state or that are invalid are left to the interpreter.
+	static OpKind ClassifyInstruction(uint8_t op, uint16_t imm)
+	{
+		switch (op)
+		{
+		case 0x18: case 0x20: case 0x28: case 0x30: case 0x38: //JR
+		case 0xC2: case 0xC3: case 0xCA: case 0xD2: case 0xDA: case 0xE9: //JP
+		case 0xC4: case 0xCC: case 0xCD: case 0xD4: case 0xDC: //CALL
+		case 0xC0: case 0xC8: case 0xC9: case 0xD0: case 0xD8: case 0xD9: //RET
+		case 0xC7: case 0xCF: case 0xD7: case 0xDF: case 0xE7: case 0xEF: case 0xF7: case 0xFF: //RST
+			return OpKind::EndsBlock;
+		case 0x10: case 0x76: case 0xF3: case 0xFB: //STOP, HALT, DI, EI
+		case 0xE0: case 0xF0: case 0xE2: case 0xF2: //LDH
+		case 0xD3: case 0xDB: case 0xDD: case 0xE3: case 0xE4: case 0xEB: case 0xEC: case 0xED: case 0xF4: case 0xFC: case 0xFD:
+			return OpKind::Excluded;
+		case 0xEA: case 0xFA: //LD (nn) A, LD A (nn)
+			return imm >= 0xFF00 ? OpKind::Excluded : OpKind::Normal;
+		default:
+			return OpKind::Normal;
+		}
+	}
+	
+	struct CodeWriter
+	{
+		struct ExitJump
+		{
+			size_t offset;
+			uint16_t pc;
+		};
+		
+		std::vector<uint8_t> code;
+		std::vector<ExitJump> exitJumps;
+		
+		void Emit(std::initializer_list<uint8_t> bytes)
+		{
+			code.insert(code.end(), bytes);
+		}
+		
+		template <typename T>
+		void EmitImm(T value)
+		{
+			uint8_t bytes[sizeof(T)];
+			std::memcpy(bytes, &value, sizeof(T));
+			code.insert(code.end(), bytes, bytes + sizeof(T));
+		}
+		
+		//Emits a jcc rel32 out of the block. Each exit gets a stub that stores pc, so the block itself only
+		//stores pc before calling a handler and when it ends.
+		void EmitExitJump(uint8_t cc, uint16_t pc)
+		{
+			Emit({ 0x0F, cc });
+			exitJumps.push_back({ code.size(), pc });
+			EmitImm<int32_t>(0);
+		}
+		
+		void EmitStorePC(uint16_t pc)
+		{
+			Emit({ 0x66, 0xC7, 0x45, PC_OFFSET }); //mov word [rbp+pc], imm16
+			EmitImm<uint16_t>(pc);
+		}
+		
+		void EmitAddCycles(uint8_t cycles)
+		{
+			Emit({ 0x83, 0xC3, cycles }); //add ebx, imm8
+		}
+		
+		static constexpr uint8_t PC_OFFSET = offsetof(CPU, pc);
+	};
+	
+	static constexpr uint8_t RegOffset(int reg) { return (uint8_t)(offsetof(CPU, reg8) + reg); }
+	static constexpr uint8_t FLAG_OP_OFFSET = offsetof(CPU, flagOp);
+	static constexpr uint8_t FLAG_OPERAND_OFFSET = offsetof(CPU, flagOperand);
+	static constexpr uint8_t FLAG_RESULT_OFFSET = offsetof(CPU, flagResult);
+	
+	//Offsets of BC, DE, HL and SP for the 16 bit register fields in bits 4-5 of an opcode
+	static constexpr uint8_t REG16_OFFSETS[] =
+	{
+		(uint8_t)(offsetof(CPU, reg16) + REG_BC * 2),
+		(uint8_t)(offsetof(CPU, reg16) + REG_DE * 2),
+		(uint8_t)(offsetof(CPU, reg16) + REG_HL * 2),
+		(uint8_t)offsetof(CPU, sp)
+	};
+	
+	//Sets al to 1 if the zero flag is set, evaluating the lazy flags like ZeroFlag in CPU.cpp
+	static void EmitZeroFlag(CodeWriter& w)
+	{
+		w.Emit({ 0x80, 0x7D, FLAG_OP_OFFSET, (uint8_t)FlagOp::None }); //cmp byte [rbp+flagOp], None
+		w.Emit({ 0x75, 0x09 });                                        //jne lazy
+		w.Emit({ 0xF6, 0x45, RegOffset(REG_F), 1 << FLAG_ZERO });     //test byte [rbp+F], zero flag
+		w.Emit({ 0x0F, 0x95, 0xC0 });                                  //setnz al
+		w.Emit({ 0xEB, 0x07 });                                        //jmp done
+		w.Emit({ 0x80, 0x7D, FLAG_RESULT_OFFSET, 0x00 });              //lazy: cmp byte [rbp+flagResult], 0
+		w.Emit({ 0x0F, 0x94, 0xC0 });                                  //sete al
+	}
+	
+	//Emits host code for the common instructions that only touch registers, these record their flags the same way
+	//as the interpreter's handlers. Returns false for instructions that have to call their handler.
+	static bool EmitInline(CodeWriter& w, uint8_t op, uint16_t imm, uint16_t nextAddress)
+	{
+		const int dstReg = OpRegToRegIdx[(op >> 3) & 7];
+		const int srcReg = OpRegToRegIdx[op & 7];
+		
+		if (op == 0x00) //NOP
+		{
+			w.EmitAddCycles(4);
+			return true;
+		}
+		
+		if (op >= 0x40 && op < 0x80 && dstReg != -1 && srcReg != -1) //LD r r
+		{
+			w.Emit({ 0x8A, 0x45, RegOffset(srcReg) }); //mov al, [rbp+src]
+			w.Emit({ 0x88, 0x45, RegOffset(dstReg) }); //mov [rbp+dst], al
+			w.EmitAddCycles(4);
+			return true;
+		}
+		
+		if ((op & 0xC7) == 0x06 && dstReg != -1) //LD r n
+		{
+			w.Emit({ 0xC6, 0x45, RegOffset(dstReg), (uint8_t)imm }); //mov byte [rbp+dst], imm8
+			w.EmitAddCycles(8);
+			return true;
+		}
+		
+		if ((op & 0xCF) == 0x01) //LD rr nn
+		{
+			w.Emit({ 0x66, 0xC7, 0x45, REG16_OFFSETS[op >> 4] }); //mov word [rbp+rr], imm16
+			w.EmitImm<uint16_t>(imm);
+			w.EmitAddCycles(12);
+			return true;
+		}
+		
+		if ((op & 0xC7) == 0x03) //INC rr, DEC rr
+		{
+			w.Emit({ 0x66, 0xFF, (uint8_t)(op & 0x08 ? 0x4D : 0x45), REG16_OFFSETS[op >> 4] }); //inc/dec word [rbp+rr]
+			w.EmitAddCycles(8);
+			return true;
+		}
+		
+		//ADD, SUB, AND, XOR, OR and CP with a register or an immediate. ADC and SBC need the carry flag evaluated.
+		const bool aluReg = op >= 0x80 && op < 0xC0 && srcReg != -1;
+		const bool aluImm = op >= 0xC0 && (op & 0x07) == 0x06;
+		const int aluOp = (op >> 3) & 7;
+		if ((aluReg || aluImm) && aluOp != 1 && aluOp != 3)
+		{
+			if (aluReg)
+				w.Emit({ 0x8A, 0x4D, RegOffset(srcReg) }); //mov cl, [rbp+src]
+			else
+				w.Emit({ 0xB1, (uint8_t)imm });             //mov cl, imm8
+			w.Emit({ 0x8A, 0x45, RegOffset(REG_A) });      //mov al, [rbp+A]
+			
+			FlagOp flagOp;
+			switch (aluOp)
+			{
+			case 0: //ADD
+				w.Emit({ 0x88, 0x45, FLAG_OPERAND_OFFSET }); //mov [rbp+flagOperand], al
+				w.Emit({ 0x00, 0xC8 });                      //add al, cl
+				flagOp = FlagOp::Add;
+				break;
+			case 2: //SUB
+			case 7: //CP
+				w.Emit({ 0x88, 0x45, FLAG_OPERAND_OFFSET }); //mov [rbp+flagOperand], al
+				w.Emit({ 0x28, 0xC8 });                      //sub al, cl
+				flagOp = FlagOp::Sub;
+				break;
+			case 4: //AND
+				w.Emit({ 0x20, 0xC8 }); //and al, cl
+				flagOp = FlagOp::And;
+				break;
+			case 5: //XOR
+				w.Emit({ 0x30, 0xC8 }); //xor al, cl
+				flagOp = FlagOp::Logic;
+				break;
+			default: //OR
+				w.Emit({ 0x08, 0xC8 }); //or al, cl
+				flagOp = FlagOp::Logic;
+				break;
+			}
+			
+			if (aluOp != 7)
+				w.Emit({ 0x88, 0x45, RegOffset(REG_A) });          //mov [rbp+A], al
+			w.Emit({ 0x88, 0x45, FLAG_RESULT_OFFSET });             //mov [rbp+flagResult], al
+			w.Emit({ 0xC6, 0x45, FLAG_OP_OFFSET, (uint8_t)flagOp }); //mov byte [rbp+flagOp], flagOp
+			w.EmitAddCycles(aluReg ? 4 : 8);
+			return true;
+		}
+		
+		if (op == 0x18 || op == 0xC3) //JR n, JP nn
+		{
+			w.EmitStorePC(op == 0x18 ? (uint16_t)(nextAddress + (int8_t)imm) : imm);
+			w.EmitAddCycles(op == 0x18 ? 12 : 16);
+			return true;
+		}
+		
+		if (op == 0x20 || op == 0x28 || op == 0xC2 || op == 0xCA) //JR NZ/Z n, JP NZ/Z nn
+		{
+			const bool relative = op < 0x80;
+			EmitZeroFlag(w);
+			w.EmitStorePC(nextAddress);
+			w.EmitAddCycles(relative ? 8 : 12);
+			w.Emit({ 0x84, 0xC0 });                       //test al, al
+			w.Emit({ (uint8_t)(op & 0x08 ? 0x74 : 0x75), 0x09 }); //jz/jnz not taken
+			w.EmitStorePC(relative ? (uint16_t)(nextAddress + (int8_t)imm) : imm);
+			w.EmitAddCycles(4);
+			return true;
+		}
+		
+		return false;
+	}
+	
+	//Block code runs common instructions inline and calls the interpreter's handler for the rest:
+	// rbx = cycles used, r12d = maxCycles, rbp = &cpu, r13 = &exitRequested
+	static BlockFunc CompileBlock(uint16_t startAddress)
+	{
+		CodeWriter w;
+		
+		w.Emit({ 0x53 });                   //push rbx
+		w.Emit({ 0x55 });                   //push rbp
+		w.Emit({ 0x41, 0x54 });             //push r12
+		w.Emit({ 0x41, 0x55 });             //push r13
+		w.Emit({ 0x48, 0x83, 0xEC, 0x08 }); //sub rsp, 8
+		w.Emit({ 0x31, 0xDB });             //xor ebx, ebx
+		w.Emit({ 0x41, 0x89, 0xFC });       //mov r12d, edi
+		w.Emit({ 0x48, 0xBD });             //mov rbp, &cpu
+		w.EmitImm(reinterpret_cast<uint64_t>(cpu));
+		w.Emit({ 0x49, 0xBD });             //mov r13, &exitRequested
+		w.EmitImm(reinterpret_cast<uint64_t>(&compiler->exitRequested));
+		
+		uint16_t address = startAddress;
+		int numInstructions = 0;
+		bool calledHandler = false;
+		bool endsBlock = false;
+		while (numInstructions < MAX_BLOCK_INSTRUCTIONS && !endsBlock)
+		{
+			//Blocks never leave the 16KB region they start in since the next region may be banked differently
+			if ((address ^ startAddress) & 0xC000)
+				break;
+			
+			DecodedInstruction* entry = decode::Lookup(address);
+			if (entry->handler == nullptr && !DecodeInstruction(address, *entry))
+				break;
+			
+			const uint8_t op = mem::Read(address);
+			OpKind kind = ClassifyInstruction(op, entry->imm);
+			if (kind == OpKind::Excluded)
+				break;
+			
+			//Only handlers can write memory, so only they can request an exit
+			if (calledHandler)
+			{
+				w.Emit({ 0x41, 0x80, 0x7D, 0x00, 0x00 }); //cmp byte [r13], 0
+				w.EmitExitJump(0x85, address);            //jne exit
+			}
+			if (numInstructions != 0)
+			{
+				w.Emit({ 0x44, 0x39, 0xE3 });  //cmp ebx, r12d
+				w.EmitExitJump(0x83, address); //jae exit
+			}
+			
+			address += entry->length;
+			numInstructions++;
+			endsBlock = kind == OpKind::EndsBlock;
+			
+			calledHandler = !EmitInline(w, op, entry->imm, address);
+			if (calledHandler)
+			{
+				//Handlers see cycleCounter at the start of their instruction, as in the interpreter,
+				//so it's moved ahead by the cycles used so far for the call and back afterwards
+				w.EmitStorePC(address);
+				w.Emit({ 0x48, 0xB8 });             //mov rax, &cycleCounter
+				w.EmitImm(reinterpret_cast<uint64_t>(&emulator->cycleCounter));
+				w.Emit({ 0x48, 0x01, 0x18 });       //add [rax], rbx
+				w.Emit({ 0xBF });                   //mov edi, imm
+				w.EmitImm<uint32_t>(entry->imm);
+				w.Emit({ 0x48, 0xB8 });             //mov rax, handler
+				w.EmitImm(reinterpret_cast<uint64_t>(entry->handler));
+				w.Emit({ 0xFF, 0xD0 });             //call rax
+				w.Emit({ 0x48, 0xB9 });             //mov rcx, &cycleCounter
+				w.EmitImm(reinterpret_cast<uint64_t>(&emulator->cycleCounter));
+				w.Emit({ 0x48, 0x29, 0x19 });       //sub [rcx], rbx
+				w.Emit({ 0x01, 0xC3 });             //add ebx, eax
+			}
+		}
+		
+		if (numInstructions == 0)
+			return nullptr;
+		
+		//Control flow instructions store their own target, a block that runs into its end continues at address
+		if (!endsBlock && !calledHandler)
+			w.EmitStorePC(address);
+		
+		const size_t epilogue = w.code.size();
+		w.Emit({ 0x89, 0xD8 });             //mov eax, ebx
+		w.Emit({ 0x48, 0x83, 0xC4, 0x08 }); //add rsp, 8
+		w.Emit({ 0x41, 0x5D });             //pop r13
+		w.Emit({ 0x41, 0x5C });             //pop r12
+		w.Emit({ 0x5D });                   //pop rbp
+		w.Emit({ 0x5B });                   //pop rbx
+		w.Emit({ 0xC3 });                   //ret
+		
+		//The exit stubs go after the epilogue, out of the way of the code that runs through the block
+		for (const CodeWriter::ExitJump& exitJump : w.exitJumps)
+		{
+			const int32_t toStub = (int32_t)(w.code.size() - (exitJump.offset + 4));
+			std::memcpy(&w.code[exitJump.offset], &toStub, sizeof(toStub));
+			
+			w.EmitStorePC(exitJump.pc);
+			w.Emit({ 0xE9 }); //jmp epilogue
+			w.EmitImm<int32_t>((int32_t)(epilogue - (w.code.size() + 4)));
+		}
+		
+		if (compiler->codeBuffer == nullptr)
+		{
+			if (compiler->codeBufferFailed)
+				return nullptr;
+			void* mapping = mmap(nullptr, CODE_BUFFER_SIZE, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (mapping == MAP_FAILED)
+			{
+				compiler->codeBufferFailed = true;
+				return nullptr;
+			}
+			compiler->codeBuffer = static_cast<uint8_t*>(mapping);
+		}
+		
+		if (compiler->codeBufferUsed + w.code.size() > CODE_BUFFER_SIZE)
+			return nullptr;
+		
+		//The buffer is only writable while a block is being copied in
+		if (mprotect(compiler->codeBuffer, CODE_BUFFER_SIZE, PROT_READ | PROT_WRITE) != 0)
+			return nullptr;
+		uint8_t* blockCode = compiler->codeBuffer + compiler->codeBufferUsed;
+		std::memcpy(blockCode, w.code.data(), w.code.size());
+		compiler->codeBufferUsed += (w.code.size() + 15) & ~(size_t)15;
+		mprotect(compiler->codeBuffer, CODE_BUFFER_SIZE, PROT_READ | PROT_EXEC);
+		
+		return reinterpret_cast<BlockFunc>(blockCode);
+	}
+	
+	int RunBlock(uint16_t address, DecodedInstruction& entry, int maxCycles)
+	{
+		if (entry.jitBlock == 0)
+		{
+			if (entry.jitHits == NOT_COMPILABLE || ++entry.jitHits < HOT_THRESHOLD)
+				return 0;
+			
+			BlockFunc block = compiler->blocks.size() < 0xFFFF ? CompileBlock(address) : nullptr;
+			if (block == nullptr)
+			{
+				entry.jitHits = NOT_COMPILABLE;
+				return 0;
+			}
+			compiler->blocks.push_back(block);
+			entry.jitBlock = (uint16_t)compiler->blocks.size();
+		}
+		
+		compiler->exitRequested = false;
+		return compiler->blocks[entry.jitBlock - 1](maxCycles);
+	}
+	
+	size_t MemoryFootprint()
+	{
+		return compiler->codeBufferUsed + compiler->blocks.capacity() * sizeof(BlockFunc);
+	}
+#else
+	void Clear() { }
+	
+	Compiler::~Compiler() { }
+	
+	size_t MemoryFootprint()
+	{
+		return 0;
+	}
+	
+	int RunBlock(uint16_t address, DecodedInstruction& entry, int maxCycles)
+	{
+		return 0;
+	}
+#endif
+}
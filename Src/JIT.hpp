@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+struct DecodedInstruction;
+
+//The recompiler emits x86-64 code for the System V calling convention
+#if defined(__x86_64__) && !defined(_WIN32) && !defined(GBEMU_NO_JIT)
+#define GBEMU_JIT
+#endif
+
+namespace jit
+{
+	using BlockFunc = int(*)(int maxCycles);
+	
+	//The compiled blocks of a machine, only used on the CPU thread. The blocks embed the addresses of its CPU,
+	//cycle counter and exitRequested, so they only run while the machine that compiled them is bound.
+	struct Compiler
+	{
+		//Set by memory writes that may switch banks or raise interrupts, makes the running block return early
+		bool exitRequested;
+		
+		//Reserved on the first compile
+		uint8_t* codeBuffer;
+		size_t codeBufferUsed;
+		bool codeBufferFailed;
+		
+		//Indexed by DecodedInstruction::jitBlock - 1
+		std::vector<BlockFunc> blocks;
+		
+		//Unmaps the code buffer
+		~Compiler();
+	};
+	
+	//The compiler of the machine bound to the calling thread, see Machine::Bind
+	extern thread_local Compiler* compiler;
+	
+	//Drops all compiled blocks, must be called together with decode::Clear
+	void Clear();
+	
+	//Runs the compiled block starting at a ROM address, compiling it once the address is hot.
+	//Returns the number of cycles used, or 0 if the interpreter should run the instruction instead.
+	//The block stops after the first instruction that brings the cycle count to maxCycles or above.
+	int RunBlock(uint16_t address, DecodedInstruction& entry, int maxCycles);
+	
+	//Bytes of emitted code and block table, the code buffer is reserved up front but only touched as it fills
+	size_t MemoryFootprint();
+}
@@ -0,0 +1,93 @@
+#include "Machine.hpp"
+#include "CPU.hpp"
+#include "Memory.hpp"
+#include "DecodeCache.hpp"
+#include "JIT.hpp"
+#include "IdleLoop.hpp"
+#include "Trace.hpp"
+#include "Profiler.hpp"
+#include "Autosave.hpp"
+
+//The state only the thread running the machine uses, zeroed like it would be in static storage
+struct Machine::Components
+{
+	CPU cpu;
+	EmulatorState emulator;
+	mem::Memory memory;
+	gpu::PPU ppu;
+	APU apu;
+	decode::Cache cache;
+	jit::Compiler compiler;
+	idle::Detector detector;
+	trace::Recorder recorder;
+	profiler::OpcodeStats opcodeStats[512];
+	autosave::Saver saver;
+};
+
+Machine::Machine()
+	: m_components(new Components()), m_events(new EventQueue), m_gpu(new gpu::Shared), m_input(new InputState), m_audio(new AudioQueue) { }
+
+Machine::~Machine()
+{
+	if (!m_thread.joinable())
+		return;
+	
+	{
+		std::lock_guard<std::mutex> lock(m_taskMutex);
+		m_stopping = true;
+	}
+	m_taskCondition.notify_one();
+	m_thread.join();
+}
+
+void Machine::Bind()
+{
+	Components& components = *m_components;
+	cpu = &components.cpu;
+	emulator = &components.emulator;
+	mem::memory = &components.memory;
+	gpu::ppu = &components.ppu;
+	apu = &components.apu;
+	decode::cache = &components.cache;
+	jit::compiler = &components.compiler;
+	idle::detector = &components.detector;
+	trace::recorder = &components.recorder;
+	profiler::opcodeStats = components.opcodeStats;
+	autosave::saver = &components.saver;
+	
+	eventQueue = m_events.get();
+	gpu::shared = m_gpu.get();
+	inputState = m_input.get();
+	audioQueue = m_audio.get();
+}
+
+void Machine::Post(std::function<void()> task)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_taskMutex);
+		m_tasks.push_back(std::move(task));
+		if (!m_thread.joinable())
+			m_thread = std::thread(&Machine::ThreadTarget, this);
+	}
+	m_taskCondition.notify_one();
+}
+
+void Machine::ThreadTarget()
+{
+	Bind();
+	
+	std::unique_lock<std::mutex> lock(m_taskMutex);
+	while (true)
+	{
+		m_taskCondition.wait(lock, [&] { return !m_tasks.empty() || m_stopping; });
+		if (m_tasks.empty())
+			break;
+		
+		std::function<void()> task = std::move(m_tasks.front());
+		m_tasks.pop_front();
+		
+		lock.unlock();
+		task();
+		lock.lock();
+	}
+}
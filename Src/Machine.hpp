@@ -0,0 +1,66 @@
+#pragma once
+
+#include "Emulator.hpp"
+#include "GPU.hpp"
+#include "Input.hpp"
+#include "Audio.hpp"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <deque>
+#include <memory>
+
+//One emulated Game Boy. The machine owns the state of every subsystem, which reaches it through the pointers Bind sets
+//on the calling thread, so the machine can be run from any thread. The CPU, memory, timer and APU state is only used
+//by the thread running the machine's tasks. The threads that render, handle input or play audio for the machine share
+//the rest with it, and are bound to the machine in the same way.
+class Machine
+{
+public:
+	Machine();
+	
+	//Runs the tasks already posted and waits for the machine's thread to exit, if it was started
+	~Machine();
+	
+	Machine(const Machine&) = delete;
+	Machine& operator=(const Machine&) = delete;
+	
+	//Makes the functions called on the calling thread use this machine. The machine's own thread is bound when it starts.
+	//A machine that is only run from a bound thread never starts a thread of its own.
+	void Bind();
+	
+	//Queues a task to run on the machine's thread, starting the thread on the first call.
+	//Tasks run one at a time in the order they were posted.
+	void Post(std::function<void()> task);
+	
+	//Runs a task on the machine's thread and waits for it to return
+	template <typename F>
+	auto Run(F task) -> decltype(task())
+	{
+		std::packaged_task<decltype(task())()> packagedTask(std::move(task));
+		auto result = packagedTask.get_future();
+		Post([&] { packagedTask(); });
+		return result.get();
+	}
+
+private:
+	void ThreadTarget();
+	
+	struct Components;
+	std::unique_ptr<Components> m_components;
+	
+	std::unique_ptr<EventQueue> m_events;
+	std::unique_ptr<gpu::Shared> m_gpu;
+	std::unique_ptr<InputState> m_input;
+	std::unique_ptr<AudioQueue> m_audio;
+	
+	std::mutex m_taskMutex;
+	std::condition_variable m_taskCondition;
+	std::deque<std::function<void()>> m_tasks;
+	bool m_stopping = false;
+	
+	std::thread m_thread;
+};
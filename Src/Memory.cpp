@@ -4,112 +4,446 @@
 #include "Input.hpp"
 #include "Common.hpp"
 #include "Audio.hpp"
+#include "DecodeCache.hpp"
+#include "JIT.hpp"
+#include "IdleLoop.hpp"
+#include "Emulator.hpp"
+#include "SaveState.hpp"
 
+#include <algorithm>
 #include <cstring>
 #include <vector>
 #include <iomanip>
 #include <iostream>
 #include <fstream>
 #include <cassert>
+#include <array>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 #define ZLIB_CONST
 #include <zlib.h>
 
-uint8_t ioReg[128];
-
 namespace mem
 {
-	static std::vector<uint8_t> cartridgeData;
+	static constexpr size_t ROM_BANK_SIZE = 16 * 1024;
 	
-	uint8_t* romBankStart;    //Start of switchable ROM bank at 0x4000
-	uint8_t* extRamBankStart; //Start of external RAM bank at 0xA000
-	uint8_t* vramBankStart;   //Start of VRAM bank at 0x8000
-	uint8_t* wramBankStart;   //Start of switchable WRAM bank at 0xD000
+	thread_local Memory* memory;
 	
-	std::mutex vramMutex;
-	std::mutex oamMutex;
+	//The transfer copies one byte per cycle
+	static constexpr uint64_t DMA_CYCLES = sizeof(Memory::oam);
 	
-	uint8_t extRam[256 * 1024];
-	uint8_t vram[2][8 * 1024];
-	uint8_t wram[32 * 1024];
-	uint8_t oam[160];
+	//Points the pages covering [address, address + size) to consecutive host memory.
+	//No page is writable during OAM DMA, so that writes go through the slow path which catches the transfer up first.
+	static void MapPages(uint16_t address, size_t size, uint8_t* host, bool writable)
+	{
+		for (size_t offset = 0; offset < size; offset += 256)
+		{
+			memory->readPages[(address + offset) >> 8] = host + offset;
+			memory->writePages[(address + offset) >> 8] = (writable && memory->dmaMin == -1) ? host + offset : nullptr;
+		}
+	}
 	
-	uint8_t backPaletteMemory[64];
-	uint8_t spritePaletteMemory[64];
+	static void SetRomBank(uint32_t bankIdx)
+	{
+		bankIdx %= memory->cartridgeSize / ROM_BANK_SIZE;
+		memory->romBankStart = memory->cartridgeData + ROM_BANK_SIZE * bankIdx;
+		MapPages(0x4000, ROM_BANK_SIZE, memory->romBankStart, false);
+		decode::OnRomBankChanged(bankIdx);
+	}
 	
-	static uint8_t hram[127];
+	//MBC2 RAM only stores the low 4 bits, so it is only written through the slow path
+	static void MapExtRam()
+	{
+		std::fill(memory->readPages + 0xA0, memory->readPages + 0xC0, nullptr);
+		std::fill(memory->writePages + 0xA0, memory->writePages + 0xC0, nullptr);
+		if (memory->extRamBankStart == nullptr || memory->rtcSelected != -1)
+			return;
+		
+		for (size_t page = 0; page < 0x20; page++)
+		{
+			const size_t offset = (memory->extRamBankStart - memory->extRam.data()) + page * 256 % memory->extRamBankSize;
+			memory->readPages[0xA0 + page] = memory->extRam.data() + offset;
+			if (memory->activeMBC != MBC::MBC2 && memory->dmaMin == -1 && memory->ramPagesDirty[offset / 256])
+				memory->writePages[0xA0 + page] = memory->extRam.data() + offset;
+		}
+	}
+	
+	static void MarkRamDirty(const uint8_t* ptr)
+	{
+		const size_t page = (ptr - memory->extRam.data()) / 256;
+		if (!memory->ramPagesDirty[page])
+		{
+			memory->ramPagesDirty[page] = true;
+			memory->anyRamPageDirty = true;
+			MapExtRam();
+		}
+	}
 	
-	enum class BankMode
+	static void SetWramBank(uint8_t* bankStart)
 	{
-		ROM,
-		RAM
+		memory->wramBankStart = bankStart;
+		MapPages(0xD000, 4 * 1024, memory->wramBankStart, true);
+	}
+	
+	static void MapAllPages()
+	{
+		std::fill(std::begin(memory->readPages), std::end(memory->readPages), nullptr);
+		std::fill(std::begin(memory->writePages), std::end(memory->writePages), nullptr);
+		MapPages(0x0000, ROM_BANK_SIZE, memory->cartridgeData, false);
+		MapPages(0x4000, ROM_BANK_SIZE, memory->romBankStart, false);
+		MapPages(0x8000, 8 * 1024, memory->vramBankStart, false);
+		MapExtRam();
+		MapPages(0xC000, 4 * 1024, memory->wram, true);
+		MapPages(0xD000, 4 * 1024, memory->wramBankStart, true);
+		MapPages(0xE000, 0x1E00, memory->wram, true);
+	}
+	
+	//Banks past the end of the cartridge's RAM wrap around
+	static void SetRamBank(uint32_t bank)
+	{
+		if (!memory->extRam.empty())
+			memory->extRamBankStart = memory->extRam.data() + memory->extRamBankSize * (bank % (memory->extRam.size() / memory->extRamBankSize));
+		MapExtRam();
+	}
+	
+	//Cartridge RAM size given by header byte 0x149, MBC2 has 512 half bytes built in instead
+	static size_t CartridgeRamSize(uint8_t sizeCode)
+	{
+		if (memory->activeMBC == MBC::MBC2)
+			return 512;
+		
+		switch (sizeCode)
+		{
+		case 0x01: return 2 * 1024;
+		case 0x02: return 8 * 1024;
+		case 0x03: return 32 * 1024;
+		case 0x04: return 128 * 1024;
+		case 0x05: return 64 * 1024;
+		default: return 0;
+		}
+	}
+	
+	enum
+	{
+		RTC_S,
+		RTC_M,
+		RTC_H,
+		RTC_DL,
+		RTC_DH
 	};
 	
-	static BankMode bankMode;
-	static uint32_t currentRomBank;
+	static constexpr uint8_t RTC_DH_DAY_HIGH = 0x01;
+	static constexpr uint8_t RTC_DH_HALT = 0x40;
+	static constexpr uint8_t RTC_DH_DAY_CARRY = 0x80;
 	
-	MBC activeMBC;
+	static constexpr uint8_t RTC_REGISTER_MASKS[] = { 0x3F, 0x3F, 0x1F, 0xFF, 0xC1 };
 	
-	void UpdateCurrentRomBank()
+	static void SyncRTC()
 	{
-		uint32_t bankIdx = currentRomBank;
-		if ((bankIdx % 32) == 0 && activeMBC == MBC::MBC1)
-			bankIdx++;
-		romBankStart = cartridgeData.data() + (16 * 1024) * bankIdx;
+		const uint64_t cycles = emulator->cycleCounter - memory->rtcSyncCycle;
+		memory->rtcSyncCycle = emulator->cycleCounter;
+		if (memory->rtc.registers[RTC_DH] & RTC_DH_HALT)
+			return;
+		
+		const uint64_t cyclesPerSecond = (uint64_t)CLOCK_RATE << cpu->doubleSpeed;
+		const uint64_t elapsed = memory->rtc.subsecondCycles + cycles;
+		memory->rtc.subsecondCycles = elapsed % cyclesPerSecond;
+		if (elapsed < cyclesPerSecond)
+			return;
+		
+		uint64_t seconds = memory->rtc.registers[RTC_S] + elapsed / cyclesPerSecond;
+		uint64_t minutes = memory->rtc.registers[RTC_M] + seconds / 60;
+		uint64_t hours = memory->rtc.registers[RTC_H] + minutes / 60;
+		uint64_t days = (((memory->rtc.registers[RTC_DH] & RTC_DH_DAY_HIGH) << 8) | memory->rtc.registers[RTC_DL]) + hours / 24;
+		
+		uint8_t dh = memory->rtc.registers[RTC_DH] & ~RTC_DH_DAY_HIGH;
+		if (days >= 512)
+			dh |= RTC_DH_DAY_CARRY;
+		days %= 512;
+		
+		memory->rtc.registers[RTC_S] = seconds % 60;
+		memory->rtc.registers[RTC_M] = minutes % 60;
+		memory->rtc.registers[RTC_H] = hours % 24;
+		memory->rtc.registers[RTC_DL] = days & 0xFF;
+		memory->rtc.registers[RTC_DH] = dh | (uint8_t)(days >> 8);
 	}
 	
-	std::string gameName;
-	static bool canSave = false;
+	static void WriteRTC(uint8_t val)
+	{
+		SyncRTC();
+		memory->rtc.registers[memory->rtcSelected] = val & RTC_REGISTER_MASKS[memory->rtcSelected];
+		if (memory->rtcSelected == RTC_S)
+			memory->rtc.subsecondCycles = 0;
+	}
+	
+	//Each MBC is a policy class. Write handles writes to its registers at 0x0000-0x7FFF and is picked
+	//once in Init, so bank switches don't branch on the MBC type. Enabling RAM isn't emulated for any of them.
+	struct NoMBC
+	{
+		static void Write(uint16_t address, uint8_t val) { }
+	};
+	
+	struct MBC1
+	{
+		static void Write(uint16_t address, uint8_t val)
+		{
+			switch (address)
+			{
+			case 0x2000 ... 0x3FFF:
+				memory->currentRomBank = (memory->currentRomBank & ~0x1FU) | (val & 0x1FU);
+				break;
+			case 0x4000 ... 0x5FFF:
+				if (memory->bankMode == BankMode::RAM)
+				{
+					SetRamBank(val & 3);
+					return;
+				}
+				memory->currentRomBank = (memory->currentRomBank & ~(0b11U << 5)) | ((val & 0b11) << 5);
+				break;
+			case 0x6000 ... 0x7FFF:
+				memory->bankMode = (BankMode)(val & 1);
+				return;
+			default:
+				return;
+			}
+			
+			//Banks 0x00, 0x20, 0x40 and 0x60 can't be selected, the bank after is mapped instead
+			SetRomBank((memory->currentRomBank % 32) == 0 ? memory->currentRomBank + 1 : memory->currentRomBank);
+		}
+	};
+	
+	struct MBC2
+	{
+		static void Write(uint16_t address, uint8_t val)
+		{
+			if (address >= 0x2000 && address <= 0x3FFF)
+			{
+				memory->currentRomBank = std::max(val & 0xFU, 1U);
+				SetRomBank(memory->currentRomBank);
+			}
+		}
+	};
+	
+	struct MBC3
+	{
+		static void Write(uint16_t address, uint8_t val)
+		{
+			switch (address)
+			{
+			case 0x2000 ... 0x3FFF:
+				memory->currentRomBank = std::max(val & 0x7FU, 1U);
+				SetRomBank(memory->currentRomBank);
+				break;
+			case 0x4000 ... 0x5FFF:
+				if (val >= 0x08 && val <= 0x0C)
+				{
+					//RTC registers are read and written through the slow path
+					memory->rtcSelected = val - 0x08;
+					MapExtRam();
+				}
+				else
+				{
+					memory->rtcSelected = -1;
+					SetRamBank(val & 3);
+				}
+				break;
+			case 0x6000 ... 0x7FFF:
+				//Writing 0 and then 1 latches the clock into the registers the CPU reads
+				if (memory->rtcLastLatchWrite == 0 && val == 1)
+				{
+					SyncRTC();
+					std::copy_n(memory->rtc.registers, 5, memory->rtc.latched);
+				}
+				memory->rtcLastLatchWrite = val;
+				break;
+			}
+		}
+	};
+	
+	struct MBC5
+	{
+		static void Write(uint16_t address, uint8_t val)
+		{
+			switch (address)
+			{
+			case 0x2000 ... 0x2FFF:
+				memory->currentRomBank = (memory->currentRomBank & ~0xFFU) | val;
+				break;
+			case 0x3000 ... 0x3FFF:
+				memory->currentRomBank = (memory->currentRomBank & ~(uint32_t)(1 << 8)) | (((uint32_t)val & 1) << 8);
+				break;
+			case 0x4000 ... 0x5FFF:
+				SetRamBank(val & 0xF);
+				return;
+			default:
+				return;
+			}
+			SetRomBank(memory->currentRomBank);
+		}
+	};
+	
+	template <typename Mapper>
+	static void SetMapper(MBC mbc, bool hasBattery)
+	{
+		memory->activeMBC = mbc;
+		memory->writeMBC = &Mapper::Write;
+		memory->canSave = hasBattery;
+	}
+	
+	uint32_t ActiveRomBank()
+	{
+		return (uint32_t)((memory->romBankStart - memory->cartridgeData) / ROM_BANK_SIZE);
+	}
+	
+	size_t RomSize()
+	{
+		return memory->cartridgeSize;
+	}
+	
+	bool RomIsShared()
+	{
+		return memory->cartridgeMapping != nullptr;
+	}
+	
+	static void ReleaseCartridge()
+	{
+#ifndef _WIN32
+		if (memory->cartridgeMapping != nullptr)
+			munmap(memory->cartridgeMapping, memory->cartridgeSize);
+#endif
+		memory->cartridgeMapping = nullptr;
+		memory->cartridgeBuffer.clear();
+		memory->cartridgeBuffer.shrink_to_fit();
+	}
+	
+	Memory::~Memory()
+	{
+#ifndef _WIN32
+		if (cartridgeMapping != nullptr)
+			munmap(cartridgeMapping, cartridgeSize);
+#endif
+	}
+	
+	static bool InitCartridge(size_t romSize);
 	
 	bool Init(std::istream& cartridgeStream)
 	{
-		cartridgeData.clear();
-		char cartReadBuf[4096];
-		while (!cartridgeStream.eof())
+		ReleaseCartridge();
+		
+		//Reads the whole stream at once if its size is known, otherwise in chunks
+		const std::streampos start = cartridgeStream.tellg();
+		if (start != std::streampos(-1) && cartridgeStream.seekg(0, std::ios::end))
+		{
+			const std::streamoff size = cartridgeStream.tellg() - start;
+			cartridgeStream.seekg(start);
+			memory->cartridgeBuffer.resize((size_t)size);
+			cartridgeStream.read(reinterpret_cast<char*>(memory->cartridgeBuffer.data()), size);
+			memory->cartridgeBuffer.resize((size_t)cartridgeStream.gcount());
+		}
+		else
+		{
+			cartridgeStream.clear();
+			char cartReadBuf[64 * 1024];
+			while (cartridgeStream.read(cartReadBuf, sizeof(cartReadBuf)) || cartridgeStream.gcount() > 0)
+				memory->cartridgeBuffer.insert(memory->cartridgeBuffer.end(), cartReadBuf, cartReadBuf + cartridgeStream.gcount());
+		}
+		
+		//Pads to whole ROM banks so that any bank the MBC selects is backed by memory
+		const size_t romSize = memory->cartridgeBuffer.size();
+		memory->cartridgeBuffer.resize(std::max((romSize + ROM_BANK_SIZE - 1) / ROM_BANK_SIZE, (size_t)2) * ROM_BANK_SIZE, 0xFF);
+		memory->cartridgeData = memory->cartridgeBuffer.data();
+		memory->cartridgeSize = memory->cartridgeBuffer.size();
+		
+		return InitCartridge(romSize);
+	}
+	
+	bool Init(const char* romPath)
+	{
+#ifndef _WIN32
+		//Maps the file directly if it doesn't need padding, so processes running the same ROM share its pages
+		int fd = open(romPath, O_RDONLY);
+		if (fd != -1)
 		{
-			cartridgeStream.read(cartReadBuf, sizeof(cartReadBuf));
-			cartridgeData.insert(cartridgeData.end(), cartReadBuf, cartReadBuf + cartridgeStream.gcount());
+			struct stat fileStat;
+			void* mapping = MAP_FAILED;
+			if (fstat(fd, &fileStat) == 0 && fileStat.st_size >= (off_t)(2 * ROM_BANK_SIZE) && fileStat.st_size % ROM_BANK_SIZE == 0)
+				mapping = mmap(nullptr, fileStat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+			close(fd);
+			
+			if (mapping != MAP_FAILED)
+			{
+				ReleaseCartridge();
+				memory->cartridgeMapping = mapping;
+				memory->cartridgeData = static_cast<uint8_t*>(mapping);
+				memory->cartridgeSize = fileStat.st_size;
+				return InitCartridge(memory->cartridgeSize);
+			}
 		}
+#endif
 		
-		if (cartridgeData.size() <= 0x014F)
+		std::ifstream cartridgeStream(romPath, std::ios::binary);
+		return cartridgeStream && Init(cartridgeStream);
+	}
+	
+	static bool InitCartridge(size_t romSize)
+	{
+		if (romSize <= 0x014F)
 			return false;
 		
-		uint8_t mbcMode = cartridgeData[0x147];
+		uint8_t mbcMode = memory->cartridgeData[0x147];
 		switch (mbcMode)
 		{
 		case 0x00:
+		case 0x08:
+			SetMapper<NoMBC>(MBC::None, false);
+			break;
+		case 0x09:
+			SetMapper<NoMBC>(MBC::None, true);
+			break;
 		case 0x01:
 		case 0x02:
-			activeMBC = MBC::MBC1;
+			SetMapper<MBC1>(MBC::MBC1, false);
 			break;
 		case 0x03:
-			canSave = true;
-			activeMBC = MBC::MBC1;
+			SetMapper<MBC1>(MBC::MBC1, true);
 			break;
 		case 0x05:
-			activeMBC = MBC::MBC2;
+			SetMapper<MBC2>(MBC::MBC2, false);
 			break;
 		case 0x06:
-			canSave = true;
-			activeMBC = MBC::MBC2;
+			SetMapper<MBC2>(MBC::MBC2, true);
+			break;
+		case 0x11:
+		case 0x12:
+			SetMapper<MBC3>(MBC::MBC3, false);
+			break;
+		case 0x0F:
+		case 0x10:
+		case 0x13:
+			SetMapper<MBC3>(MBC::MBC3, true);
 			break;
 		case 0x19:
 		case 0x1A:
 		case 0x1C:
 		case 0x1D:
-			activeMBC = MBC::MBC5;
+			SetMapper<MBC5>(MBC::MBC5, false);
 			break;
 		case 0x1B:
 		case 0x1E:
-			canSave = true;
-			activeMBC = MBC::MBC5;
+			SetMapper<MBC5>(MBC::MBC5, true);
 			break;
 		default:
 			std::cerr << "Unknown MBC: " << std::hex << std::setw(2) << (uint32_t)mbcMode << "\n";
 			return false;
 		}
 		
-		const char* titleBegin = (char*)cartridgeData.data() + 0x134;
+		const char* titleBegin = (char*)memory->cartridgeData + 0x134;
 		size_t titleLen = 15;
 		for (size_t i = 0; i < 15; i++)
 		{
@@ -119,41 +453,67 @@ namespace mem
 				break;
 			}
 		}
-		gameName = std::string(titleBegin, titleLen);
-		for (size_t i = 0; i < gameName.size(); i++)
-		{
-			if (i != 0 && gameName[i - 1] != ' ')
-				gameName[i] = std::tolower(gameName[i]);
-		}
-		
-		
-		bankMode = BankMode::ROM;
-		currentRomBank = 1;
-		UpdateCurrentRomBank();
-		
-		cgbMode = cartridgeData[0x143] == 0x80 || cartridgeData[0x143] == 0xC0;
-		extRamBankStart = extRam;
-		vramBankStart = vram[0];
-		wramBankStart = wram + 4 * 1024;
-		
-		memset(ioReg, 0, sizeof(ioReg));
-		ioReg[IOREG_NR10] = audioReg.NR10;
-		ioReg[IOREG_NR11] = audioReg.NR11;
-		ioReg[IOREG_NR12] = audioReg.NR12;
-		ioReg[IOREG_NR14] = audioReg.NR14;
-		ioReg[IOREG_NR21] = audioReg.NR21;
-		ioReg[IOREG_NR24] = audioReg.NR24;
-		ioReg[IOREG_NR30] = audioReg.NR30;
-		ioReg[IOREG_NR31] = audioReg.NR31;
-		ioReg[IOREG_NR32] = audioReg.NR32;
-		ioReg[IOREG_NR33] = audioReg.NR33;
-		ioReg[IOREG_NR41] = audioReg.NR41;
-		ioReg[IOREG_NR44] = audioReg.NR44;
-		ioReg[IOREG_NR50] = audioReg.NR50;
-		ioReg[IOREG_NR51] = audioReg.NR51;
-		ioReg[IOREG_NR52] = audioReg.NR52;
-		ioReg[IOREG_LCDC] = 0x91;
-		ioReg[IOREG_BGP]  = 0xFC;
+		memory->gameName = std::string(titleBegin, titleLen);
+		for (size_t i = 0; i < memory->gameName.size(); i++)
+		{
+			if (i != 0 && memory->gameName[i - 1] != ' ')
+				memory->gameName[i] = std::tolower(memory->gameName[i]);
+		}
+		
+		
+		decode::Clear();
+		jit::Clear();
+		idle::Clear();
+		
+		//VRAM writes are logged for the renderer, everything from OAM and up goes through the slow path
+		memory->dmaMin = -1;
+		std::fill(std::begin(memory->readPages), std::end(memory->readPages), nullptr);
+		std::fill(std::begin(memory->writePages), std::end(memory->writePages), nullptr);
+		MapPages(0x0000, ROM_BANK_SIZE, memory->cartridgeData, false);
+		MapPages(0xC000, 4 * 1024, memory->wram, true);
+		MapPages(0xE000, 0x1E00, memory->wram, true);
+		
+		memory->bankMode = BankMode::ROM;
+		memory->currentRomBank = 1;
+		SetRomBank(memory->currentRomBank);
+		
+		memory->rtc = { };
+		memory->rtcSyncCycle = emulator->cycleCounter;
+		memory->rtcSelected = -1;
+		memory->rtcLastLatchWrite = 0xFF;
+		
+		memory->extRam = std::vector<uint8_t>(CartridgeRamSize(memory->cartridgeData[0x149]));
+		memory->extRamBankSize = std::min<size_t>(memory->extRam.size(), 8 * 1024);
+		memory->extRamBankStart = nullptr;
+		memory->ramPagesDirty.assign((memory->extRam.size() + 255) / 256, false);
+		memory->anyRamPageDirty = false;
+		SetRamBank(0);
+		
+		memory->cgbMode = memory->cartridgeData[0x143] == 0x80 || memory->cartridgeData[0x143] == 0xC0;
+		memory->vramBankStart = memory->vram[0];
+		MapPages(0x8000, 8 * 1024, memory->vramBankStart, false);
+		SetWramBank(memory->wram + 4 * 1024);
+		
+		memset(memory->ioReg, 0, sizeof(memory->ioReg));
+		memory->ioReg[IOREG_NR10] = apu->reg.NR10;
+		memory->ioReg[IOREG_NR11] = apu->reg.NR11;
+		memory->ioReg[IOREG_NR12] = apu->reg.NR12;
+		memory->ioReg[IOREG_NR14] = apu->reg.NR14;
+		memory->ioReg[IOREG_NR21] = apu->reg.NR21;
+		memory->ioReg[IOREG_NR24] = apu->reg.NR24;
+		memory->ioReg[IOREG_NR30] = apu->reg.NR30;
+		memory->ioReg[IOREG_NR31] = apu->reg.NR31;
+		memory->ioReg[IOREG_NR32] = apu->reg.NR32;
+		memory->ioReg[IOREG_NR33] = apu->reg.NR33;
+		memory->ioReg[IOREG_NR41] = apu->reg.NR41;
+		memory->ioReg[IOREG_NR44] = apu->reg.NR44;
+		memory->ioReg[IOREG_NR50] = apu->reg.NR50;
+		memory->ioReg[IOREG_NR51] = apu->reg.NR51;
+		memory->ioReg[IOREG_NR52] = apu->reg.NR52;
+		memory->ioReg[IOREG_LCDC] = 0x91;
+		memory->ioReg[IOREG_BGP]  = 0xFC;
+		memory->ioReg[IOREG_HDMA5] = 0xFF;
+		memory->hdmaBlocksLeft = 0;
 		
 		return true;
 	}
@@ -163,32 +523,77 @@ namespace mem
 		switch (address)
 		{
 		case 0x0000 ... 0x3FFF:
-			return &cartridgeData[address - 0x0000];
+			return &memory->cartridgeData[address - 0x0000];
 		case 0x4000 ... 0x7FFF:
-			return &romBankStart[address - 0x4000];
+			return &memory->romBankStart[address - 0x4000];
 		case 0x8000 ... 0x9FFF:
-			return &vramBankStart[address - 0x8000];
+			return &memory->vramBankStart[address - 0x8000];
 		case 0xA000 ... 0xBFFF:
-			return &extRamBankStart[address - 0xA000];
+			return memory->extRamBankStart ? &memory->extRamBankStart[(address - 0xA000) % memory->extRamBankSize] : nullptr;
 		case 0xC000 ... 0xCFFF:
-			return &wram[address - 0xC000];
+			return &memory->wram[address - 0xC000];
 		case 0xD000 ... 0xDFFF:
-			return &wramBankStart[address - 0xD000];
+			return &memory->wramBankStart[address - 0xD000];
 		case 0xE000 ... 0xFDFF:
-			return &wram[address - 0xE000];
+			return &memory->wram[address - 0xE000];
 		case 0xFE00 ... 0xFE9F:
-			return &oam[address - 0xFE00];
+			return &memory->oam[address - 0xFE00];
 		case 0xFF80 ... 0xFFFE:
-			return &hram[address - 0xFF80];
+			return &memory->hram[address - 0xFF80];
 		case 0xFF00 ... 0xFF7F:
-			return &ioReg[address - 0xFF00];
+			return &memory->ioReg[address - 0xFF00];
 		default:
 			return nullptr;
 		}
 	}
 	
-	uint8_t Read(uint16_t address)
+	uint8_t* GetHostPointer(uint16_t address)
+	{
+		return ResolveAddress(address);
+	}
+	
+	int DMACyclesLeft()
+	{
+		if (memory->dmaMin == -1)
+			return 0;
+		return (int)std::max<int64_t>(memory->dmaStartCycle + DMA_CYCLES - emulator->cycleCounter, 1);
+	}
+	
+	void UpdateDMA()
+	{
+		if (memory->dmaMin == -1)
+			return;
+		
+		//Copies everything transferred by now in one go. Unless the CPU writes memory or reads OAM
+		//before the transfer is done, this is a single copy of the whole source.
+		const uint32_t progress = (uint32_t)std::min(emulator->cycleCounter - memory->dmaStartCycle, DMA_CYCLES);
+		if (progress > memory->dmaBytesCopied)
+		{
+			//Sources above WRAM read the WRAM below them like echo RAM does
+			const uint16_t sourceAddress = (memory->dmaMin < 0xFE00 ? memory->dmaMin : memory->dmaMin - 0x2000) + memory->dmaBytesCopied;
+			const uint32_t count = progress - memory->dmaBytesCopied;
+			if (memory->rtcSelected != -1 && sourceAddress >= 0xA000 && sourceAddress <= 0xBFFF)
+				memset(memory->oam + memory->dmaBytesCopied, memory->rtc.latched[memory->rtcSelected], count);
+			else if (const uint8_t* source = ResolveAddress(sourceAddress))
+				memcpy(memory->oam + memory->dmaBytesCopied, source, count);
+			else
+				memset(memory->oam + memory->dmaBytesCopied, 0xFF, count); //Missing cartridge RAM reads as open bus
+			gpu::LogMemoryWrites(gpu::VideoMemory::OAM, memory->dmaBytesCopied, memory->oam + memory->dmaBytesCopied, progress - memory->dmaBytesCopied);
+			memory->dmaBytesCopied = progress;
+		}
+		
+		if (progress == DMA_CYCLES)
+		{
+			memory->dmaMin = -1;
+			MapAllPages();
+		}
+	}
+	
+	uint8_t ReadSlow(uint16_t address)
 	{
+		if (memory->dmaMin != -1 && address >= 0xFE00 && address <= 0xFE9F)
+			UpdateDMA();
+		
 		if (address >= 0xFF00 && address <= 0xFF7F)
 		{
 			uint32_t reg = address - 0xFF00;
@@ -196,7 +601,7 @@ namespace mem
 			{
 			case IOREG_JOYP:
 			{
-				uint8_t val = ioReg[IOREG_JOYP] & 0x30;
+				uint8_t val = memory->ioReg[IOREG_JOYP] & 0x30;
 				if (val & (1 << 5))
 					val |= GetButtonMask() & 0xF;
 				else if (val & (1 << 4))
@@ -205,155 +610,235 @@ namespace mem
 			}
 			
 			case IOREG_KEY1:
-				return ioReg[IOREG_KEY1] | (cpu.doubleSpeed << 7);
+				return memory->ioReg[IOREG_KEY1] | (cpu->doubleSpeed << 7);
+			
+			case IOREG_DIV:
+			case IOREG_TIMA:
+				SyncTimer();
+				return memory->ioReg[reg];
 			
 			case IOREG_LY:
-			{
-				std::lock_guard<std::mutex> lock(gpu::regMutex);
-				return gpu::reg.ly;
-			}
+				return gpu::ppu->reg.ly;
 			
 			case IOREG_STAT:
 				return gpu::GetRegisterSTAT();
 			
 			case IOREG_BGPD:
-				return backPaletteMemory[ioReg[IOREG_BGPI] & 0x3F];
+				return memory->backPaletteMemory[memory->ioReg[IOREG_BGPI] & 0x3F];
 			case IOREG_OBPD:
-				return spritePaletteMemory[ioReg[IOREG_OBPI] & 0x3F];
+				return memory->spritePaletteMemory[memory->ioReg[IOREG_OBPI] & 0x3F];
 				
 			case 0x30 ... 0x3F:
-				return audioReg.waveMem[reg - 0x30];
+				return apu->reg.waveMem[reg - 0x30];
 				
-			case IOREG_NR10: return audioReg.NR10 | 0x80;
-			case IOREG_NR11: return audioReg.NR11 | 0x3F;
-			case IOREG_NR12: return audioReg.NR12;
-			case IOREG_NR14: return audioReg.NR14 | 0xBF;
-			case IOREG_NR21: return audioReg.NR21 | 0x3F;
-			case IOREG_NR22: return audioReg.NR22;
-			case IOREG_NR24: return audioReg.NR24 | 0xBF;
-			case IOREG_NR30: return audioReg.NR30 | 0x7F;
-			case IOREG_NR32: return audioReg.NR32 | 0x9F;
-			case IOREG_NR34: return audioReg.NR34 | 0xBF;
-			case IOREG_NR42: return audioReg.NR42;
-			case IOREG_NR43: return audioReg.NR43;
-			case IOREG_NR44: return audioReg.NR44 | 0xBF;
-			case IOREG_NR50: return audioReg.NR50;
-			case IOREG_NR51: return audioReg.NR51;
-			case IOREG_NR52: return audioReg.NR52 | 0x70;
+			case IOREG_NR10: return apu->reg.NR10 | 0x80;
+			case IOREG_NR11: return apu->reg.NR11 | 0x3F;
+			case IOREG_NR12: return apu->reg.NR12;
+			case IOREG_NR14: return apu->reg.NR14 | 0xBF;
+			case IOREG_NR21: return apu->reg.NR21 | 0x3F;
+			case IOREG_NR22: return apu->reg.NR22;
+			case IOREG_NR24: return apu->reg.NR24 | 0xBF;
+			case IOREG_NR30: return apu->reg.NR30 | 0x7F;
+			case IOREG_NR32: return apu->reg.NR32 | 0x9F;
+			case IOREG_NR34: return apu->reg.NR34 | 0xBF;
+			case IOREG_NR42: return apu->reg.NR42;
+			case IOREG_NR43: return apu->reg.NR43;
+			case IOREG_NR44: return apu->reg.NR44 | 0xBF;
+			case IOREG_NR50: return apu->reg.NR50;
+			case IOREG_NR51: return apu->reg.NR51;
+			case IOREG_NR52:
+				SyncAudio();
+				return apu->reg.NR52 | 0x70;
 				
 			default:
-				return ioReg[reg];
+				return memory->ioReg[reg];
 			}
 		}
 		else if (address == 0xFFFF)
 		{
-			return cpu.intEnableReg;
+			return cpu->intEnableReg;
+		}
+		else if (memory->rtcSelected != -1 && address >= 0xA000 && address <= 0xBFFF)
+		{
+			return memory->rtc.latched[memory->rtcSelected];
 		}
 		else if (uint8_t* ptr = ResolveAddress(address))
 		{
 			return *ptr;
 		}
+		else if (address >= 0xA000 && address <= 0xBFFF)
+		{
+			return 0xFF;
+		}
 		return 0;
 	}
 	
-	static int dmaMin = -1;
-	static int dmaProgress = 0;
+	//Each block halts the CPU for 8 M-cycles in normal speed mode, the same time takes twice the cycles in double speed
+	static uint32_t HDMABlockCycles()
+	{
+		return 32 << cpu->doubleSpeed;
+	}
+	
+	//Copies bytes from the HDMA source to VRAM in runs that don't cross a source page
+	static void CopyHDMA(uint32_t bytes)
+	{
+		while (bytes > 0)
+		{
+			const uint32_t run = std::min<uint32_t>({ bytes, 0x100U - (memory->hdmaSource & 0xFF), 0x2000U - memory->hdmaDest });
+			uint8_t* dst = memory->vramBankStart + memory->hdmaDest;
+			if (const uint8_t* page = memory->readPages[memory->hdmaSource >> 8])
+			{
+				memcpy(dst, page + (memory->hdmaSource & 0xFF), run);
+			}
+			else
+			{
+				for (uint32_t i = 0; i < run; i++)
+					dst[i] = ReadSlow(memory->hdmaSource + i);
+			}
+			gpu::LogMemoryWrites(gpu::VideoMemory::VRAM, (uint16_t)(dst - memory->vram[0]), dst, run);
+			
+			memory->hdmaSource += run;
+			memory->hdmaDest = (memory->hdmaDest + run) & 0x1FFF;
+			bytes -= run;
+		}
+	}
+	
+	static void WriteHDMA5(uint8_t val)
+	{
+		//Clearing bit 7 while an H-blank transfer is running stops it
+		if (memory->hdmaBlocksLeft > 0 && !(val & 0x80))
+		{
+			memory->ioReg[IOREG_HDMA5] = 0x80 | (memory->hdmaBlocksLeft - 1);
+			memory->hdmaBlocksLeft = 0;
+			return;
+		}
+		
+		memory->hdmaSource = ((memory->ioReg[IOREG_HDMA1] << 8) | memory->ioReg[IOREG_HDMA2]) & 0xFFF0;
+		memory->hdmaDest = ((memory->ioReg[IOREG_HDMA3] << 8) | memory->ioReg[IOREG_HDMA4]) & 0x1FF0;
+		memory->hdmaBlocksLeft = (val & 0x7F) + 1;
+		
+		if (val & 0x80)
+		{
+			memory->ioReg[IOREG_HDMA5] = val & 0x7F;
+			return;
+		}
+		
+		//General purpose DMA, the whole transfer happens while the CPU is halted
+		StallCPU(memory->hdmaBlocksLeft * HDMABlockCycles());
+		CopyHDMA(memory->hdmaBlocksLeft * 16);
+		memory->hdmaBlocksLeft = 0;
+		memory->ioReg[IOREG_HDMA5] = 0xFF;
+	}
+	
+	void RunHBlankDMA(uint32_t hblanks)
+	{
+		if (memory->hdmaBlocksLeft == 0)
+			return;
+		
+		const uint32_t blocks = std::min(hblanks, memory->hdmaBlocksLeft);
+		StallCPU(blocks * HDMABlockCycles());
+		CopyHDMA(blocks * 16);
+		memory->hdmaBlocksLeft -= blocks;
+		memory->ioReg[IOREG_HDMA5] = memory->hdmaBlocksLeft == 0 ? 0xFF : memory->hdmaBlocksLeft - 1;
+	}
 	
 	void Write(uint16_t address, uint8_t val)
 	{
-		if (!(ioReg[IOREG_NR52] & (1 << 7)) && (address >= (0xFF00 | IOREG_NR10)) && (address < (0xFF00 | IOREG_NR52)))
+		if (uint8_t* page = memory->writePages[address >> 8])
+		{
+			page[address & 0xFF] = val;
+			decode::InvalidateRAM(&page[address & 0xFF]);
+			return;
+		}
+		
+		//Anything but HRAM could change the source of a running OAM DMA transfer or its mapping
+		if (memory->dmaMin != -1 && address < 0xFF80)
+			UpdateDMA();
+		
+		if (address >= (0xFF00 | IOREG_NR10) && address <= 0xFF3F)
+			SyncAudio();
+		
+		if (!(memory->ioReg[IOREG_NR52] & (1 << 7)) && (address >= (0xFF00 | IOREG_NR10)) && (address < (0xFF00 | IOREG_NR52)))
 			return;
 		
+		//Writes to the MBC, I/O registers and IE may switch banks or raise interrupts
+		if (address < 0x8000 || (address >= 0xFF00 && (address < 0xFF80 || address == 0xFFFF)))
+			jit::compiler->exitRequested = true;
+		
 		switch (address)
 		{
-		case 0x0000 ... 0x1FFF:
-			break;
-			
-		case 0x2000 ... 0x2FFF:
-			if (activeMBC == MBC::MBC1 || activeMBC == MBC::MBC2)
-				currentRomBank = (currentRomBank & ~0x1FU) | (val & 0x1FU);
-			else if (activeMBC == MBC::MBC5)
-				currentRomBank = (currentRomBank & ~0xFFU) | val;
-			UpdateCurrentRomBank();
-			break;
-		
-		case 0x3000 ... 0x3FFF:
-			if (activeMBC == MBC::MBC1 || activeMBC == MBC::MBC2)
-				currentRomBank = (currentRomBank & ~0x1FU) | (val & 0x1FU);
-			else if (activeMBC == MBC::MBC5)
-				currentRomBank = (currentRomBank & ~(uint32_t)(1 << 8)) | (((uint32_t)val & 1) << 8);
-			UpdateCurrentRomBank();
+		case 0x0000 ... 0x7FFF:
+			memory->writeMBC(address, val);
 			break;
-		
-		case 0x4000 ... 0x5FFF:
-			if (activeMBC == MBC::MBC5 || bankMode == BankMode::RAM)
+		case 0xA000 ... 0xBFFF:
+			if (memory->rtcSelected != -1)
 			{
-				extRamBankStart = extRam + (1024 * 8) * (size_t)std::max((int)val, 1);
+				WriteRTC(val);
 			}
-			else if (bankMode == BankMode::ROM)
+			else if (uint8_t* ptr = ResolveAddress(address))
 			{
-				currentRomBank = (currentRomBank & ~(0b11U << 5)) | ((val & 0b11) << 5);
-				UpdateCurrentRomBank();
+				*ptr = memory->activeMBC == MBC::MBC2 ? (val | 0xF0) : val;
+				decode::InvalidateRAM(ptr);
+				MarkRamDirty(ptr);
 			}
 			break;
-		
-		case 0x6000 ... 0x7FFF:
-			bankMode = (BankMode)val;
-			break;
 			
 		case 0x8000 ... 0x9FFF:
-		{
-			std::lock_guard<std::mutex> lock(vramMutex);
-			vramBankStart[address - 0x8000] = val;
+			memory->vramBankStart[address - 0x8000] = val;
+			gpu::LogMemoryWrite(gpu::VideoMemory::VRAM, (uint16_t)(memory->vramBankStart - memory->vram[0] + address - 0x8000), val);
 			break;
-		}
 		case 0xFE00 ... 0xFE9F:
-		{
-			std::lock_guard<std::mutex> lock(oamMutex);
-			oam[address - 0xFE00] = val;
+			memory->oam[address - 0xFE00] = val;
+			gpu::LogMemoryWrite(gpu::VideoMemory::OAM, address - 0xFE00, val);
 			break;
-		}
 		
 		case 0xFF00 | IOREG_DIV:
-			ioReg[IOREG_DIV] = 0; //Writing any value to this should reset it to 0
+		case 0xFF00 | IOREG_TIMA:
+		case 0xFF00 | IOREG_TMA:
+		case 0xFF00 | IOREG_TAC:
+			WriteTimerRegister(address & 0xFF, val);
 			break;
 		case 0xFF00 | IOREG_VBK:
-			vramBankStart = vram[val];
-			ioReg[IOREG_VBK] = val;
+			memory->vramBankStart = memory->vram[val & 1];
+			MapPages(0x8000, 8 * 1024, memory->vramBankStart, false);
+			memory->ioReg[IOREG_VBK] = val & 1;
 			break;
 		case 0xFF00 | IOREG_SVBK:
-			wramBankStart = wram + (4 * 1024) * std::max(val & 7, 1);
-			ioReg[IOREG_SVBK] = val & 7;
+			SetWramBank(memory->wram + (4 * 1024) * std::max(val & 7, 1));
+			memory->ioReg[IOREG_SVBK] = val & 7;
 			break;
 		case 0xFF00 | IOREG_DMA:
-			dmaMin = (uint16_t)val * 0x100U;
-			dmaProgress = 0;
+			memory->dmaMin = (uint16_t)val * 0x100U;
+			memory->dmaStartCycle = emulator->cycleCounter;
+			memory->dmaBytesCopied = 0;
+			std::fill(std::begin(memory->writePages), std::end(memory->writePages), nullptr);
+			ScheduleEvent(Event::DMA, memory->dmaStartCycle + DMA_CYCLES);
 			break;
 			
 		case 0xFF00 | IOREG_KEY1:
-			ioReg[IOREG_KEY1] = val & 1;
+			memory->ioReg[IOREG_KEY1] = val & 1;
 			break;
 			
 		case 0xFF00 | IOREG_BGPD:
 		{
-			uint32_t bgpi = ioReg[IOREG_BGPI];
+			uint32_t bgpi = memory->ioReg[IOREG_BGPI];
 			uint32_t idx = bgpi & 0x3F;
 			if (bgpi & 0x80)
-				ioReg[IOREG_BGPI] = ((idx + 1) & 0x3F) | 0x80;
+				memory->ioReg[IOREG_BGPI] = ((idx + 1) & 0x3F) | 0x80;
 			
-			std::lock_guard<std::mutex> lock(vramMutex);
-			backPaletteMemory[idx] = val;
+			memory->backPaletteMemory[idx] = val;
+			gpu::LogMemoryWrite(gpu::VideoMemory::BackPalette, idx, val);
 			break;
 		}
 		case 0xFF00 | IOREG_OBPD:
 		{
-			uint32_t obpi = ioReg[IOREG_OBPI];
+			uint32_t obpi = memory->ioReg[IOREG_OBPI];
 			uint32_t idx = obpi & 0x3F;
 			if (obpi & 0x80)
-				ioReg[IOREG_OBPI] = ((idx + 1) & 0x3F) | 0x80;
+				memory->ioReg[IOREG_OBPI] = ((idx + 1) & 0x3F) | 0x80;
 			
-			std::lock_guard<std::mutex> lock(vramMutex);
-			spritePaletteMemory[idx] = val;
+			memory->spritePaletteMemory[idx] = val;
+			gpu::LogMemoryWrite(gpu::VideoMemory::SpritePalette, idx, val);
 			break;
 		}
 		
@@ -361,13 +846,16 @@ namespace mem
 		case 0xFF00 | IOREG_HDMA2:
 		case 0xFF00 | IOREG_HDMA3:
 		case 0xFF00 | IOREG_HDMA4:
+			memory->ioReg[address & 0xFF] = val;
+			break;
 		case 0xFF00 | IOREG_HDMA5:
-			std::abort();
+			if (memory->cgbMode)
+				WriteHDMA5(val);
+			break;
 		
 		#define DEF_WRITE_GPU_REGISTER(name, field) \
-		case 0xFF00 | name: { ioReg[name] = val; std::lock_guard<std::mutex> lock(gpu::regMutex); gpu::reg.field = val; break; }
+		case 0xFF00 | name: { memory->ioReg[name] = val; gpu::ppu->reg.field = val; break; }
 		DEF_WRITE_GPU_REGISTER(IOREG_LYC, lyc)
-		DEF_WRITE_GPU_REGISTER(IOREG_LCDC, lcdc)
 		DEF_WRITE_GPU_REGISTER(IOREG_STAT, stat)
 		DEF_WRITE_GPU_REGISTER(IOREG_SCX, scx)
 		DEF_WRITE_GPU_REGISTER(IOREG_SCY, scy)
@@ -376,55 +864,60 @@ namespace mem
 		DEF_WRITE_GPU_REGISTER(IOREG_BGP, bgp)
 		DEF_WRITE_GPU_REGISTER(IOREG_OBP0, obp0)
 		DEF_WRITE_GPU_REGISTER(IOREG_OBP1, obp1)
+		case 0xFF00 | IOREG_LCDC:
+			memory->ioReg[IOREG_LCDC] = val;
+			gpu::WriteLCDC(val);
+			break;
 		
-		case 0xFF00 | IOREG_NR10: audioReg.NR10 = val; break;
+		case 0xFF00 | IOREG_NR10: apu->reg.NR10 = val; break;
 		case 0xFF00 | IOREG_NR11:
-			audioReg.NR11 = val;
+			apu->reg.NR11 = val;
 			SetAudioChannelLen(1, val & 0x3F);
 			break;
-		case 0xFF00 | IOREG_NR12: audioReg.NR12 = val; break;
-		case 0xFF00 | IOREG_NR13: audioReg.NR13 = val; break;
-		case 0xFF00 | IOREG_NR14: audioReg.NR14 = val; break;
+		case 0xFF00 | IOREG_NR12: apu->reg.NR12 = val; break;
+		case 0xFF00 | IOREG_NR13: apu->reg.NR13 = val; break;
+		case 0xFF00 | IOREG_NR14: apu->reg.NR14 = val; break;
 		case 0xFF00 | IOREG_NR21:
-			audioReg.NR21 = val;
+			apu->reg.NR21 = val;
 			SetAudioChannelLen(2, val & 0x3F);
 			break;
-		case 0xFF00 | IOREG_NR22: audioReg.NR22 = val; break;
-		case 0xFF00 | IOREG_NR23: audioReg.NR23 = val; break;
-		case 0xFF00 | IOREG_NR24: audioReg.NR24 = val; break;
-		case 0xFF00 | IOREG_NR30: audioReg.NR30 = val; break;
+		case 0xFF00 | IOREG_NR22: apu->reg.NR22 = val; break;
+		case 0xFF00 | IOREG_NR23: apu->reg.NR23 = val; break;
+		case 0xFF00 | IOREG_NR24: apu->reg.NR24 = val; break;
+		case 0xFF00 | IOREG_NR30: apu->reg.NR30 = val; break;
 		case 0xFF00 | IOREG_NR31:
-			audioReg.NR31 = val;
+			apu->reg.NR31 = val;
 			SetAudioChannelLen(3, val);
 			break;
-		case 0xFF00 | IOREG_NR32: audioReg.NR32 = val; break;
-		case 0xFF00 | IOREG_NR33: audioReg.NR33 = val; break;
-		case 0xFF00 | IOREG_NR34: audioReg.NR34 = val; break;
+		case 0xFF00 | IOREG_NR32: apu->reg.NR32 = val; break;
+		case 0xFF00 | IOREG_NR33: apu->reg.NR33 = val; break;
+		case 0xFF00 | IOREG_NR34: apu->reg.NR34 = val; break;
 		case 0xFF00 | IOREG_NR41:
-			audioReg.NR41 = val;
+			apu->reg.NR41 = val;
 			SetAudioChannelLen(4, val & 0x3F);
 			break;
-		case 0xFF00 | IOREG_NR42: audioReg.NR42 = val; break;
-		case 0xFF00 | IOREG_NR43: audioReg.NR43 = val; break;
-		case 0xFF00 | IOREG_NR44: audioReg.NR44 = val; break;
-		case 0xFF00 | IOREG_NR50: audioReg.NR50 = val; break;
-		case 0xFF00 | IOREG_NR51: audioReg.NR51 = val; break;
+		case 0xFF00 | IOREG_NR42: apu->reg.NR42 = val; break;
+		case 0xFF00 | IOREG_NR43: apu->reg.NR43 = val; break;
+		case 0xFF00 | IOREG_NR44: apu->reg.NR44 = val; break;
+		case 0xFF00 | IOREG_NR50: apu->reg.NR50 = val; break;
+		case 0xFF00 | IOREG_NR51: apu->reg.NR51 = val; break;
 		
 		case 0xFF00 | IOREG_NR52:
-			audioReg.NR52 = (audioReg.NR52 & 0x7F) | (val & 0x80);
+			apu->reg.NR52 = (apu->reg.NR52 & 0x7F) | (val & 0x80);
 			break;
 		
-		case 0xFF30 ... 0xFF3F: audioReg.waveMem[address - 0xFF30] = val; break;
+		case 0xFF30 ... 0xFF3F: apu->reg.waveMem[address - 0xFF30] = val; break;
 		
 		case 0xFF00 | IOREG_LY: break;
 			
 		case 0xFFFF:
-			cpu.intEnableReg = val;
+			cpu->intEnableReg = val;
 			break;
 		default:
 			if (uint8_t* ptr = ResolveAddress(address))
 			{
 				*ptr = val;
+				decode::InvalidateRAM(ptr);
 			}
 			else if (!(address >= 0xFEA0 && address <= 0xFEFF))
 			{
@@ -435,33 +928,11 @@ namespace mem
 		}
 	}
 	
-	void UpdateDMA(int cycles)
-	{
-		if (dmaMin == -1)
-			return;
-		
-		std::lock_guard<std::mutex> lock(oamMutex);
-		
-		cycles = std::min<int>(cycles, (int)sizeof(oam) - (int)dmaProgress);
-		
-		while (cycles > 0)
-		{
-			oam[dmaProgress] = *ResolveAddress(dmaMin + dmaProgress);
-			dmaProgress++;
-			cycles--;
-		}
-		
-		if (dmaProgress == sizeof(oam))
-		{
-			dmaMin = -1;
-		}
-	}
-	
 	static constexpr char MAGIC[] = { (char)0xFF, 'E', 'G', 'B' };
 	
 	void LoadRAM(const std::string& path)
 	{
-		if (!canSave)
+		if (!memory->canSave)
 			return;
 		
 		std::ifstream stream(path, std::ios::binary);
@@ -476,9 +947,13 @@ namespace mem
 			return;
 		}
 		
+		//Saves for cartridges with a clock store it before the RAM
+		if (memory->activeMBC == MBC::MBC3)
+			stream.read(reinterpret_cast<char*>(&memory->rtc), sizeof(memory->rtc));
+		
 		z_stream inflateStream = { };
-		inflateStream.avail_out = sizeof(extRam);
-		inflateStream.next_out = extRam;
+		inflateStream.avail_out = memory->extRam.size();
+		inflateStream.next_out = memory->extRam.data();
 		if (inflateInit(&inflateStream) != Z_OK)
 		{
 			std::cerr << "Error initializing ZLIB" << std::endl;
@@ -488,7 +963,7 @@ namespace mem
 		int status = 0;
 		std::array<char, 1024> buffer;
 		
-		while (!stream.eof() && status != Z_STREAM_END)
+		while (!stream.eof() && status != Z_STREAM_END && inflateStream.avail_out != 0)
 		{
 			stream.read(buffer.data(), buffer.size());
 			
@@ -501,7 +976,7 @@ namespace mem
 			if (status == Z_MEM_ERROR || status == Z_DATA_ERROR || status == Z_NEED_DICT)
 			{
 				std::cerr << "ZLIB Error " << status << std::endl;
-				std::memset(extRam, 0, sizeof(extRam));
+				std::fill(memory->extRam.begin(), memory->extRam.end(), 0);
 				return;
 			}
 		}
@@ -509,36 +984,248 @@ namespace mem
 		inflateEnd(&inflateStream);
 	}
 	
-	void SaveRAM(const std::string& path)
+	//The title, licensee, type and checksum fields identify the cartridge a state was saved with
+	static constexpr size_t STATE_HEADER_BEGIN = 0x134;
+	static constexpr size_t STATE_HEADER_END = 0x150;
+	
+	void SaveState(state::Writer& writer)
 	{
-		if (!canSave)
-			return;
+		writer.WriteBytes(memory->cartridgeData + STATE_HEADER_BEGIN, STATE_HEADER_END - STATE_HEADER_BEGIN);
+		
+		writer.Write(memory->ioReg);
+		writer.Write(memory->vram);
+		writer.Write(memory->wram);
+		writer.Write(memory->oam);
+		writer.Write(memory->hram);
+		writer.Write(memory->backPaletteMemory);
+		writer.Write(memory->spritePaletteMemory);
+		writer.WriteBytes(memory->extRam.data(), memory->extRam.size());
+		
+		writer.Write(ActiveRomBank());
+		writer.Write(memory->currentRomBank);
+		writer.Write(memory->bankMode);
+		writer.Write(memory->rtcSelected);
+		writer.Write(memory->extRamBankStart ? (int64_t)(memory->extRamBankStart - memory->extRam.data()) : (int64_t)-1);
+		writer.Write((uint8_t)(memory->vramBankStart == memory->vram[1]));
+		writer.Write((uint32_t)(memory->wramBankStart - memory->wram));
+		
+		writer.Write(memory->rtc);
+		writer.Write(memory->rtcSyncCycle);
+		writer.Write(memory->rtcLastLatchWrite);
+		
+		writer.Write(memory->hdmaSource);
+		writer.Write(memory->hdmaDest);
+		writer.Write(memory->hdmaBlocksLeft);
+		writer.Write(memory->dmaMin);
+		writer.Write(memory->dmaStartCycle);
+		writer.Write(memory->dmaBytesCopied);
+	}
+	
+	bool LoadState(state::Reader& reader)
+	{
+		const uint8_t* header = reader.ReadInPlace(STATE_HEADER_END - STATE_HEADER_BEGIN);
+		if (header == nullptr || !std::equal(header, header + STATE_HEADER_END - STATE_HEADER_BEGIN, memory->cartridgeData + STATE_HEADER_BEGIN))
+			return false;
+		
+		//The memory is only referenced here and the registers read into locals,
+		//so nothing is changed until the state is known to be valid
+		const uint8_t* loadedIoReg = reader.ReadInPlace(sizeof(memory->ioReg));
+		const uint8_t* loadedVram = reader.ReadInPlace(sizeof(memory->vram));
+		const uint8_t* loadedWram = reader.ReadInPlace(sizeof(memory->wram));
+		const uint8_t* loadedOam = reader.ReadInPlace(sizeof(memory->oam));
+		const uint8_t* loadedHram = reader.ReadInPlace(sizeof(memory->hram));
+		const uint8_t* loadedBackPalette = reader.ReadInPlace(sizeof(memory->backPaletteMemory));
+		const uint8_t* loadedSpritePalette = reader.ReadInPlace(sizeof(memory->spritePaletteMemory));
+		const uint8_t* loadedRam = reader.ReadInPlace(memory->extRam.size());
+		
+		uint32_t romBank = 1;
+		uint32_t loadedCurrentRomBank = 1;
+		BankMode loadedBankMode = memory->bankMode;
+		int loadedRtcSelected = -1;
+		int64_t extRamBankOffset = -1;
+		uint8_t vramBank = 0;
+		uint32_t wramBankOffset = 4 * 1024;
+		reader.Read(romBank);
+		reader.Read(loadedCurrentRomBank);
+		reader.Read(loadedBankMode);
+		reader.Read(loadedRtcSelected);
+		reader.Read(extRamBankOffset);
+		reader.Read(vramBank);
+		reader.Read(wramBankOffset);
+		
+		RTCState loadedRtc = memory->rtc;
+		uint64_t loadedRtcSyncCycle = 0;
+		uint8_t loadedRtcLastLatchWrite = 0;
+		reader.Read(loadedRtc);
+		reader.Read(loadedRtcSyncCycle);
+		reader.Read(loadedRtcLastLatchWrite);
+		
+		uint16_t loadedHdmaSource = 0;
+		uint16_t loadedHdmaDest = 0;
+		uint32_t loadedHdmaBlocksLeft = 0;
+		int loadedDmaMin = -1;
+		uint64_t loadedDmaStartCycle = 0;
+		uint32_t loadedDmaBytesCopied = 0;
+		reader.Read(loadedHdmaSource);
+		reader.Read(loadedHdmaDest);
+		reader.Read(loadedHdmaBlocksLeft);
+		reader.Read(loadedDmaMin);
+		reader.Read(loadedDmaStartCycle);
+		reader.Read(loadedDmaBytesCopied);
+		
+		//Out of range values would index past the RTC registers, or make the transfers copy past VRAM, OAM or the
+		//memory region they read from. DMA can read from any page that the DMA register selects.
+		const bool validRtc = loadedRtcSelected >= -1 && loadedRtcSelected <= RTC_DH;
+		const bool validHdma = (loadedHdmaSource & 0xF) == 0 && (loadedHdmaDest & ~0x1FF0) == 0 && loadedHdmaBlocksLeft <= 0x80;
+		const bool validDma = loadedDmaMin == -1 || (loadedDmaMin >= 0 && loadedDmaMin <= 0xFF00 && (loadedDmaMin & 0xFF) == 0);
+		if (reader.failed || !validRtc || !validHdma || !validDma || loadedDmaBytesCopied > DMA_CYCLES)
+			return false;
+		
+		std::memcpy(memory->ioReg, loadedIoReg, sizeof(memory->ioReg));
+		std::memcpy(memory->vram, loadedVram, sizeof(memory->vram));
+		std::memcpy(memory->wram, loadedWram, sizeof(memory->wram));
+		std::memcpy(memory->oam, loadedOam, sizeof(memory->oam));
+		std::memcpy(memory->hram, loadedHram, sizeof(memory->hram));
+		std::memcpy(memory->backPaletteMemory, loadedBackPalette, sizeof(memory->backPaletteMemory));
+		std::memcpy(memory->spritePaletteMemory, loadedSpritePalette, sizeof(memory->spritePaletteMemory));
+		
+		//Pages that differ from the loaded RAM are marked dirty so that the next save includes them
+		for (size_t page = 0; page < memory->ramPagesDirty.size(); page++)
+		{
+			const size_t begin = page * 256;
+			const size_t end = std::min(begin + 256, memory->extRam.size());
+			if (!std::equal(loadedRam + begin, loadedRam + end, memory->extRam.begin() + begin))
+			{
+				std::copy(loadedRam + begin, loadedRam + end, memory->extRam.begin() + begin);
+				memory->ramPagesDirty[page] = true;
+				memory->anyRamPageDirty = true;
+			}
+		}
+		
+		memory->currentRomBank = loadedCurrentRomBank;
+		memory->bankMode = loadedBankMode;
+		memory->rtcSelected = loadedRtcSelected;
+		memory->rtc = loadedRtc;
+		memory->rtcSyncCycle = loadedRtcSyncCycle;
+		memory->rtcLastLatchWrite = loadedRtcLastLatchWrite;
+		
+		memory->hdmaSource = loadedHdmaSource;
+		memory->hdmaDest = loadedHdmaDest;
+		memory->hdmaBlocksLeft = loadedHdmaBlocksLeft;
+		memory->dmaMin = loadedDmaMin;
+		memory->dmaStartCycle = loadedDmaStartCycle;
+		memory->dmaBytesCopied = loadedDmaBytesCopied;
+		
+		SetRomBank(romBank);
+		const bool validRamBank = extRamBankOffset >= 0 && (uint64_t)extRamBankOffset + memory->extRamBankSize <= memory->extRam.size();
+		memory->extRamBankStart = validRamBank ? memory->extRam.data() + extRamBankOffset : nullptr;
+		memory->vramBankStart = memory->vram[vramBank & 1];
+		memory->wramBankStart = memory->wram + std::min<uint32_t>(wramBankOffset, sizeof(memory->wram) - 4 * 1024);
+		MapAllPages();
+		
+		decode::ClearRAM();
+		gpu::ReloadVideoMemory();
+		return true;
+	}
+	
+	bool HasBattery()
+	{
+		return memory->canSave;
+	}
+	
+	bool UpdateSaveSnapshot(SaveSnapshot& snapshot)
+	{
+		const bool changed = memory->anyRamPageDirty;
+		if (snapshot.ram.size() != memory->extRam.size())
+		{
+			snapshot.ram = memory->extRam;
+		}
+		else if (memory->anyRamPageDirty)
+		{
+			for (size_t page = 0; page < memory->ramPagesDirty.size(); page++)
+			{
+				if (memory->ramPagesDirty[page])
+				{
+					const size_t end = std::min(page * 256 + 256, memory->extRam.size());
+					std::copy(memory->extRam.begin() + page * 256, memory->extRam.begin() + end, snapshot.ram.begin() + page * 256);
+				}
+			}
+		}
 		
+		if (memory->activeMBC == MBC::MBC3)
+		{
+			SyncRTC();
+			const uint8_t* rtcBytes = reinterpret_cast<const uint8_t*>(&memory->rtc);
+			snapshot.rtc.assign(rtcBytes, rtcBytes + sizeof(memory->rtc));
+		}
+		
+		if (changed)
+		{
+			std::fill(memory->ramPagesDirty.begin(), memory->ramPagesDirty.end(), false);
+			memory->anyRamPageDirty = false;
+			MapExtRam();
+		}
+		return changed;
+	}
+	
+	bool WriteSave(const std::string& path, const SaveSnapshot& snapshot)
+	{
 		z_stream deflateStream = { };
-		deflateStream.avail_in = sizeof(extRam);
-		deflateStream.next_in = extRam;
+		deflateStream.avail_in = snapshot.ram.size();
+		deflateStream.next_in = snapshot.ram.data();
 		if (deflateInit(&deflateStream, Z_DEFAULT_COMPRESSION) != Z_OK)
 		{
 			std::cerr << "Error initializing ZLIB\n";
-			return;
+			return false;
 		}
 		
-		std::ofstream stream(path, std::ios::binary);
+		//Writes a temporary file first, so that the previous save is kept if writing fails part way
+		const std::string tempPath = path + ".tmp";
+		std::ofstream stream(tempPath, std::ios::binary);
 		stream.write(MAGIC, sizeof(MAGIC));
+		stream.write(reinterpret_cast<const char*>(snapshot.rtc.data()), snapshot.rtc.size());
 		
-		while (deflateStream.avail_in > 0)
+		int status = Z_OK;
+		while (status != Z_STREAM_END)
 		{
 			std::array<char, 1024> outBuffer;
 			
 			deflateStream.avail_out = outBuffer.size();
 			deflateStream.next_out = reinterpret_cast<Bytef*>(outBuffer.data());
 			
-			int status = deflate(&deflateStream, Z_FINISH);
+			status = deflate(&deflateStream, Z_FINISH);
 			assert(status != Z_STREAM_ERROR);
 			
 			stream.write(outBuffer.data(), outBuffer.size() - deflateStream.avail_out);
 		}
 		
 		deflateEnd(&deflateStream);
+		
+		stream.close();
+		if (!stream)
+		{
+			std::cerr << "Error writing save file: " << tempPath << "\n";
+			return false;
+		}
+		
+#ifdef _WIN32
+		std::remove(path.c_str());
+#endif
+		if (std::rename(tempPath.c_str(), path.c_str()) != 0)
+		{
+			std::cerr << "Error replacing save file: " << path << "\n";
+			return false;
+		}
+		return true;
+	}
+	
+	void SaveRAM(const std::string& path)
+	{
+		if (!memory->canSave)
+			return;
+		
+		SaveSnapshot snapshot;
+		UpdateSaveSnapshot(snapshot);
+		WriteSave(path, snapshot);
 	}
 }
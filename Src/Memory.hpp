@@ -1,8 +1,17 @@
 #pragma once
 
 #include <cstdint>
+#include <cstddef>
 #include <istream>
+#include <vector>
 #include <mutex>
+#include <string>
+
+namespace state
+{
+	struct Writer;
+	struct Reader;
+}
 
 enum
 {
@@ -65,47 +74,177 @@ enum
 	IOREG_NR52 = 0x26,
 };
 
-extern uint8_t ioReg[128];
-
 namespace mem
 {
-	extern uint8_t* vramBankStart;
-	
-	extern uint8_t extRam[];
-	extern uint8_t vram[][8 * 1024];
-	extern uint8_t wram[];
-	extern uint8_t oam[160];
-	
-	extern uint8_t backPaletteMemory[64];
-	extern uint8_t spritePaletteMemory[64];
-	
-	extern std::mutex vramMutex;
-	extern std::mutex oamMutex;
-	
-	extern std::string gameName;
-	
 	enum class MBC
 	{
+		None,
 		MBC1,
 		MBC2,
+		MBC3,
 		MBC5
 	};
 	
-	extern MBC activeMBC;
+	enum class BankMode
+	{
+		ROM,
+		RAM
+	};
+	
+	//MBC3 real time clock. It counts emulated cycles rather than wall clock time, so it stops
+	//while the emulator isn't running and stays in step with the game when running faster or slower.
+	struct RTCState
+	{
+		uint8_t registers[5];
+		uint8_t latched[5];
+		uint32_t subsecondCycles;
+	};
+	
+	//The memory, cartridge and bank registers of a machine, only used on the CPU thread
+	struct Memory
+	{
+		uint8_t ioReg[128];
+		
+		//Set from the cartridge header by Init
+		bool cgbMode;
+		
+		//Points either into cartridgeBuffer or to a read only mapping of the ROM file.
+		//The size is always a whole number of ROM banks, and at least two.
+		uint8_t* cartridgeData;
+		size_t cartridgeSize;
+		std::vector<uint8_t> cartridgeBuffer;
+		void* cartridgeMapping;
+		
+		uint8_t* romBankStart;    //Start of switchable ROM bank at 0x4000
+		uint8_t* extRamBankStart; //Start of external RAM bank at 0xA000
+		uint8_t* vramBankStart;   //Start of VRAM bank at 0x8000
+		uint8_t* wramBankStart;   //Start of switchable WRAM bank at 0xD000
+		
+		std::vector<uint8_t> extRam;
+		size_t extRamBankSize; //Smaller than a bank for RAM that is mirrored across 0xA000-0xBFFF
+		
+		//One flag per 256 bytes of extRam, set on the first write since the last save snapshot.
+		//Clean pages aren't writable through writePages, so that first write takes the slow path.
+		std::vector<bool> ramPagesDirty;
+		bool anyRamPageDirty;
+		
+		uint8_t vram[2][8 * 1024];
+		uint8_t wram[32 * 1024];
+		uint8_t oam[160];
+		uint8_t hram[127];
+		
+		uint8_t backPaletteMemory[64];
+		uint8_t spritePaletteMemory[64];
+		
+		//HDMA transfers from hdmaSource to hdmaDest in the current VRAM bank, 16 byte blocks at a time.
+		//General purpose transfers finish as soon as they are started, so blocks are only left during an H-blank transfer.
+		uint16_t hdmaSource;
+		uint16_t hdmaDest;
+		uint32_t hdmaBlocksLeft;
+		
+		BankMode bankMode;
+		uint32_t currentRomBank;
+		int rtcSelected = -1; //MBC3 clock register mapped at 0xA000 instead of RAM, or -1
+		
+		MBC activeMBC;
+		bool canSave = false;
+		
+		//Handles writes to the MBC registers at 0x0000-0x7FFF, picked by Init
+		void (*writeMBC)(uint16_t address, uint8_t val);
+		
+		//Host memory for each 256 byte page of the address space. Pages that are null, like I/O and
+		//the MBC registers, need the side effects of the slow path. Updated on every bank switch.
+		uint8_t* readPages[256];
+		uint8_t* writePages[256];
+		
+		//Source of the running OAM DMA transfer, -1 if there is none
+		int dmaMin = -1;
+		uint64_t dmaStartCycle;
+		uint32_t dmaBytesCopied;
+		
+		RTCState rtc;
+		uint64_t rtcSyncCycle;
+		uint8_t rtcLastLatchWrite;
+		
+		std::string gameName;
+		
+		//Unmaps the ROM file
+		~Memory();
+	};
+	
+	//The memory of the machine bound to the calling thread, see Machine::Bind
+	extern thread_local Memory* memory;
 	
+	//Loads a cartridge and resets memory. Returns false if the ROM can't be read or isn't valid.
 	bool Init(std::istream& cartridgeStream);
 	
-	uint8_t Read(uint16_t address);
+	//Like Init(std::istream&), but maps the ROM file into memory instead of copying it where possible
+	bool Init(const char* romPath);
+	
+	uint8_t ReadSlow(uint16_t address);
+	
+	inline uint8_t Read(uint16_t address)
+	{
+		if (const uint8_t* page = memory->readPages[address >> 8])
+			return page[address & 0xFF];
+		return ReadSlow(address);
+	}
 	
 	void Write(uint16_t address, uint8_t val);
 	
-	void UpdateDMA(int cycles);
+	//Returns the host memory backing an address, or nullptr for I/O and unmapped addresses
+	uint8_t* GetHostPointer(uint16_t address);
+	
+	//Finishes the OAM DMA transfer once it has run for long enough
+	void UpdateDMA();
+	
+	//Copies one block of the running H-blank DMA transfer for each H-blank that has started
+	void RunHBlankDMA(uint32_t hblanks);
+	
+	//Cycles until the running OAM DMA transfer is done, 0 if there is none
+	int DMACyclesLeft();
+	
+	//Index of the ROM bank mapped at 0x4000
+	uint32_t ActiveRomBank();
+	
+	//Bytes of ROM held in host memory. RomIsShared is true if it is a mapping of the ROM file,
+	//whose pages are shared by every process running the same ROM.
+	size_t RomSize();
+	bool RomIsShared();
+	
+	//A copy of the battery backed state, which can be written to a save file on another thread
+	struct SaveSnapshot
+	{
+		std::vector<uint8_t> ram;
+		std::vector<uint8_t> rtc; //MBC3 clock state, empty for cartridges without a clock
+	};
+	
+	//True if the cartridge has a battery, so its RAM should be saved
+	bool HasBattery();
+	
+	//Copies the cartridge RAM written since the last call into snapshot, or all of it if snapshot is empty, and the clock.
+	//Returns true if any RAM was written since the last call. Must be called on the CPU thread.
+	bool UpdateSaveSnapshot(SaveSnapshot& snapshot);
+	
+	//Compresses a snapshot to a temporary file next to path and renames it over path. Can be called from any thread.
+	bool WriteSave(const std::string& path, const SaveSnapshot& snapshot);
+	
+	//Writes the cartridge header, memory, bank registers, clock and transfer progress to a save state
+	void SaveState(state::Writer& writer);
+	
+	//Returns false without changing anything if the state was saved with another cartridge
+	bool LoadState(state::Reader& reader);
 	
 	void LoadRAM(const std::string& path);
+	
+	//Writes all of the cartridge RAM to a save file right away
 	void SaveRAM(const std::string& path);
 	
 	inline uint16_t Read16(uint16_t address)
 	{
+		const uint8_t* page = memory->readPages[address >> 8];
+		if (page != nullptr && (address & 0xFF) != 0xFF)
+			return (uint16_t)page[address & 0xFF] | ((uint16_t)page[(address & 0xFF) + 1] << 8);
 		return (uint16_t)Read(address) | ((uint16_t)Read(address + 1) << 8);
 	}
 	
@@ -0,0 +1,44 @@
+#include "Profiler.hpp"
+#include "CPU.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+
+namespace profiler
+{
+	bool enabled;
+	
+	thread_local OpcodeStats* opcodeStats;
+	
+	void PrintReport(std::ostream& stream, int maxLines)
+	{
+		int opcodes[512];
+		uint64_t totalCycles = 0;
+		uint64_t totalTicks = 0;
+		int numOpcodes = 0;
+		for (int i = 0; i < 512; i++)
+		{
+			if (opcodeStats[i].count == 0)
+				continue;
+			opcodes[numOpcodes++] = i;
+			totalCycles += opcodeStats[i].cycles;
+			totalTicks += opcodeStats[i].ticks;
+		}
+		
+		std::sort(opcodes, opcodes + numOpcodes, [] (int a, int b) { return opcodeStats[a].ticks > opcodeStats[b].ticks; });
+		
+		stream << "   op " << std::left << std::setw(22) << "name" << std::right << std::setw(12) << "count"
+			<< std::setw(12) << "cycles" << std::setw(10) << "ticks/op" << std::setw(7) << "time" << "\n";
+		for (int i = 0; i < std::min(numOpcodes, maxLines); i++)
+		{
+			const OpcodeStats& stats = opcodeStats[opcodes[i]];
+			stream << (opcodes[i] >= 0x100 ? "cb " : "   ") << std::hex << std::setfill('0') << std::setw(2) << (opcodes[i] & 0xFF)
+				<< std::dec << std::setfill(' ') << " " << std::left << std::setw(22) << InstructionName(opcodes[i]) << std::right
+				<< std::setw(12) << stats.count
+				<< std::setw(11) << std::fixed << std::setprecision(1) << (100.0 * stats.cycles / std::max(totalCycles, (uint64_t)1)) << "%"
+				<< std::setw(10) << (stats.ticks / (double)stats.count)
+				<< std::setw(6) << (100.0 * stats.ticks / std::max(totalTicks, (uint64_t)1)) << "%\n";
+		}
+	}
+}
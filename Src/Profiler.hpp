@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+#include <iosfwd>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <chrono>
+#endif
+
+//Counts executions, emulated cycles and host time per opcode while enabled.
+//Runs as part of the CPU's debug hooks, so it costs nothing when disabled.
+namespace profiler
+{
+	extern bool enabled;
+	
+	struct OpcodeStats
+	{
+		uint64_t count;
+		uint64_t cycles;
+		uint64_t ticks;
+	};
+	
+	//The 512 counters of the machine bound to the calling thread, see Machine::Bind.
+	//Indexed by opcode, CB prefixed opcodes are at 0x100 + the second byte.
+	extern thread_local OpcodeStats* opcodeStats;
+	
+	//Host timestamp in TSC ticks, or nanoseconds where there is no TSC
+	inline uint64_t ReadTimestamp()
+	{
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+		return __rdtsc();
+#else
+		return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+	}
+	
+	//Prints opcodes sorted by host time, limited to maxLines
+	void PrintReport(std::ostream& stream, int maxLines = 512);
+}
@@ -3,7 +3,8 @@
 #include "Memory.hpp"
 #include "Input.hpp"
 #include "CPU.hpp"
-#include "../Font.h"
+#include "Profiler.hpp"
+#include "../../Font.h"
 
 #include <sstream>
 #include <iomanip>
@@ -43,7 +44,7 @@ void DebugPane::UpdateTilesTexture(SDL_Texture* texture, TilePalette palette)
 	int pitch;
 	SDL_LockTexture(texture, nullptr, &pixels, &pitch);
 	
-	const gpu::Tile* tiles = reinterpret_cast<gpu::Tile*>(mem::vram);
+	//Shows the tiles of bank 0 followed by bank 1, rows past the last tile are left blank
 	for (int ty = 0; ty < 48; ty++)
 	{
 		for (int py = 0; py < 8; py++)
@@ -55,7 +56,9 @@ void DebugPane::UpdateTilesTexture(SDL_Texture* texture, TilePalette palette)
 				for (int px = 0; px < 8; px++)
 				{
 					const int dstX = tx * 8 + px;
-					rowBegin[dstX] = gpu::ToColor32(gpu::ResolveColorMonochrome(tiles[ty * 32 + tx].At(px, py), PALETTE));
+					const int tile = ty * 32 + tx;
+					const uint8_t color = tile < 2 * 384 ? gpu::shared->renderer.decodedTiles[tile / 384][tile % 384][0].pixels[py][px] : 0;
+					rowBegin[dstX] = gpu::ToColor32(gpu::ResolveColorMonochrome(color, PALETTE));
 				}
 			}
 		}
@@ -84,31 +87,32 @@ void DebugPane::Draw(SDL_Renderer* renderer)
 	SDL_Rect tilesDst = { START_X, 0, 32 * 8, 48 * 8 };
 	SDL_RenderCopy(renderer, m_tilesTexture, nullptr, &tilesDst);
 	
-	gpu::RegisterState gpuReg;
+	MachineState machine;
 	{
-		std::lock_guard<std::mutex> lock(gpu::regMutex);
-		gpuReg = gpu::reg;
+		std::lock_guard<std::mutex> lock(m_machineStateMutex);
+		machine = m_machineState;
 	}
+	const gpu::RegisterState& gpuReg = machine.gpuReg;
+	m_captureRequested = true;
+	const CPU& cpuRegs = machine.cpu;
 	
 	const uint32_t buttonMask = GetButtonMask();
 	
-	const uint32_t mbcNames[] = { 1, 2, 5 };
-	
 	const uint32_t regValues[] =
 	{
 		gpuReg.lyc, gpuReg.lcdc,
 		gpuReg.scx, gpuReg.scy,
 		gpuReg.wx, gpuReg.wy,
 		gpuReg.obp0, gpuReg.obp1,
-		gpuReg.bgp, ioReg[IOREG_TIMA],
-		ioReg[IOREG_TMA], ioReg[IOREG_TAC],
-		cpu.intEnableReg, cpu.intEnableMaster,
-		buttonMask, cpu.halted,
-		cgbMode, mbcNames[(int)mem::activeMBC],
-		cpu.reg8[REG_A], cpu.reg8[REG_F],
-		cpu.reg8[REG_B], cpu.reg8[REG_C],
-		cpu.reg8[REG_D], cpu.reg8[REG_E],
-		cpu.reg8[REG_H], cpu.reg8[REG_L]
+		gpuReg.bgp, machine.tima,
+		machine.tma, machine.tac,
+		cpuRegs.intEnableReg, cpuRegs.intEnableMaster,
+		buttonMask, cpuRegs.halted,
+		machine.cgbMode, machine.mbc,
+		cpuRegs.reg8[REG_A], machine.flags,
+		cpuRegs.reg8[REG_B], cpuRegs.reg8[REG_C],
+		cpuRegs.reg8[REG_D], cpuRegs.reg8[REG_E],
+		cpuRegs.reg8[REG_H], cpuRegs.reg8[REG_L]
 	};
 	
 	const char* regNames[] = 
@@ -148,11 +152,13 @@ void DebugPane::Draw(SDL_Renderer* renderer)
 			textStream << "  ";
 	}
 	
-	textStream << " PC: " << std::setw(4) << cpu.pc << "\n";
-	textStream << " SP: " << std::setw(4) << cpu.sp << "\n\n";
-	textStream << "CPU: " << std::dec << std::fixed << std::setprecision(2) << (m_procTimeSum / (double)CLOCK_RATE) << "/" << NSPerClockCycle() << " ns\n";
+	textStream << " PC: " << std::setw(4) << cpuRegs.pc << "\n";
+	textStream << " SP: " << std::setw(4) << cpuRegs.sp << "\n\n";
+	textStream << "CPU: " << std::dec << std::fixed << std::setprecision(2) << (m_procTimeSum / (double)CLOCK_RATE) << "/" << (1000000000LL >> cpuRegs.doubleSpeed) / CLOCK_RATE << " ns\n";
 	textStream << "GPU: " << std::dec << std::fixed << std::setprecision(2) << (m_gpuTime / 1E6) << " ms\n";
 	textStream << "FPS: " << std::dec << m_fps << " Hz";
+	if (m_framesPerDraw > 1)
+		textStream << " x" << m_framesPerDraw;
 	
 	std::string textStr = textStream.str();
 	
@@ -165,25 +171,66 @@ void DebugPane::Draw(SDL_Renderer* renderer)
 	SDL_DestroyTexture(textTexture);
 	SDL_FreeSurface(textSurface);
 	
+	//Renders the most expensive opcodes below the tiles
+	if (profiler::enabled)
+	{
+		SDL_Surface* profileSurface = TTF_RenderUTF8_Blended_Wrapped(m_font12, machine.profileReport.c_str(), textColor, WIDTH - BORDER_WIDTH);
+		SDL_Texture* profileTexture = SDL_CreateTextureFromSurface(renderer, profileSurface);
+		
+		SDL_Rect profileDst = { START_X, tilesDst.h + 4, profileSurface->w, profileSurface->h };
+		SDL_RenderCopy(renderer, profileTexture, nullptr, &profileDst);
+		
+		SDL_DestroyTexture(profileTexture);
+		SDL_FreeSurface(profileSurface);
+	}
+	
 	if (m_spriteOverlayEnabled)
 	{
 		DrawSpriteOverlay(renderer);
 	}
 }
 
+void DebugPane::CaptureMachineState()
+{
+	if (!m_captureRequested.exchange(false))
+		return;
+	
+	const uint32_t mbcNames[] = { 0, 1, 2, 3, 5 };
+	
+	MachineState machine;
+	machine.cpu = *cpu;
+	machine.gpuReg = gpu::ppu->reg;
+	machine.flags = GetFlags(*cpu);
+	machine.tima = mem::memory->ioReg[IOREG_TIMA];
+	machine.tma = mem::memory->ioReg[IOREG_TMA];
+	machine.tac = mem::memory->ioReg[IOREG_TAC];
+	machine.cgbMode = mem::memory->cgbMode;
+	machine.mbc = mbcNames[(int)mem::memory->activeMBC];
+	if (profiler::enabled)
+	{
+		std::ostringstream profileStream;
+		profiler::PrintReport(profileStream, 10);
+		machine.profileReport = profileStream.str();
+	}
+	
+	std::lock_guard<std::mutex> lock(m_machineStateMutex);
+	m_machineState = std::move(machine);
+}
+
 void DebugPane::DrawSpriteOverlay(SDL_Renderer* renderer) const
 {
 	const SDL_Color backColor = { 87, 16, 7, 200 };
 	const SDL_Color textColor = { 250, 150, 150, 255 };
+	const uint8_t* prevOAM = gpu::shared->renderer.prevOAM;
 	
 	for (int i = 0; i < 40; i++)
 	{
-		int spy = (int)gpu::prevOAM[i * 4 + 0] - 16;
-		int spx = (int)gpu::prevOAM[i * 4 + 1] - 8;
+		int spy = (int)prevOAM[i * 4 + 0] - 16;
+		int spx = (int)prevOAM[i * 4 + 1] - 8;
 		if (spx > -8 && spx < RES_X && spy > -16 && spy < RES_Y)
 		{
-			uint8_t tile = gpu::prevOAM[i * 4 + 2];
-			uint8_t flags = gpu::prevOAM[i * 4 + 3];
+			uint8_t tile = prevOAM[i * 4 + 2];
+			uint8_t flags = prevOAM[i * 4 + 3];
 			
 			SDL_Rect spriteRect = { spx * PIXEL_SCALE, spy * PIXEL_SCALE, 8 * PIXEL_SCALE, 8 * PIXEL_SCALE };
 			
@@ -3,6 +3,11 @@
 #include <SDL.h>
 #include <SDL_ttf.h>
 #include <atomic>
+#include <mutex>
+#include <string>
+
+#include "CPU.hpp"
+#include "GPU.hpp"
 
 class DebugPane
 {
@@ -29,6 +34,14 @@ public:
 		m_fps = fps;
 	}
 	
+	void SetFramesPerDraw(int frames)
+	{
+		m_framesPerDraw = frames;
+	}
+	
+	//Copies the state shown by the pane if Draw has asked for it, called by the CPU thread between slices
+	void CaptureMachineState();
+	
 	static constexpr uint32_t BORDER_WIDTH = 8;
 	static constexpr uint32_t WIDTH = 512 + BORDER_WIDTH;
 	
@@ -52,10 +65,29 @@ private:
 	bool m_spriteOverlayEnabled = false;
 	
 	int m_fps = 0;
+	int m_framesPerDraw = 1;
 	
 	TTF_Font* m_font16;
 	TTF_Font* m_font12;
 	
 	uint64_t m_gpuTime = 0;
 	std::atomic_int64_t m_procTimeSum { 0 };
+	
+	//The CPU thread's state as of the last frame, the CPU and memory can only be read on that thread
+	struct MachineState
+	{
+		CPU cpu;
+		gpu::RegisterState gpuReg;
+		uint8_t flags;
+		uint8_t tima;
+		uint8_t tma;
+		uint8_t tac;
+		bool cgbMode;
+		uint32_t mbc;
+		std::string profileReport;
+	};
+	
+	std::mutex m_machineStateMutex;
+	MachineState m_machineState { };
+	std::atomic_bool m_captureRequested { true };
 };
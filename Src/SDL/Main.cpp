@@ -0,0 +1,359 @@
+#include <SDL.h>
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <thread>
+#include <fstream>
+#include <cstring>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+
+#include "CPU.hpp"
+#include "GPU.hpp"
+#include "Memory.hpp"
+#include "Input.hpp"
+#include "Common.hpp"
+#include "DebugPane.hpp"
+#include "Audio.hpp"
+#include "Emulator.hpp"
+#include "IdleLoop.hpp"
+#include "Profiler.hpp"
+#include "Trace.hpp"
+#include "Autosave.hpp"
+#include "SaveState.hpp"
+#include "Machine.hpp"
+#include "SDLSinks.hpp"
+
+using namespace std::chrono;
+
+//The CPU thread runs this many cycles between checks of the wall clock
+static constexpr int CYCLES_PER_SLICE = 1024;
+
+//How often the speed is measured while unthrottled, the sound is stretched to match the last measurement
+static constexpr int64_t SPEED_MEASURE_NS = 250000000;
+
+static constexpr double MIN_SPEED = 0.25;
+static constexpr double MAX_SPEED = 16;
+
+static std::atomic_bool shouldQuit;
+static bool speedDevPrint;
+
+//Runs unthrottled while set (-fast, toggled with tab), otherwise at speedMultiplier times the real hardware (-speed)
+static std::atomic_bool fastMode;
+static double speedMultiplier = 1;
+static bool benchmarkMode;
+static bool dumpTraceMode;
+
+//F5 saves the state to statePath and F8 loads it, on the machine's thread between slices
+static std::string statePath;
+static std::atomic_bool saveStateRequested;
+static std::atomic_bool loadStateRequested;
+
+void CPUThreadTarget()
+{
+	auto targetTime = std::chrono::high_resolution_clock::now();
+	bool wasFast = !fastMode;
+	
+	int64_t procTimeSum = 0;
+	int procTimeSumElapsedCycles = 0;
+	
+	//Emulated time against wall time, for the sound while unthrottled and for -s
+	int64_t measureBeginTime = NanoTime();
+	int64_t measureEmulatedNS = 0;
+	int64_t printBeginTime = measureBeginTime;
+	int64_t printEmulatedNS = 0;
+	
+	while (!shouldQuit)
+	{
+		const int64_t beginProcTime = NanoTime();
+		
+		const bool fast = fastMode;
+		if (fast != wasFast)
+		{
+			//Starts pacing from now, so the time spent unthrottled isn't made up for by sleeping or running ahead
+			targetTime = std::chrono::high_resolution_clock::now();
+			SetAudioSpeed(fast ? MAX_SPEED : speedMultiplier);
+			wasFast = fast;
+			measureBeginTime = NanoTime();
+			measureEmulatedNS = 0;
+		}
+		
+		int cycles = RunCycles(CYCLES_PER_SLICE);
+		autosave::Update();
+		
+		if (DebugPane::instance)
+			DebugPane::instance->CaptureMachineState();
+		
+		if (saveStateRequested.exchange(false) && !state::SaveToFile(statePath, true))
+			std::cerr << "Failed to save state to '" << statePath << "'\n";
+		if (loadStateRequested.exchange(false) && !state::LoadFromFile(statePath))
+			std::cerr << "Failed to load state from '" << statePath << "'\n";
+		
+		const int64_t emulatedNS = NSPerClockCycle() * cycles;
+		targetTime += std::chrono::nanoseconds((int64_t)(emulatedNS / speedMultiplier));
+		measureEmulatedNS += emulatedNS;
+		printEmulatedNS += emulatedNS;
+		procTimeSumElapsedCycles += cycles;
+		procTimeSum += NanoTime() - beginProcTime;
+		if (procTimeSumElapsedCycles >= CLOCK_RATE && DebugPane::instance)
+		{
+			DebugPane::instance->SetProcTimeSum(procTimeSum);
+			procTimeSum = 0;
+			procTimeSumElapsedCycles -= CLOCK_RATE;
+		}
+		
+		const int64_t time = NanoTime();
+		if (time - measureBeginTime >= SPEED_MEASURE_NS)
+		{
+			if (fast)
+				SetAudioSpeed(measureEmulatedNS / (double)(time - measureBeginTime));
+			measureBeginTime = time;
+			measureEmulatedNS = 0;
+		}
+		if (speedDevPrint && time - printBeginTime >= 1000000000LL)
+		{
+			std::cout << "Speed: " << std::fixed << std::setprecision(2) << printEmulatedNS / (double)(time - printBeginTime) << "x\n";
+			printBeginTime = time;
+			printEmulatedNS = 0;
+		}
+		
+		if (!fast)
+			std::this_thread::sleep_until(targetTime);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_GAMECONTROLLER | SDL_INIT_EVENTS | SDL_INIT_AUDIO))
+	{
+		std::cerr << SDL_GetError() << "\n";
+		return 1;
+	}
+	
+	if (TTF_Init())
+	{
+		std::cerr << TTF_GetError() << "\n";
+		return 1;
+	}
+	
+	//Parses arguments
+	const char* romPath = nullptr;
+	for (int i = 1; i < argc; i++)
+	{
+		std::string_view arg(argv[i]);
+		if (arg == "-d")
+			devMode = true;
+		else if (arg == "-v")
+			verboseMode = true;
+		else if (arg == "-s")
+			speedDevPrint = true;
+		else if (arg == "-fast")
+			fastMode = true;
+		else if (arg == "-speed" && i + 1 < argc)
+			speedMultiplier = std::clamp(strtod(argv[++i], nullptr), MIN_SPEED, MAX_SPEED);
+		else if (arg == "-bench")
+			benchmarkMode = true;
+		else if (arg == "-jit")
+			jitMode = true;
+		else if (arg == "-noidle")
+			idle::enabled = false;
+		else if (arg == "-profile")
+			profiler::enabled = true;
+		else if (arg == "-dumptrace")
+			dumpTraceMode = true;
+		else if (arg.size() > 2 && arg.substr(0, 2) == "-b")
+		{
+			//Either -bADDR, or -bBANK:ADDR for an address in a specific ROM bank. Checked after the
+			//other flags, since -bench would otherwise be read as a breakpoint at 0xE.
+			char* end;
+			long value = strtol(argv[i] + 2, &end, 16);
+			if (*end == ':')
+				AddBreakpoint(strtol(end + 1, nullptr, 16), value);
+			else
+				AddBreakpoint(value);
+		}
+		else if (argv[i][0] != '-')
+			romPath = argv[i];
+	}
+	
+	if (romPath == nullptr)
+	{
+		SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "No ROM Specified", "Expected path to ROM as command line argument.", nullptr);
+		return 2;
+	}
+	
+	//With -dumptrace the path is a trace file written by -v, which is printed instead of running a ROM
+	if (dumpTraceMode)
+	{
+		InitInstructionDebug();
+		return trace::Decode(romPath, std::cout) ? 0 : 2;
+	}
+	
+	if (verboseMode)
+		trace::outputPath = std::string(romPath) + ".trace";
+	statePath = std::string(romPath) + ".state";
+	
+	//The emulator runs on the machine's thread, this thread renders and handles input for it
+	Machine machine;
+	machine.Bind();
+	
+	//Loads the ROM
+	{
+		if (!std::ifstream(romPath, std::ios::binary))
+		{
+			std::string msg = std::string("Failed to open file for reading: '") + romPath + "'.";
+			SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Error Opening ROM", msg.c_str(), nullptr);
+			return 2;
+		}
+		if (!machine.Run([&] { return mem::Init(romPath); }))
+		{
+			SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Invalid ROM", "The specified ROM is not valid.", nullptr);
+			return 2;
+		}
+	}
+	
+	if (benchmarkMode)
+	{
+		machine.Run([&] { RunDispatchBenchmark(romPath); });
+		return 0;
+	}
+	
+	const std::string gameName = machine.Run([] { return mem::memory->gameName; });
+	std::string ramPath;
+	if (!gameName.empty())
+	{
+		char* prefPath = SDL_GetPrefPath("EAE", "GbEmu");
+		ramPath = prefPath;
+		for (char c : gameName)
+			ramPath += tolower(c);
+		ramPath.append(".egb");
+	}
+	
+	constexpr int WINDOW_H = RES_Y * PIXEL_SCALE;
+	const int windowWidth = RES_X * PIXEL_SCALE + (devMode ? DebugPane::WIDTH : 0);
+	
+	//Creates the window
+	std::string windowTitle = (gameName.empty() ? "EaeEmu" : gameName + " - EaeEmu");
+	SDL_Window* window = SDL_CreateWindow(windowTitle.c_str(), SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, windowWidth, WINDOW_H, SDL_WINDOW_SHOWN);
+	if (window == nullptr)
+	{
+		SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Error Creating Window", SDL_GetError(), nullptr);
+		return 1;
+	}
+	
+	SDL_Renderer* renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_PRESENTVSYNC | SDL_RENDERER_ACCELERATED);
+	SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, 0);
+	SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
+	
+	if (devMode)
+	{
+		DebugPane::instance = new DebugPane(renderer);
+	}
+	
+	gpu::Init();
+	InitInstructionDebug();
+	auto video = std::make_unique<SDLVideo>(renderer);
+	auto input = std::make_unique<SDLInput>();
+	auto audio = std::make_unique<SDLAudio>();
+	
+	machine.Run([&]
+	{
+		if (!ramPath.empty())
+		{
+			mem::LoadRAM(ramPath);
+			autosave::Start(ramPath);
+		}
+		InitCPU();
+		gpu::ReloadVideoMemory();
+	});
+	
+	machine.Post(CPUThreadTarget);
+	
+	while (!shouldQuit)
+	{
+		auto startTime = std::chrono::high_resolution_clock::now();
+		
+		SDL_Event event;
+		while (SDL_PollEvent(&event))
+		{
+			switch (event.type)
+			{
+			case SDL_QUIT:
+				shouldQuit = true;
+				break;
+			case SDL_KEYDOWN:
+				if (event.key.keysym.scancode == SDL_SCANCODE_F2 && verboseMode)
+					trace::flushRequested = true;
+				if (event.key.keysym.scancode == SDL_SCANCODE_F5)
+					saveStateRequested = true;
+				if (event.key.keysym.scancode == SDL_SCANCODE_F8)
+					loadStateRequested = true;
+				if (event.key.keysym.scancode == SDL_SCANCODE_TAB && !event.key.repeat)
+					fastMode = !fastMode;
+				break;
+			}
+			
+			if (DebugPane::instance)
+			{
+				DebugPane::instance->HandleEvent(event);
+			}
+			
+			input->HandleEvent(event);
+		}
+		
+		auto gpuBeginTime = std::chrono::high_resolution_clock::now();
+		
+		//When the machine runs faster than the display, only the last of the frames it finished is drawn
+		const int framesPerDraw = gpu::RunLatestFrame(*video);
+		
+		SDL_Rect copyDst = { 0, 0, RES_X * PIXEL_SCALE, RES_Y * PIXEL_SCALE };
+		SDL_RenderCopy(renderer, video->Texture(), nullptr, &copyDst);
+		
+		auto gpuEndTime = std::chrono::high_resolution_clock::now();
+		
+		if (DebugPane::instance)
+		{
+			DebugPane::instance->SetGPUTime((gpuEndTime - gpuBeginTime).count());
+			DebugPane::instance->SetFramesPerDraw(framesPerDraw);
+			DebugPane::instance->Draw(renderer);
+		}
+		
+		SDL_RenderPresent(renderer);
+		
+		std::this_thread::sleep_until(startTime + std::chrono::nanoseconds(1000000000LL / 60));
+		
+		auto frameTime = std::chrono::high_resolution_clock::now() - startTime;
+		if (DebugPane::instance)
+		{
+			DebugPane::instance->SetFPS(1000000000LL / frameTime.count());
+		}
+	}
+	
+	//The CPU thread could be waiting for the renderer to take lines, so it has to stop before the CPU thread can be joined
+	gpu::StopRenderer();
+	
+	//Runs once CPUThreadTarget has returned
+	machine.Run([]
+	{
+		if (devMode)
+		{
+			idle::PrintStats(std::cout);
+			PrintMemoryFootprint(std::cout);
+		}
+		if (profiler::enabled)
+			profiler::PrintReport(std::cout);
+		if (verboseMode)
+			trace::Flush();
+		
+		autosave::Stop();
+	});
+	
+	//The sinks use SDL, so they go before it shuts down
+	audio.reset();
+	video.reset();
+	
+	SDL_DestroyRenderer(renderer);
+	SDL_DestroyWindow(window);
+	SDL_Quit();
+}
@@ -0,0 +1,52 @@
+#include "SDLSinks.hpp"
+#include "GPU.hpp"
+#include "Audio.hpp"
+
+#include <iostream>
+
+SDLVideo::SDLVideo(SDL_Renderer* renderer)
+{
+	m_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING, RES_X, RES_Y);
+}
+
+SDLVideo::~SDLVideo()
+{
+	SDL_DestroyTexture(m_texture);
+}
+
+void SDLVideo::PresentFrame(const uint32_t* pixels)
+{
+	SDL_UpdateTexture(m_texture, nullptr, pixels, RES_X * sizeof(uint32_t));
+}
+
+static void AudioCallback(void* userdata, uint8_t* stream, int len)
+{
+	MixAudio(*static_cast<AudioQueue*>(userdata), reinterpret_cast<int8_t*>(stream), len);
+}
+
+SDLAudio::SDLAudio()
+{
+	SDL_AudioSpec audioSpec = { };
+	audioSpec.freq = AUDIO_OUTPUT_FREQ;
+	audioSpec.callback = AudioCallback;
+	audioSpec.userdata = audioQueue;
+	audioSpec.channels = 2;
+	audioSpec.samples = 4096;
+	audioSpec.format = AUDIO_S8;
+	
+	SDL_AudioSpec realAudioSpec;
+	m_deviceId = SDL_OpenAudioDevice(nullptr, 0, &audioSpec, &realAudioSpec, 0);
+	if (m_deviceId == 0 || realAudioSpec.freq != (int)AUDIO_OUTPUT_FREQ)
+	{
+		std::cout << SDL_GetError() << std::endl;
+		return;
+	}
+	
+	SDL_PauseAudioDevice(m_deviceId, 0);
+}
+
+SDLAudio::~SDLAudio()
+{
+	if (m_deviceId != 0)
+		SDL_CloseAudioDevice(m_deviceId);
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <SDL.h>
+
+#include "Sinks.hpp"
+
+//Copies each frame into a streaming texture, which the window is drawn from
+class SDLVideo : public VideoSink
+{
+public:
+	explicit SDLVideo(SDL_Renderer* renderer);
+	~SDLVideo();
+	
+	SDL_Texture* Texture() const { return m_texture; }
+	
+	void PresentFrame(const uint32_t* pixels) override;
+	
+private:
+	SDL_Texture* m_texture;
+};
+
+//Plays the bound machine's audio queue on the default device, mixing from SDL's audio thread
+class SDLAudio : public AudioSink
+{
+public:
+	SDLAudio();
+	~SDLAudio();
+	
+private:
+	SDL_AudioDeviceID m_deviceId = 0;
+};
+
+//Maps keyboard and game controller events to buttons on the bound machine
+class SDLInput : public InputSource
+{
+public:
+	SDLInput();
+	
+	void HandleEvent(SDL_Event& event);
+};
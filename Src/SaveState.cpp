@@ -0,0 +1,106 @@
+#include "SaveState.hpp"
+#include "Memory.hpp"
+#include "GPU.hpp"
+#include "Audio.hpp"
+#include "CPU.hpp"
+#include "Emulator.hpp"
+
+#include <fstream>
+#include <iterator>
+
+#define ZLIB_CONST
+#include <zlib.h>
+
+namespace state
+{
+	static constexpr char MAGIC[] = { (char)0xFF, 'E', 'G', 'S' };
+	
+	//Files written with compression start with this and the size of the state, followed by the zlib stream
+	static constexpr char COMPRESSED_MAGIC[] = { (char)0xFF, 'E', 'G', 'Z' };
+	
+	static void WriteState(Writer& writer)
+	{
+		writer.WriteBytes(MAGIC, sizeof(MAGIC));
+		writer.Write(VERSION);
+		mem::SaveState(writer);
+		SaveEmulatorState(writer);
+		gpu::SaveState(writer);
+		SaveAudioState(writer);
+	}
+	
+	void Save(std::vector<uint8_t>& data)
+	{
+		MaterializeFlags();
+		
+		data.clear();
+		Writer writer { &data, 0 };
+		WriteState(writer);
+	}
+	
+	bool Load(const uint8_t* data, size_t size)
+	{
+		//The layout is fixed for a cartridge, so a state of any other size than the current one is truncated or from another cartridge.
+		//This is checked up front since nothing can be undone once loading has started.
+		Writer sizeCounter { nullptr, 0 };
+		WriteState(sizeCounter);
+		if (size != sizeCounter.size || size < sizeof(MAGIC) + sizeof(VERSION) ||
+			std::memcmp(data, MAGIC, sizeof(MAGIC)) != 0 || std::memcmp(data + sizeof(MAGIC), &VERSION, sizeof(VERSION)) != 0)
+		{
+			return false;
+		}
+		
+		Reader reader { data, size, sizeof(MAGIC) + sizeof(VERSION), false };
+		if (!mem::LoadState(reader))
+			return false;
+		LoadEmulatorState(reader);
+		gpu::LoadState(reader);
+		LoadAudioState(reader);
+		return !reader.failed;
+	}
+	
+	bool SaveToFile(const std::string& path, bool compressed)
+	{
+		std::vector<uint8_t> data;
+		Save(data);
+		
+		std::ofstream stream(path, std::ios::binary);
+		if (compressed)
+		{
+			uLongf compressedSize = compressBound(data.size());
+			std::vector<uint8_t> compressedData(compressedSize);
+			if (compress2(compressedData.data(), &compressedSize, data.data(), data.size(), Z_BEST_SPEED) != Z_OK)
+				return false;
+			
+			const uint32_t size = (uint32_t)data.size();
+			stream.write(COMPRESSED_MAGIC, sizeof(COMPRESSED_MAGIC));
+			stream.write(reinterpret_cast<const char*>(&size), sizeof(size));
+			stream.write(reinterpret_cast<const char*>(compressedData.data()), compressedSize);
+		}
+		else
+		{
+			stream.write(reinterpret_cast<const char*>(data.data()), data.size());
+		}
+		
+		return (bool)stream;
+	}
+	
+	bool LoadFromFile(const std::string& path)
+	{
+		std::ifstream stream(path, std::ios::binary);
+		if (!stream)
+			return false;
+		std::vector<uint8_t> data((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+		
+		if (data.size() < sizeof(COMPRESSED_MAGIC) + sizeof(uint32_t) || std::memcmp(data.data(), COMPRESSED_MAGIC, sizeof(COMPRESSED_MAGIC)) != 0)
+			return Load(data.data(), data.size());
+		
+		uint32_t size;
+		std::memcpy(&size, data.data() + sizeof(COMPRESSED_MAGIC), sizeof(size));
+		std::vector<uint8_t> uncompressedData(size);
+		uLongf uncompressedSize = size;
+		const size_t headerSize = sizeof(COMPRESSED_MAGIC) + sizeof(size);
+		if (uncompress(uncompressedData.data(), &uncompressedSize, data.data() + headerSize, data.size() - headerSize) != Z_OK)
+			return false;
+		return Load(uncompressedData.data(), uncompressedSize);
+	}
+}
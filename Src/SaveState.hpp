@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <type_traits>
+
+//Snapshots of the complete machine. A state is the raw bytes of each module's variables in a fixed order,
+//behind a header with the format version and the cartridge it was taken from. States are only loaded by the
+//same build of the emulator for the same cartridge, so the layout doesn't need to be portable.
+namespace state
+{
+	//Bumped whenever anything is added to or removed from the state
+	constexpr uint32_t VERSION = 2;
+	
+	//Appends values to data, or only adds up their size if data is null
+	struct Writer
+	{
+		std::vector<uint8_t>* data;
+		size_t size;
+		
+		void WriteBytes(const void* src, size_t count)
+		{
+			size += count;
+			if (data == nullptr)
+				return;
+			const uint8_t* bytes = static_cast<const uint8_t*>(src);
+			data->insert(data->end(), bytes, bytes + count);
+		}
+		
+		template <typename T>
+		void Write(const T& value)
+		{
+			static_assert(std::is_trivially_copyable_v<T>, "Only plain data can be written as is");
+			WriteBytes(&value, sizeof(T));
+		}
+	};
+	
+	//Reads values in the order they were written. Reading past the end sets failed and leaves the destination as it was.
+	struct Reader
+	{
+		const uint8_t* data;
+		size_t size;
+		size_t pos;
+		bool failed;
+		
+		void ReadBytes(void* dst, size_t count)
+		{
+			if (failed || size - pos < count)
+			{
+				failed = true;
+				return;
+			}
+			std::memcpy(dst, data + pos, count);
+			pos += count;
+		}
+		
+		//Returns the next count bytes without copying them, or nullptr if there aren't that many left
+		const uint8_t* ReadInPlace(size_t count)
+		{
+			if (failed || size - pos < count)
+			{
+				failed = true;
+				return nullptr;
+			}
+			pos += count;
+			return data + pos - count;
+		}
+		
+		template <typename T>
+		void Read(T& value)
+		{
+			static_assert(std::is_trivially_copyable_v<T>, "Only plain data can be read as is");
+			ReadBytes(&value, sizeof(T));
+		}
+	};
+	
+	//Replaces data with the current state. Must be called on the CPU thread between calls to RunCycles.
+	void Save(std::vector<uint8_t>& data);
+	
+	//Returns false and leaves the machine as it was if the state is for another cartridge, another version, or truncated.
+	//Must be called on the CPU thread between calls to RunCycles.
+	bool Load(const uint8_t* data, size_t size);
+	
+	//Writes the state to a file, compressed with zlib if compress is set
+	bool SaveToFile(const std::string& path, bool compress);
+	
+	//Loads a state written by SaveToFile, compressed or not
+	bool LoadFromFile(const std::string& path);
+}
@@ -0,0 +1,55 @@
+#include "Sinks.hpp"
+#include "GPU.hpp"
+#include "Audio.hpp"
+#include "Input.hpp"
+
+RawVideoFile::RawVideoFile(const std::string& path)
+	: m_stream(path, std::ios::binary), m_bytes(RES_X * RES_Y * 4) { }
+
+void RawVideoFile::PresentFrame(const uint32_t* pixels)
+{
+	for (int i = 0; i < RES_X * RES_Y; i++)
+	{
+		m_bytes[i * 4 + 0] = (uint8_t)(pixels[i] >> 24);
+		m_bytes[i * 4 + 1] = (uint8_t)(pixels[i] >> 16);
+		m_bytes[i * 4 + 2] = (uint8_t)(pixels[i] >> 8);
+		m_bytes[i * 4 + 3] = (uint8_t)pixels[i];
+	}
+	m_stream.write(reinterpret_cast<const char*>(m_bytes.data()), m_bytes.size());
+}
+
+RawAudioFile::RawAudioFile(const std::string& path)
+	: m_stream(path, std::ios::binary) { }
+
+void RawAudioFile::Update(AudioQueue& queue)
+{
+	const uint32_t numSamples = QueuedAudioSamples(queue);
+	if (numSamples == 0)
+		return;
+	
+	m_samples.resize(numSamples * 2);
+	MixAudio(queue, m_samples.data(), (int)m_samples.size());
+	m_stream.write(reinterpret_cast<const char*>(m_samples.data()), m_samples.size());
+}
+
+RawInputFile::RawInputFile(const std::string& path)
+	: m_stream(path, std::ios::binary) { }
+
+void RawInputFile::Update()
+{
+	char held = 0;
+	if (!m_stream.get(held))
+		held = 0;
+	
+	const uint8_t changed = (uint8_t)held ^ m_heldButtons;
+	for (uint32_t btn = 0; btn < 8; btn++)
+	{
+		if (!(changed & (1 << btn)))
+			continue;
+		if (held & (1 << btn))
+			SetButtonDown(btn);
+		else
+			SetButtonUp(btn);
+	}
+	m_heldButtons = (uint8_t)held;
+}
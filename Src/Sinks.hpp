@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <fstream>
+#include <vector>
+
+struct AudioQueue;
+
+//Receives each frame drawn by gpu::RunOneFrame
+class VideoSink
+{
+public:
+	virtual ~VideoSink() = default;
+	
+	//Called on the render thread with RES_X * RES_Y pixels row by row, each packed as by gpu::ToColor32
+	virtual void PresentFrame(const uint32_t* pixels) = 0;
+};
+
+//Takes the machine's sound out of its AudioQueue with MixAudio, either from a thread of its own or in Update
+class AudioSink
+{
+public:
+	virtual ~AudioSink() = default;
+	
+	//Called on the machine's thread between slices
+	virtual void Update(AudioQueue& queue) { }
+};
+
+//Presses and releases buttons with SetButtonDown and SetButtonUp
+class InputSource
+{
+public:
+	virtual ~InputSource() = default;
+	
+	//Called once per frame on a thread bound to the machine
+	virtual void Update() { }
+};
+
+class NullVideoSink : public VideoSink
+{
+public:
+	void PresentFrame(const uint32_t* pixels) override { }
+};
+
+//Leaves the audio queue alone, it stops taking register states once it is full
+class NullAudioSink : public AudioSink { };
+
+class NullInputSource : public InputSource { };
+
+//Appends every frame to a file as raw 8 bit RGBA
+class RawVideoFile : public VideoSink
+{
+public:
+	explicit RawVideoFile(const std::string& path);
+	
+	bool IsOpen() const { return m_stream.is_open(); }
+	
+	void PresentFrame(const uint32_t* pixels) override;
+
+private:
+	std::ofstream m_stream;
+	std::vector<uint8_t> m_bytes;
+};
+
+//Appends everything queued to a file as raw signed 8 bit stereo at AUDIO_OUTPUT_FREQ, so it follows emulated time
+class RawAudioFile : public AudioSink
+{
+public:
+	explicit RawAudioFile(const std::string& path);
+	
+	bool IsOpen() const { return m_stream.is_open(); }
+	
+	void Update(AudioQueue& queue) override;
+
+private:
+	std::ofstream m_stream;
+	std::vector<int8_t> m_samples;
+};
+
+//Replays a file holding one byte per frame, with bit BTN_* set while the button is held. All buttons are released at the end.
+class RawInputFile : public InputSource
+{
+public:
+	explicit RawInputFile(const std::string& path);
+	
+	bool IsOpen() const { return m_stream.is_open(); }
+	
+	void Update() override;
+
+private:
+	std::ifstream m_stream;
+	uint8_t m_heldButtons = 0;
+};
@@ -0,0 +1,142 @@
+#include "Trace.hpp"
+#include "Emulator.hpp"
+#include "CPU.hpp"
+#include "Memory.hpp"
+
+#include <memory>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+
+namespace trace
+{
+	static constexpr char FILE_MAGIC[8] = { 'G', 'B', 'T', 'R', 'A', 'C', 'E', '1' };
+	
+	//32MB, about a second of emulated time
+	static constexpr size_t RING_SIZE = 1 << 20;
+	
+	thread_local Recorder* recorder;
+	
+	std::string outputPath = "gbemu.trace";
+	std::atomic_bool flushRequested;
+	
+	static Entry& NextEntry(EntryKind kind)
+	{
+		if (!recorder->ring)
+			recorder->ring.reset(new Entry[RING_SIZE]());
+		
+		Entry& entry = recorder->ring[recorder->numRecorded.load(std::memory_order_relaxed) % RING_SIZE];
+		entry.cycle = emulator->cycleCounter;
+		entry.pc = cpu->pc;
+		entry.romBank = cpu->pc >= 0x4000 && cpu->pc < 0x8000 ? mem::ActiveRomBank() : 0;
+		entry.sp = cpu->sp;
+		entry.kind = kind;
+		entry.ime = cpu->intEnableMaster;
+		entry.ie = cpu->intEnableReg;
+		entry.ifReg = mem::memory->ioReg[IOREG_IF];
+		std::memcpy(entry.reg8, cpu->reg8, sizeof(entry.reg8));
+		entry.reg8[REG_F] = GetFlags(*cpu);
+		return entry;
+	}
+	
+	void RecordInstruction()
+	{
+		Entry& entry = NextEntry(EntryKind::Instruction);
+		entry.length = InstructionLength(mem::Read(cpu->pc));
+		for (int i = 0; i < 3; i++)
+			entry.bytes[i] = i < entry.length ? mem::Read(cpu->pc + i) : 0;
+		recorder->numRecorded.fetch_add(1, std::memory_order_release);
+	}
+	
+	void RecordInterrupt(int index)
+	{
+		Entry& entry = NextEntry(EntryKind::Interrupt);
+		entry.length = 0;
+		entry.bytes[0] = (uint8_t)index;
+		entry.bytes[1] = entry.bytes[2] = 0;
+		recorder->numRecorded.fetch_add(1, std::memory_order_release);
+	}
+	
+	bool Flush()
+	{
+		//The ring is only allocated once something is recorded
+		const uint64_t end = recorder->numRecorded.load(std::memory_order_acquire);
+		if (end == 0)
+		{
+			std::cout << "No trace entries to write\n";
+			return true;
+		}
+		
+		std::ofstream stream(outputPath, std::ios::binary);
+		if (!stream)
+		{
+			std::cerr << "Failed to open trace file for writing: '" << outputPath << "'\n";
+			return false;
+		}
+		
+		const uint64_t begin = end > RING_SIZE ? end - RING_SIZE : 0;
+		const uint64_t count = end - begin;
+		
+		stream.write(FILE_MAGIC, sizeof(FILE_MAGIC));
+		stream.write(reinterpret_cast<const char*>(&count), sizeof(count));
+		
+		//The ring wraps at most once within the range
+		const size_t first = begin % RING_SIZE;
+		const size_t firstCount = std::min<size_t>(count, RING_SIZE - first);
+		stream.write(reinterpret_cast<const char*>(&recorder->ring[first]), firstCount * sizeof(Entry));
+		stream.write(reinterpret_cast<const char*>(&recorder->ring[0]), (count - firstCount) * sizeof(Entry));
+		
+		std::cout << "Wrote " << count << " trace entries to '" << outputPath << "'\n";
+		return true;
+	}
+	
+	bool Decode(const char* path, std::ostream& stream)
+	{
+		std::ifstream inStream(path, std::ios::binary);
+		char magic[sizeof(FILE_MAGIC)];
+		uint64_t count;
+		if (!inStream.read(magic, sizeof(magic)) || std::memcmp(magic, FILE_MAGIC, sizeof(magic)) != 0 ||
+			!inStream.read(reinterpret_cast<char*>(&count), sizeof(count)))
+		{
+			std::cerr << "Invalid trace file: '" << path << "'\n";
+			return false;
+		}
+		
+		stream << std::setfill('0') << std::hex;
+		
+		Entry entry;
+		for (uint64_t i = 0; i < count && inStream.read(reinterpret_cast<char*>(&entry), sizeof(entry)); i++)
+		{
+			stream << std::dec << std::setfill(' ') << std::setw(12) << entry.cycle << std::hex << std::setfill('0')
+				<< " [" << std::setw(2) << entry.romBank << ":" << std::setw(4) << entry.pc << "] ";
+			
+			std::string text;
+			if (entry.kind == EntryKind::Interrupt)
+			{
+				text = "INT " + std::to_string(entry.bytes[0]);
+			}
+			else
+			{
+				for (int b = 0; b < 3; b++)
+				{
+					char byteText[4];
+					snprintf(byteText, sizeof(byteText), b < entry.length ? "%02x " : "   ", entry.bytes[b]);
+					text += byteText;
+				}
+				text += InstructionName(entry.bytes[0] == 0xCB ? 0x100 | entry.bytes[1] : entry.bytes[0]);
+			}
+			
+			stream << std::left << std::setfill(' ') << std::setw(34) << text << std::right << std::setfill('0')
+				<< " A:" << std::setw(2) << +entry.reg8[REG_A] << " F:" << std::setw(2) << +entry.reg8[REG_F]
+				<< " B:" << std::setw(2) << +entry.reg8[REG_B] << " C:" << std::setw(2) << +entry.reg8[REG_C]
+				<< " D:" << std::setw(2) << +entry.reg8[REG_D] << " E:" << std::setw(2) << +entry.reg8[REG_E]
+				<< " H:" << std::setw(2) << +entry.reg8[REG_H] << " L:" << std::setw(2) << +entry.reg8[REG_L]
+				<< " SP:" << std::setw(4) << entry.sp
+				<< " IME:" << +entry.ime << " IE:" << std::setw(2) << +entry.ie << " IF:" << std::setw(2) << +entry.ifReg << "\n";
+		}
+		return true;
+	}
+}
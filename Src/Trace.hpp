@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <atomic>
+#include <memory>
+#include <iosfwd>
+
+//Binary instruction trace for -v. Every instruction and interrupt is recorded into a fixed size ring buffer,
+//which is written to a file on a breakpoint, when requested by the user and at exit.
+namespace trace
+{
+	enum class EntryKind : uint8_t
+	{
+		Instruction,
+		Interrupt
+	};
+	
+	struct Entry
+	{
+		uint64_t cycle;
+		uint16_t pc;
+		uint16_t romBank;  //Bank mapped at 0x4000 if pc is in 0x4000-0x7FFF, otherwise 0
+		uint16_t sp;
+		EntryKind kind;
+		uint8_t length;    //Instruction length in bytes
+		uint8_t bytes[3];  //The instruction's bytes, or the interrupt index
+		uint8_t ime;
+		uint8_t ie;
+		uint8_t ifReg;
+		uint8_t reg8[8];   //Indexed by REG_*, F is always up to date
+	};
+	
+	static_assert(sizeof(Entry) == 32, "Trace entries are written to files as is");
+	
+	//The trace of a machine. Only its CPU thread writes entries, the count is published once an entry is complete.
+	struct Recorder
+	{
+		//Allocated once something is recorded
+		std::unique_ptr<Entry[]> ring;
+		std::atomic_uint64_t numRecorded { 0 };
+	};
+	
+	//The recorder of the machine bound to the calling thread, see Machine::Bind
+	extern thread_local Recorder* recorder;
+	
+	//The trace is written here, set by Main to the ROM path with .trace appended
+	extern std::string outputPath;
+	
+	//Set from other threads to make the CPU thread flush the trace after the current slice
+	extern std::atomic_bool flushRequested;
+	
+	void RecordInstruction();
+	void RecordInterrupt(int index);
+	
+	//Writes the entries currently in the ring, oldest first, to outputPath
+	bool Flush();
+	
+	inline void FlushIfRequested()
+	{
+		if (flushRequested.load(std::memory_order_relaxed))
+		{
+			flushRequested = false;
+			Flush();
+		}
+	}
+	
+	//Prints a trace file written by Flush in readable form, requires InitInstructionDebug
+	bool Decode(const char* path, std::ostream& stream);
+}